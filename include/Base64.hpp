@@ -0,0 +1,101 @@
+//
+//  Base64.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/*
+
+ Base64:
+ Binary payloads can't travel in the text protocol as is, the delimiters would show up
+ in them. These encode into an existing string and decode straight into the destination
+ memory, so a chunk isn't copied on its way into a preallocated buffer.
+
+ */
+
+namespace mpe {
+
+//! Returns the number of characters needed to encode \a size bytes.
+inline size_t base64EncodedSize( size_t size )
+{
+	return ( ( size + 2 ) / 3 ) * 4;
+}
+
+//! Returns the number of bytes that \a encoded of length \a size decodes to.
+inline size_t base64DecodedSize( const char *encoded, size_t size )
+{
+	if( size < 4 )
+		return 0;
+	size_t padding = ( encoded[size - 1] == '=' ) + ( encoded[size - 2] == '=' );
+	return ( size / 4 ) * 3 - padding;
+}
+
+//! Appends the encoding of \a size bytes from \a data to \a out.
+inline void base64Encode( const uint8_t *data, size_t size, std::string &out )
+{
+	static const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	size_t start = out.size();
+	out.resize( start + base64EncodedSize( size ) );
+	char *dst = &out[start];
+	size_t i = 0;
+	for( ; i + 2 < size; i += 3 ) {
+		uint32_t triple = ( data[i] << 16 ) | ( data[i + 1] << 8 ) | data[i + 2];
+		*dst++ = kAlphabet[( triple >> 18 ) & 0x3F];
+		*dst++ = kAlphabet[( triple >> 12 ) & 0x3F];
+		*dst++ = kAlphabet[( triple >> 6 ) & 0x3F];
+		*dst++ = kAlphabet[triple & 0x3F];
+	}
+	if( i < size ) {
+		uint32_t triple = data[i] << 16;
+		if( i + 1 < size )
+			triple |= data[i + 1] << 8;
+		*dst++ = kAlphabet[( triple >> 18 ) & 0x3F];
+		*dst++ = kAlphabet[( triple >> 12 ) & 0x3F];
+		*dst++ = ( i + 1 < size ) ? kAlphabet[( triple >> 6 ) & 0x3F] : '=';
+		*dst++ = '=';
+	}
+}
+
+//! Decodes \a size characters from \a encoded into \a dst, which must hold base64DecodedSize() bytes.
+//! Returns the number of bytes written, or 0 if \a encoded isn't valid base64.
+inline size_t base64Decode( const char *encoded, size_t size, uint8_t *dst )
+{
+	static const struct DecodeTable {
+		DecodeTable()
+		{
+			for( auto & value : mValues )
+				value = 0xFF;
+			const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+			for( uint8_t i = 0; i < 64; ++i )
+				mValues[static_cast<uint8_t>( alphabet[i] )] = i;
+			mValues[static_cast<uint8_t>( '=' )] = 0;
+		}
+		uint8_t mValues[256];
+	} kTable;
+
+	if( size % 4 != 0 )
+		return 0;
+
+	size_t decodedSize = base64DecodedSize( encoded, size );
+	size_t written = 0;
+	for( size_t i = 0; i < size; i += 4 ) {
+		uint32_t quad = 0;
+		for( size_t j = 0; j < 4; ++j ) {
+			uint8_t value = kTable.mValues[static_cast<uint8_t>( encoded[i + j] )];
+			if( value == 0xFF )
+				return 0;
+			quad = ( quad << 6 ) | value;
+		}
+		for( int shift = 16; shift >= 0 && written < decodedSize; shift -= 8 ) {
+			dst[written++] = static_cast<uint8_t>( quad >> shift );
+		}
+	}
+	return written;
+}
+
+}
@@ -8,19 +8,47 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <deque>
+#include <map>
+#include <set>
+#include <random>
+#include <thread>
+#include <type_traits>
 
 #include "cinder/Rect.h"
 
 #include "ClientBase.hpp"
+#include "ClockSync.hpp"
+#include "DoubleBuffer.hpp"
+#include "FrameArena.hpp"
+#include "FrameInterpolation.hpp"
+#include "ReplicatedState.hpp"
+#include "StateHasher.hpp"
+#include "Trace.hpp"
 #include "TcpClient.h"
 
 namespace mpe {
 	
 using ClientRef				= std::shared_ptr<class Client>;
+
+//! How messages sent with the same coalescing key during a frame are combined.
+//! LATEST keeps the last one, ACCUMULATE adds up messages of comma separated numbers.
+enum class CoalesceMode { LATEST, ACCUMULATE };
+
 using UpdateFrameCallback	= std::function<void ( uint64_t )>;
 using ResetCallback			= std::function<void()>;
+using FrameHandoffCallback	= std::function<void()>;
 using DataMessageCallback	= std::function<void ( const std::string &, const uint32_t )>;
+using DataMessageBatchCallback = std::function<void ( const MessageRecord *, size_t )>;
+using StreamReader			= std::function<void ( uint8_t *, size_t, size_t )>;
+using SendProgressCallback	= std::function<void ( uint32_t, size_t, size_t )>;
+using StreamAllocator		= std::function<ci::BufferRef ( uint32_t, uint32_t, size_t )>;
+using StreamProgressCallback = std::function<void ( uint32_t, uint32_t, size_t, size_t )>;
+using StreamMessageCallback	= std::function<void ( const ci::BufferRef &, const uint32_t )>;
 using io_service_ref		= std::shared_ptr<asio::io_service>;
 	
 class Client : public ClientBase, public std::enable_shared_from_this<Client> {
@@ -37,11 +65,16 @@ public:
 	//! Stops the connection to the server.
 	virtual void	stop() override;
 	//! Returns whether the connection to the server is still open.
-	bool			isConnected() const override { return mIsConnected && mTcpSession->getSocket()->is_open(); }
+	bool			isConnected() const override { return mIsConnected && mTcpSession && mTcpSession->getSocket()->is_open(); }
 	//! Updates the client and processes all received messages.
 	virtual void	update() override;
 	
+	//! Points \a cam at the part of the master space the first viewport shows from \a zPosition, keeping its fov
+	//! and clip planes. The aspect ratio, orientation and lens shift are cached, like the matrices.
 	static void setupCamera( const ClientRef &client, ci::CameraPersp &cam, float zPosition );
+	//! Sets up \a cam for the viewport at \a viewportIndex, for clients that drive several windows.
+	static void setupCamera( const ClientRef &client, size_t viewportIndex, ci::CameraPersp &cam, float zPosition );
+	//! Returns the transform from master space to the pixels of the client's window.
 	static ci::mat4 getClientModelTransform( const ClientRef &client );
 	
 	// Communication with the server from this client below...
@@ -54,8 +87,140 @@ public:
 	void			sendMessage( const std::string &message ) override;
 	//! Sends \a message as a data message, which will only be broadcast to clients in \a clientIds.
 	void			sendMessage( const std::string &message, const std::vector<uint32_t> &clientIds ) override;
+	//! Sends \a message as a data message that only needs its latest value delivered. Messages with the same
+	//! \a coalesceKey are combined according to \a mode, on this client until the next update and on the server
+	//! until the next frame, so high rate input doesn't pile up. Receivers get them as regular data messages.
+	void			sendCoalescedMessage( const std::string &message, const std::string &coalesceKey, CoalesceMode mode = CoalesceMode::LATEST );
+	//! Sends \a message as a data message for the clients whose visible rect intersects \a bounds, in master space.
+	//! Clients without a viewport, like async controllers, receive it regardless. Falls back to a broadcast if the
+	//! server doesn't route by area of interest. Region messages always go on the control lane.
+	void			sendMessage( const std::string &message, const ci::Rectf &bounds );
+	//! Subscribes to \a topic. Messages published to it arrive as regular data messages, even if this is an async
+	//! client that doesn't receive broadcasts. Subscriptions are kept and renewed when the client reconnects.
+	void			subscribe( const std::string &topic );
+	//! Stops receiving messages published to \a topic.
+	void			unsubscribe( const std::string &topic );
+	//! Returns the topics this client is subscribed to.
+	const std::set<std::string>& getSubscriptions() const { return mTopics; }
+	//! Sends \a message to the clients subscribed to \a topic. Falls back to a broadcast if the server has no topics.
+	void			publish( const std::string &topic, const std::string &message );
+	//! Returns whether the server routes published messages by topic.
+	bool			isTopicsNegotiated() const { return mTopicsNegotiated; }
+	//! Sets whether the client reconnects with a growing, jittered delay when the connection drops. On by default, the
+	//! "reconnect" setting turns it off. The server keeps a client's session for a while, so when it comes back in time
+	//! it gets the frames it missed and the server gets the messages it missed, instead of the wall being reset.
+	void			setAutoReconnect( bool autoReconnect ) { mAutoReconnect = autoReconnect; mShouldReconnect = autoReconnect; }
+	bool			isAutoReconnecting() const { return mAutoReconnect; }
+	//! Returns whether the last connection resumed the session of the one before.
+	bool			isSessionResumed() const { return mSessionResumed; }
+	//! Returns whether the server answers clock pings and stamps frames with a presentation time.
+	bool			isClockNegotiated() const { return mClockNegotiated; }
+	//! Returns the estimate of the server clock, which is kept up to date with a ping every couple of seconds.
+	const ClockSync&	getClockSync() const { return mClockSync; }
+	//! Returns whether the current frame has a presentation time.
+	bool			hasPresentationTime() const { return mPresentationTime != 0 && mClockSync.isSynchronized(); }
+	//! Returns when the current frame should be presented, in local time. It's the same moment in the server's clock
+	//! on every screen, so releasing frames then leaves the error of the clock estimate as the skew between screens
+	//! instead of the network jitter. Returns now if the frame has no presentation time.
+	std::chrono::steady_clock::time_point	getPresentationTime() const;
+	//! Sleeps until the presentation time of the current frame, at most a second. Call it right before drawing, or set
+	//! "waitForPresentation" in the settings to wait in update, before the UpdateFrameCallback.
+	void			waitForPresentationTime() const;
+	//! Returns the frame rate the server releases frames at, or 0 if it doesn't say. A server with --adaptive lowers
+	//! it to a divisor of the display refresh when the wall can't keep up, so animations should advance by
+	//! 1 / getTargetFrameRate() per frame rather than assume a fixed rate.
+	float			getTargetFrameRate() const { return mTargetFrameRate; }
+	//! Returns whether the server collects traces, see Trace.hpp. Only offered if tracing was on when connecting.
+	bool			isTraceNegotiated() const { return mTraceNegotiated; }
+	//! Asks the server to collect the trace of every client and write it out.
+	void			requestTrace();
+	//! The hash of the app's state that doneRendering() sends with the frame, see StateHasher.hpp. Sync clients that keep
+	//! it up to date as their state changes get the first frame they diverged in reported by the server.
+	StateHasher&	getStateHasher() { return mStateHasher; }
+	//! Returns whether the server compares state hashes.
+	bool			isStateHashNegotiated() const { return mStateHashNegotiated; }
+	//! Registers \a handler, with signature void ( const T &, uint32_t fromClientId ), for values sent with send<T>() on
+	//! \a channelId. T is sent by memcpy, so it has to be trivially copyable and laid out the same on every client, and
+	//! every client has to register it with the same \a channelId. Handlers are called while the frame is parsed, before
+	//! the UpdateFrameCallback, and their messages don't reach the DataMessageCallback.
+	template<typename T>
+	void registerChannel( uint16_t channelId, const std::function<void ( const T &, uint32_t )> &handler )
+	{
+		static_assert( std::is_trivially_copyable<T>::value, "Channel types are sent by memcpy." );
+		registerChannel( channelId, channelType<T>(), sizeof( T ), [handler]( const uint8_t *data, uint32_t fromClientId ) {
+			T value;
+			std::memcpy( &value, data, sizeof( T ) );
+			handler( value, fromClientId );
+		} );
+	}
+	//! Sends \a value on the channel registered for T, to \a clientIds or to all clients if empty.
+	template<typename T>
+	void send( const T &value, const std::vector<uint32_t> &clientIds = std::vector<uint32_t>() )
+	{
+		static_assert( std::is_trivially_copyable<T>::value, "Channel types are sent by memcpy." );
+		sendChannelMessage( channelType<T>(), &value, sizeof( T ), clientIds );
+	}
+	//! Sends \a value on the channel registered for T to the clients whose viewport touches \a bounds, like sendMessage.
+	template<typename T>
+	void send( const T &value, const ci::Rectf &bounds )
+	{
+		static_assert( std::is_trivially_copyable<T>::value, "Channel types are sent by memcpy." );
+		sendChannelMessage( channelType<T>(), &value, sizeof( T ), bounds );
+	}
+	//! Returns the state shared by every client. Values that are set show up on all clients, including
+	//! this one, right before the UpdateFrameCallback of the next frame the server releases.
+	ReplicatedState&		getState() { return mState; }
+	const ReplicatedState&	getState() const { return mState; }
+	//! Returns whether the server agreed to merge ReplicatedState deltas.
+	bool			isStateNegotiated() const { return mStateNegotiated; }
+	//! Keeps the previous frame's value of \a value, an app owned float or float vector, so draws at display rate
+	//! can interpolate it with getInterpolated(). See FrameInterpolation.hpp.
+	template<typename T>
+	void			registerInterpolated( T *value ) { mInterpolation.add( value ); }
+	void			unregisterInterpolated( const void *value ) { mInterpolation.remove( value ); }
+	//! Keeps the previous frame's value of \a key in getState(), for getInterpolatedState().
+	void			registerInterpolatedState( const std::string &key ) { mInterpolation.add( key, mState ); }
+	void			unregisterInterpolatedState( const std::string &key ) { mInterpolation.remove( key ); }
+	//! Returns how far the display is from the previous frame to the current one, 0 when a frame arrives and
+	//! 1 a frame interval later. Draws that mix the two frames by it move smoothly, a frame behind.
+	float			getInterpolationAlpha() const { return mInterpolation.getAlpha( ClockSync::now() ); }
+	//! Returns the registered \a value mixed from its value in the previous frame by getInterpolationAlpha().
+	template<typename T>
+	T				getInterpolated( const T *value ) const { return mInterpolation.get( value, getInterpolationAlpha() ); }
+	//! Returns the registered \a key of getState() mixed from the previous frame by getInterpolationAlpha().
+	template<typename T>
+	T				getInterpolatedState( const std::string &key, const T &defaultValue = T() ) const
+	{
+		return mInterpolation.get( mState, key, getInterpolationAlpha(), defaultValue );
+	}
+	//! Returns whether the server routes messages sent with bounds to the clients whose viewport they touch.
+	bool			isRegionRoutingNegotiated() const { return mRegionRoutingNegotiated; }
+	//! Returns whether the server agreed to compressed data messages. Until then messages are sent raw.
+	bool			isCompressionNegotiated() const { return mCompressionNegotiated; }
+	//! Returns whether the server accepted the bulk lane. Until then every message goes on the control lane.
+	bool			isBulkLaneReady() const { return mBulkLaneReady; }
+	//! Streams \a totalSize bytes to \a clientIds, or to all clients if empty, on the bulk lane. \a reader is called with
+	//! ( destination, offset, size ) for one chunk at a time, spread over several updates, so the payload never has to be
+	//! in memory as a whole. \a progress is called with ( streamId, bytesSent, totalSize ) after each chunk. Returns the stream id.
+	uint32_t		sendStream( size_t totalSize, const StreamReader &reader, const SendProgressCallback &progress = SendProgressCallback(),
+							    const std::vector<uint32_t> &clientIds = std::vector<uint32_t>() );
+	//! Streams the contents of \a buffer, which has to stay unchanged until the stream is sent.
+	uint32_t		sendStream( const ci::BufferRef &buffer, const SendProgressCallback &progress = SendProgressCallback(),
+							    const std::vector<uint32_t> &clientIds = std::vector<uint32_t>() );
 	//! Called by the Cinder App to announce that rendering is done. The MPE Server waits until all clients are doneRendering before it sends out an order to go to the next frame. Only inform the server if this is a new frame. It's possible that a given frame is rendered multiple times if the server update is slower than the app loop.
 	void			doneRendering();
+	//! Announces that the window showing the viewport at \a viewportIndex is done rendering. The server is
+	//! informed once every viewport of this client has rendered the current frame.
+	void			doneRendering( size_t viewportIndex );
+	//! Runs the UpdateFrameCallback of each new frame on a worker thread while the render thread draws the previous
+	//! frame. Keep the simulation in a DoubleBuffer: step from front() into back() in the UpdateFrameCallback, draw
+	//! front() and swap() in the FrameHandoffCallback. doneRendering waits for the worker, so frames stay in lockstep
+	//! and every screen shows the same frame, one frame later. Sync clients only. The UpdateFrameCallback mustn't send
+	//! messages or touch the app's render thread state while it runs on the worker. ReplicatedState::set and erase are
+	//! locked, either thread can call them.
+	void			setPipelined( bool pipelined );
+	//! Returns whether the UpdateFrameCallback runs on the worker thread.
+	bool			isPipelined() const { return mIsPipelined; }
 	//! Returns a bool whether you should update to the next frame.
 	bool			shouldUpdate() { return mFrameIsReady; }
 	
@@ -74,8 +239,24 @@ public:
 	const ci::ivec2&	getMasterSize() const override { return mMasterSize; }
 	//! Returns the Viewport Dimensions.
 	const ci::Rectf&	getVisibleRect() const override { return mLocalViewportRect; }
-	//! Sets the Viewport Dimensions used for setting scissor and viewport.
-	void				setVisibleRect( const ci::Rectf & rect ) override { mLocalViewportRect = rect; }
+	//! Sets the Viewport Dimensions used for setting scissor and viewport. Several viewports are moved and scaled
+	//! with it, keeping their place within it.
+	void				setVisibleRect( const ci::Rectf & rect ) override;
+	//! Sets the size of the whole display in pixels. The settings file usually provides it.
+	void				setMasterSize( const ci::ivec2 &size ) { mMasterSize = size; updateTransforms(); }
+	//! Returns the transform from master space to the pixels of the viewport at \a viewportIndex, for drawing in 2D
+	//! after gl::setMatricesWindow( getViewportRect( viewportIndex ).getSize() ). Cached, like the view and projection.
+	const ci::mat4&		getModelMatrix( size_t viewportIndex = 0 ) const { return mTransforms.at( viewportIndex ).mModel; }
+	//! Returns the view of a perspective camera looking at the master space, with y pointing down. Shared by all viewports.
+	const ci::mat4&		getViewMatrix( size_t viewportIndex = 0 ) const { return mTransforms.at( viewportIndex ).mView; }
+	//! Returns the off axis projection that shows the part of the master space covered by the viewport at \a viewportIndex.
+	const ci::mat4&		getProjectionMatrix( size_t viewportIndex = 0 ) const { return mTransforms.at( viewportIndex ).mProjection; }
+	//! The batch variants from ClientBase, for arrays of points, circles and boxes.
+	using ClientBase::isOnScreen;
+	//! Returns the number of viewports this client renders, 1 unless the settings have a "viewports" array.
+	size_t				getNumViewports() const { return mViewports.empty() ? 1 : mViewports.size(); }
+	//! Returns the part of the master space the viewport at \a index shows. getVisibleRect() covers all of them.
+	const ci::Rectf&	getViewportRect( size_t index ) const { return mViewports.empty() ? mLocalViewportRect : mViewports.at( index ); }
 	//! Returns whether this point is inside your screen.
 	bool			isOnScreen( const ci::vec2 &pos ) override { return mLocalViewportRect.contains( pos ); }
 	//! Returns whether this point is inside your screen.
@@ -101,6 +282,12 @@ public:
 	template<class F, class T>
 	void setUpdateFrameCallback( F function, T* instance )
 	{ mUpdateCallback = std::bind( function, instance, std::placeholders::_1 ); }
+	//! Sets the function, with signature void(), to be called on the render thread in pipelined mode when a new frame
+	//! arrives, after the worker finished stepping the last one and before it steps the new one.
+	void setFrameHandoffCallback( const FrameHandoffCallback& handoffFunc ) { mFrameHandoffCallback = handoffFunc; }
+	template<class F, class T>
+	void setFrameHandoffCallback( F function, T* instance )
+	{ mFrameHandoffCallback = std::bind( function, instance ); }
 	//! Sets the function, with signature void(), to be called when the
 	//! server requests that all clients reset.
 	void setResetCallback( const ResetCallback& resetFunc ) { mResetCallback = resetFunc; }
@@ -113,11 +300,35 @@ public:
 	template<class F, class T>
 	void setDataMessageCallback( F function, T* instance )
 	{ mDataMessageCallback = std::bind( function, instance, std::placeholders::_1, std::placeholders::_2 ); }
+	//! Sets the function, with signature void ( const MessageRecord *, size_t ), to be called once per frame with
+	//! all of the frame's data messages. The payloads live in a per frame arena and are only valid until the next
+	//! frame arrives, copy what has to outlive it. Unlike the DataMessageCallback this doesn't allocate per message.
+	void setDataMessageBatchCallback( const DataMessageBatchCallback& batchFunc ) { mDataMessageBatchCallback = batchFunc; }
+	template<class F, class T>
+	void setDataMessageBatchCallback( F function, T* instance )
+	{ mDataMessageBatchCallback = std::bind( function, instance, std::placeholders::_1, std::placeholders::_2 ); }
+	//! Sets the function, with signature void ( const ci::BufferRef &, const uint32_t ), to be called
+	//! with a completed stream in the frame the server releases it.
+	void setStreamMessageCallback( const StreamMessageCallback& streamMessageFunc ) { mStreamMessageCallback = streamMessageFunc; }
+	template<class F, class T>
+	void setStreamMessageCallback( F function, T* instance )
+	{ mStreamMessageCallback = std::bind( function, instance, std::placeholders::_1, std::placeholders::_2 ); }
+	//! Sets the function, with signature void ( uint32_t fromClientId, uint32_t streamId, size_t received, size_t total ),
+	//! to be called from update when more of an incoming stream has arrived.
+	void setStreamProgressCallback( const StreamProgressCallback& streamProgressFunc ) { mStreamProgressCallback = streamProgressFunc; }
+	//! Sets the function, with signature ci::BufferRef ( uint32_t fromClientId, uint32_t streamId, size_t total ), that
+	//! provides the buffer an incoming stream is decoded into. Called from the io thread. Defaults to a new ci::Buffer.
+	void setStreamAllocator( const StreamAllocator& allocatorFunc ) { mStreamAllocator = allocatorFunc; }
 	
 	
 protected:
 	Client( const ci::DataSourceRef &jsonSettingsFile, asio::io_service &service, bool thread );
 	
+	static void setupCamera( const ci::ivec2 &masterSize, const ci::Rectf &viewportRect, ci::CameraPersp &cam, float zPosition );
+	
+	//! Recomputes the matrices of every viewport. Called when the visible rect or the master size change.
+	void updateTransforms();
+	
 	//! Load's settings from a json file from the constructor.
 	void loadSettings( const ci::DataSourceRef &settingsJsonFile );
 	
@@ -132,16 +343,93 @@ protected:
 	virtual void		onRead( const ci::BufferRef &buffer );
 	//! Internal Callback for TcpSession when TcpSession has finished a write
 	virtual void		onWrite( size_t bytesTransferred );
+	//! Internal Callback for the bulk lane's TcpClient, which caches the session and sends the bulk lane handshake.
+	virtual void		onBulkConnect( TcpSessionRef session );
+	//! Internal Callback for the bulk lane's TcpSession when it has read something.
+	virtual void		onBulkRead( const ci::BufferRef &buffer );
 	
 	//! Called when we receive a resetCommand. Calls the ResetCallback if one is present.
 	void			receivedResetCommand() override;
 	//! Called when we receive a new render frame.
 	void			setCurrentRenderFrame( uint64_t frameNum ) override;
-	//! Called when we receive a data message. Calls the DataMessageCallback if one is present.
-	virtual void	receivedStringMessage( const std::string &dataMessage, uint32_t fromClientId ) override;
+	//! Called when the server answers the options sent with our client id.
+	void			receivedHandshake( const std::map<std::string, std::string> &options ) override;
+	//! Called when a frame carries a merged ReplicatedState delta. It's applied before the UpdateFrameCallback.
+	void			receivedStateDelta( const std::string &delta ) override;
+	//! Called when a frame carries the server time it should be presented at.
+	void			receivedPresentationTime( uint64_t serverTime ) override;
+	//! Called when the server answers a clock ping.
+	void			receivedClockSample( uint64_t sentTime, uint64_t serverTime ) override;
+	//! Called with the server's target frame rate, with every frame once pacing is negotiated.
+	void			receivedFrameRate( float fps ) override;
+	//! Called with the lines the server received on this connection, with every frame while the session can resume.
+	void			receivedLinesAcknowledged( uint64_t lines ) override;
+	//! Called when the server collects traces. Sends the events of every thread, on the server clock once it's synchronized.
+	void			receivedTraceRequest() override;
+	//! Pings the server for its clock, in a quick burst at first and then every couple of seconds.
+	void			sendClockPing();
+	//! Sends the messages combined by coalescing key since the last update. Called once per update.
+	void			sendCoalescedMessages();
+	//! Sends the changes made to mState since the last update. Called once per update.
+	void			sendStateDelta();
+	//! Replaces a clean message with its compressed form if the codec was negotiated and it's long enough.
+	void			compressMessage( std::string &sanitizedMessage );
+	//! Sends an already cleaned message, compressing it or moving it to the bulk lane depending on its size.
+	void			sendCleanMessage( std::string sanitizedMessage, const std::vector<uint32_t> &clientIds );
+	//! Sends an already cleaned message to the clients whose viewport touches \a bounds.
+	void			sendCleanMessage( std::string sanitizedMessage, const ci::Rectf &bounds );
+	
+	//! Calls a channel handler with the payload of a channel message. Payloads are checked against the registered size.
+	using ChannelHandler = std::function<void ( const uint8_t *, uint32_t )>;
+	//! Returns a dense index for each type used with registerChannel or send.
+	template<typename T>
+	static size_t	channelType() { static const size_t type = nextChannelType(); return type; }
+	static size_t	nextChannelType() { static size_t next = 0; return next++; }
+	void			registerChannel( uint16_t channelId, size_t type, size_t size, const ChannelHandler &handler );
+	void			sendChannelMessage( size_t type, const void *data, size_t size, const std::vector<uint32_t> &clientIds );
+	void			sendChannelMessage( size_t type, const void *data, size_t size, const ci::Rectf &bounds );
+	//! Decodes a channel message and looks its handler up in mChannels.
+	void			receivedChannelMessage( boost::string_ref dataMessage, uint32_t fromClientId );
+	
+	//! Called when we receive a data message. Copies it into mFrameArena, decompressing it if needed.
+	virtual void	receivedDataMessage( boost::string_ref dataMessage, uint32_t fromClientId ) override;
+	//! Hands the data messages of the frame that was just parsed to the callbacks.
+	void			dispatchFrameMessages();
+	//! Called when a frame references a message reassembled from the bulk lane.
+	void			receivedBulkMessage( uint32_t msgId, uint32_t fromClientId ) override;
+	//! Called from the io thread for every chunk received on the bulk lane.
+	void			receivedDataChunk( uint32_t fromClientId, uint32_t msgId, size_t offset, size_t total,
+									   const char *chunk, size_t chunkSize ) override;
+	//! Called from the io thread for every stream chunk received on the bulk lane.
+	void			receivedStreamChunk( uint32_t fromClientId, uint32_t streamId, size_t offset, size_t total,
+										 const char *encoded, size_t encodedSize ) override;
+	//! Called from the io thread when the server acknowledges the bulk lane.
+	void			bulkLaneAccepted() override { mBulkLaneReady = true; }
+	
+	//! Hands \a frame to the worker thread in pipelined mode.
+	void			startPipelinedUpdate( uint64_t frame );
+	//! Waits for the worker to finish the frame it's stepping, then sends what it set. Does nothing if it's idle.
+	void			finishPipelinedUpdate();
+	//! The worker thread's loop.
+	void			runPipeline();
+	
+	//! Queues \a message to be sent in chunks on the bulk lane.
+	void			queueBulkMessage( std::string message, const std::vector<uint32_t> &clientIds );
+	//! Writes at most mBulkFrameBudget bytes of queued bulk messages. Called once per update.
+	void			sendBulkChunks();
+	//! Returns whether every bulk message referenced by \a message has been reassembled.
+	bool			hasBulkPayloads( boost::string_ref message );
+	//! Calls the StreamProgressCallback for every incoming stream that grew since the last update.
+	void			reportStreamProgress();
 	
 	//! onConnect calls this when the TcpClient connects to the server.
 	void sendClientId();
+	//! Writes \a msg, one or more lines, to the control lane, and keeps its lines in case the session resumes.
+	void			write( std::string &msg );
+	//! Tries to connect again, and schedules the next try in case this one fails.
+	void			reconnect();
+	//! Sends the lines of the last connection the server didn't receive, the first \a received ones it did.
+	void			resendOutbox( size_t received );
 	
 	
 	// Member variables.
@@ -149,23 +437,184 @@ protected:
 	// Callbacks used to communicate with your app
 	UpdateFrameCallback				mUpdateCallback;
 	ResetCallback					mResetCallback;
+	FrameHandoffCallback			mFrameHandoffCallback;
 	DataMessageCallback				mDataMessageCallback;
+	DataMessageBatchCallback		mDataMessageBatchCallback;
+	StreamMessageCallback			mStreamMessageCallback;
+	StreamProgressCallback			mStreamProgressCallback;
+	StreamAllocator					mStreamAllocator;
 	cinder::signals::Connection		mAppUpdateConnection;
 	
 	// A connection to the server.
     TcpClientRef					mTcpClient;
 	TcpSessionRef					mTcpSession;
 	bool							mIsConnected;
+	
+	// Reconnecting. While the session can resume, mOutbox holds what was written since the connection was made, one
+	// entry per write(), until frames tell that the server received it. mResendOutbox holds what the connection before
+	// had left, until the handshake tells how much of it the server received. Lines are counted from the start of
+	// their connection, like the server does. The oldest writes beyond kMaxOutboxLines are dropped.
+	struct OutboxEntry {
+		std::string				mLines;
+		size_t					mFirstLine;
+		size_t					mLineCount;
+	};
+	bool							mAutoReconnect;			// settings
+	bool							mShouldReconnect;
+	std::atomic<bool>				mIsConnecting;
+	uint64_t						mNextReconnect;
+	uint64_t						mReconnectDelay;
+	std::minstd_rand				mReconnectRandom;
+	std::string						mResumeToken;
+	bool							mSessionResumed;
+	uint64_t						mLastFrameReceived;
+	std::mutex						mOutboxMutex;
+	std::atomic<bool>				mRecordOutbox;
+	std::atomic<bool>				mHandshakePending;
+	std::deque<OutboxEntry>			mOutbox;
+	size_t							mOutboxLines;
+	std::deque<OutboxEntry>			mResendOutbox;
+	size_t							mResendOutboxLines;
 	uint16_t                        mPort;					// settings
     std::string                     mHostname;				// settings
 	
+	// The bulk lane is a second connection that carries large data messages in chunks,
+	// so they can't hold up frame ticks and confirmations on the control lane.
+	// Streams are read chunk by chunk from mReader instead of mPayload.
+	struct OutgoingBulkMessage {
+		uint32_t				mId;
+		std::string				mPayload;
+		size_t					mOffset;
+		std::vector<uint32_t>	mClientIds;
+		StreamReader			mReader;
+		size_t					mTotal;
+		SendProgressCallback	mProgress;
+	};
+	// Failed ones are kept until their frame releases them, which then goes on without them.
+	struct IncomingBulkMessage {
+		std::string				mPayload;
+		size_t					mTotal = 0;
+		bool					mFailed = false;
+	};
+	struct IncomingStream {
+		ci::BufferRef			mBuffer;
+		size_t					mReceived = 0;
+		size_t					mReported = 0;
+		size_t					mTotal = 0;
+		bool					mFailed = false;
+	};
+	
+	TcpClientRef					mBulkTcpClient;
+	TcpSessionRef					mBulkSession;
+	std::atomic<bool>				mBulkLaneReady;
+	bool							mUseBulkLane;			// settings
+	size_t							mBulkThreshold;			// settings
+	size_t							mBulkChunkSize;			// settings
+	size_t							mBulkFrameBudget;		// settings
+	uint32_t						mNextBulkMessageId;
+	std::deque<OutgoingBulkMessage>	mBulkOutgoing;
+	std::map<std::pair<uint32_t, uint32_t>, IncomingBulkMessage> mBulkIncoming;
+	std::map<std::pair<uint32_t, uint32_t>, IncomingStream> mStreamIncoming;
+	std::vector<uint8_t>			mStreamScratch;
+	
+	// Typed channels, indexed by channel id and by channelType() so dispatch is a lookup.
+	struct Channel {
+		size_t					mSize = 0;
+		ChannelHandler			mHandler;
+	};
+	std::vector<Channel>			mChannels;
+	std::vector<int32_t>			mChannelIds;
+	std::vector<uint8_t>			mChannelScratch;
+	std::string						mChannelMessage;
+	
+	// Coalesced messages waiting for the end of the update, in the order their keys were first used.
+	struct CoalescedMessage {
+		std::string				mKey;
+		std::string				mMessage;
+		bool					mAccumulate;
+	};
+	std::vector<CoalescedMessage>	mCoalescedMessages;
+	
+	// Replicated state, mPendingStateDelta holds the frame's merged deltas until the frame is dispatched.
+	ReplicatedState					mState;
+	std::string						mPendingStateDelta;
+	bool							mStateNegotiated;
+	
+	// The previous frame of registered values, for clients that draw between frames.
+	FrameInterpolation				mInterpolation;
+	
+	// Whether the server knows our viewport and routes region messages.
+	bool							mRegionRoutingNegotiated;
+	
+	// Topics this client subscribed to, and whether the server routes by topic.
+	std::set<std::string>			mTopics;
+	bool							mTopicsNegotiated;
+	
+	// Clock sync. mClockArrivals holds the local time each clock ping answer was read, until it's parsed.
+	ClockSync						mClockSync;
+	std::deque<uint64_t>			mClockArrivals;
+	bool							mClockNegotiated;
+	uint64_t						mNextClockPing;
+	uint64_t						mPresentationTime;		// server clock, 0 if the frame has none
+	bool							mWaitForPresentation;	// settings
+	
+	// The frame rate the server paces frames at, 0 if it doesn't send it.
+	float							mTargetFrameRate;
+	
+	bool							mTraceNegotiated;
+	
+	// Sent with every confirmed frame once the app hashed something and the server compares them.
+	StateHasher						mStateHasher;
+	bool							mStateHashNegotiated;
+	
+	// Data messages at least mCompressionThreshold long are compressed once the server agrees to the codec.
+	bool							mOfferCompression;		// settings
+	bool							mCompressionNegotiated;
+	size_t							mCompressionThreshold;	// settings
+	std::vector<uint8_t>			mCompressScratch;
+	std::string						mCompressedMessage;
+	std::vector<uint8_t>			mDecompressScratch;
+	std::string						mDecompressedMessage;
+	
+	// Pipelined mode, mPipelineStarted is only used on the render thread.
+	bool							mIsPipelined;			// settings
+	bool							mPipelineStarted;
+	std::thread						mPipelineThread;
+	std::mutex						mPipelineMutex;
+	std::condition_variable			mPipelineCondition;
+	uint64_t						mPipelineFrame;
+	bool							mPipelineBusy;
+	bool							mPipelineQuit;
+	
 	// Threaded details
 	const bool						mIsThreaded;
 	std::shared_ptr<std::mutex>		mMessageMutex;
-	std::deque<std::string>			mMessages;
+	// Bytes read from the control lane, complete lines are parsed in place and erased by update.
+	std::string						mInbound;
+	
+	// The current frame's data messages, reset by setCurrentRenderFrame.
+	FrameArena						mFrameArena;
+	std::string						mDispatchMessage;
 	
 	//! Rendering details.
     ci::Rectf                       mLocalViewportRect;		// settings
+	std::vector<ci::Rectf>			mViewports;				// settings
+	std::vector<bool>				mViewportsDone;
+	uint64_t						mViewportsDoneFrame;
+	
+	// Cached per viewport, see updateTransforms.
+	struct Transforms {
+		ci::mat4				mModel = ci::mat4( 1 );
+		ci::mat4				mView = ci::mat4( 1 );
+		ci::mat4				mProjection = ci::mat4( 1 );
+		float					mAspectRatio = 1.0f;
+		ci::quat				mOrientation;
+		ci::vec2				mLensShift;
+	};
+	std::vector<Transforms>			mTransforms;
+	float							mCameraFov;				// settings
+	float							mCameraNear;			// settings
+	float							mCameraFar;				// settings
     ci::ivec2                       mMasterSize;			// settings
     uint64_t                        mLastFrameConfirmed;
 	
@@ -174,6 +623,8 @@ protected:
     uint32_t                        mClientID;				// settings
     bool                            mIsAsync;				// settings
     bool                            mAsyncReceivesData;		// settings
+    float                           mAsyncDeliveryRate;		// settings, 0 for every frame
+    bool                            mAsyncLatestOnly;		// settings
 	
 	
 };
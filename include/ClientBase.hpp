@@ -8,6 +8,7 @@
 #pragma once
 
 #include "MessageHandler.hpp"
+#include "Culling.hpp"
 
 /*
  
@@ -55,6 +56,14 @@ public:
     virtual bool                isOnScreen(const ci::vec2 & pos) = 0;
     virtual bool                isOnScreen(float x, float y, float w, float h) = 0;
     virtual bool                isOnScreen(const ci::Rectf & rect) = 0;
+    // Batch hit testing against the visible rect grown by margin, so objects crossing
+    // a seam between screens stay visible on both. See Culling.hpp.
+    // Writes the indices of the visible shapes and returns how many there are.
+    size_t                      isOnScreen(const CullBatch & batch, uint32_t * outIndices, float margin = 0) const
+    { return batch.cull( getVisibleRect(), outIndices, margin ); }
+    // Sets one bit per visible shape and returns how many there are.
+    size_t                      isOnScreen(const CullBatch & batch, uint64_t * outMask, float margin = 0) const
+    { return batch.cull( getVisibleRect(), outMask, margin ); }
 	
     // Connection
     virtual void                start() = 0;
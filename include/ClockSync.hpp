@@ -0,0 +1,112 @@
+//
+//  ClockSync.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+/*
+
+ ClockSync:
+ Estimates the server's clock from ping samples, the way NTP does. Each sample is the local
+ time a ping was sent, the server time it was answered at and the local time the answer
+ arrived. Assuming the network is symmetric, the server time was taken half way through the
+ round trip. Samples with the shortest round trip were delayed the least, so the estimate is
+ the best sample of the last few, and the drift between the two clocks comes from how that
+ estimate moves over several seconds.
+
+ All times are in microseconds. Local times come from std::chrono::steady_clock.
+
+ */
+
+namespace mpe {
+
+class ClockSync {
+public:
+
+	//! The local clock in microseconds.
+	static uint64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+	}
+
+	//! Adds a ping that was sent at local time \a sent, answered at \a serverTime and received at local time \a received.
+	void addSample( uint64_t sent, uint64_t serverTime, uint64_t received )
+	{
+		if( received < sent )
+			return;
+		Sample sample;
+		sample.mLocal = sent + ( received - sent ) / 2;
+		sample.mOffset = static_cast<int64_t>( serverTime - sample.mLocal );
+		sample.mRoundTrip = received - sent;
+		mSamples[mSampleCount++ % kWindow] = sample;
+
+		const Sample *best = mSamples;
+		size_t count = mSampleCount < kWindow ? mSampleCount : kWindow;
+		for( size_t i = 1; i < count; ++i ) {
+			if( mSamples[i].mRoundTrip < best->mRoundTrip )
+				best = &mSamples[i];
+		}
+		mEstimate = *best;
+
+		// The drift is the slope of the estimate over at least kDriftInterval, smoothed and kept to what clocks can do.
+		if( mSampleCount == 1 ) {
+			mDriftAnchor = mEstimate;
+		}
+		else if( mEstimate.mLocal >= mDriftAnchor.mLocal + kDriftInterval ) {
+			double slope = double( mEstimate.mOffset - mDriftAnchor.mOffset ) / double( mEstimate.mLocal - mDriftAnchor.mLocal );
+			slope = slope > kMaxDrift ? kMaxDrift : ( slope < -kMaxDrift ? -kMaxDrift : slope );
+			mDrift = mHasDrift ? mDrift * 0.75 + slope * 0.25 : slope;
+			mHasDrift = true;
+			mDriftAnchor = mEstimate;
+		}
+	}
+	//! Forgets every sample, e.g. after reconnecting to a different server.
+	void reset() { *this = ClockSync(); }
+
+	//! Returns whether there's an estimate yet.
+	bool		isSynchronized() const { return mSampleCount > 0; }
+	//! Returns how many samples were added.
+	size_t		getSampleCount() const { return mSampleCount; }
+	//! Returns the round trip of the sample the estimate is based on.
+	uint64_t	getRoundTrip() const { return mEstimate.mRoundTrip; }
+	//! Returns how many microseconds the server clock gains per local microsecond.
+	double		getDrift() const { return mDrift; }
+	//! Returns server time minus local time at local time \a local.
+	int64_t getOffset( uint64_t local ) const
+	{
+		return mEstimate.mOffset + static_cast<int64_t>( mDrift * ( double( local ) - double( mEstimate.mLocal ) ) );
+	}
+
+	//! Converts a local time to server time.
+	uint64_t toServer( uint64_t local ) const { return local + getOffset( local ); }
+	//! Converts a server time to local time.
+	uint64_t toLocal( uint64_t server ) const
+	{
+		// The offset barely changes over the difference, so evaluating it at the server time is close enough.
+		return server - getOffset( server - mEstimate.mOffset );
+	}
+
+private:
+	struct Sample {
+		uint64_t	mLocal = 0;
+		int64_t		mOffset = 0;
+		uint64_t	mRoundTrip = 0;
+	};
+
+	static const size_t		kWindow = 8;
+	static const uint64_t	kDriftInterval = 5000000;
+	static constexpr double	kMaxDrift = 0.0005;
+
+	Sample		mSamples[kWindow];
+	size_t		mSampleCount = 0;
+	Sample		mEstimate;
+	Sample		mDriftAnchor;
+	double		mDrift = 0;
+	bool		mHasDrift = false;
+};
+
+}
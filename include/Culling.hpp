@@ -0,0 +1,218 @@
+//
+//  Culling.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "cinder/Rect.h"
+#include "cinder/Vector.h"
+
+#if ! defined( MPE_NO_SIMD ) && defined( __AVX__ )
+	#define MPE_CULLING_AVX 1
+	#include <immintrin.h>
+#elif ! defined( MPE_NO_SIMD ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+	#define MPE_CULLING_SSE 1
+	#include <emmintrin.h>
+#endif
+
+#if defined( _MSC_VER )
+	#include <intrin.h>
+#endif
+
+/*
+
+ Culling:
+ Tests whole arrays of points, circles or axis aligned boxes against a rect, 4 or 8 at a
+ time depending on whether the build targets SSE2 or AVX. Define MPE_NO_SIMD to use the
+ scalar kernel. Every shape is reduced to its bounding box, so circles are tested
+ conservatively, which is what culling wants anyway.
+
+ CullBatch describes the input without copying it. Arrays of structs are read with a
+ stride, so a ci::vec2 array or a ci::Rectf array can be passed as is.
+
+ */
+
+namespace mpe {
+
+class CullBatch {
+public:
+
+	//! Points as separate x and y arrays.
+	static CullBatch points( const float *xs, const float *ys, size_t count )
+	{ return CullBatch( count, { xs, 1 }, { ys, 1 }, { xs, 1 }, { ys, 1 }, { nullptr, 0 } ); }
+	//! Points as an array of ci::vec2.
+	static CullBatch points( const ci::vec2 *points, size_t count )
+	{ return CullBatch( count, { &points->x, 2 }, { &points->y, 2 }, { &points->x, 2 }, { &points->y, 2 }, { nullptr, 0 } ); }
+	//! Circles as separate center and radius arrays.
+	static CullBatch circles( const float *xs, const float *ys, const float *radii, size_t count )
+	{ return CullBatch( count, { xs, 1 }, { ys, 1 }, { xs, 1 }, { ys, 1 }, { radii, 1 } ); }
+	//! Circles as an array of ci::vec3 holding x, y and the radius.
+	static CullBatch circles( const ci::vec3 *circles, size_t count )
+	{ return CullBatch( count, { &circles->x, 3 }, { &circles->y, 3 }, { &circles->x, 3 }, { &circles->y, 3 }, { &circles->z, 3 } ); }
+	//! Boxes as separate corner arrays.
+	static CullBatch rects( const float *x1s, const float *y1s, const float *x2s, const float *y2s, size_t count )
+	{ return CullBatch( count, { x1s, 1 }, { y1s, 1 }, { x2s, 1 }, { y2s, 1 }, { nullptr, 0 } ); }
+	//! Boxes as an array of ci::Rectf, which have to be canonical.
+	static CullBatch rects( const ci::Rectf *rects, size_t count )
+	{ return CullBatch( count, { &rects->x1, 4 }, { &rects->y1, 4 }, { &rects->x2, 4 }, { &rects->y2, 4 }, { nullptr, 0 } ); }
+
+	size_t	size() const { return mCount; }
+
+	//! Writes the indices of the shapes that touch \a rect, grown by \a margin on every side, to \a outIndices,
+	//! which must hold size() entries. Returns how many were written.
+	size_t cull( const ci::Rectf &rect, uint32_t *outIndices, float margin = 0 ) const
+	{
+		IndexEmitter emitter = { outIndices, 0 };
+		run( rect, margin, emitter );
+		return emitter.mCount;
+	}
+	//! Sets bit i % 64 of word i / 64 in \a outMask for every shape i that touches \a rect, grown by \a margin.
+	//! \a outMask must hold ( size() + 63 ) / 64 words. Returns how many bits were set.
+	size_t cull( const ci::Rectf &rect, uint64_t *outMask, float margin = 0 ) const
+	{
+		std::memset( outMask, 0, ( ( mCount + 63 ) / 64 ) * sizeof( uint64_t ) );
+		MaskEmitter emitter = { outMask, 0 };
+		run( rect, margin, emitter );
+		return emitter.mCount;
+	}
+
+private:
+	struct Stream {
+		const float		*mData;
+		size_t			mStride;
+	};
+
+	CullBatch( size_t count, Stream minX, Stream minY, Stream maxX, Stream maxY, Stream radius )
+	: mCount( count ), mMinX( minX ), mMinY( minY ), mMaxX( maxX ), mMaxY( maxY ), mRadius( radius )
+	{}
+
+	static int lowestBit( uint32_t bits )
+	{
+#if defined( _MSC_VER )
+		unsigned long index;
+		_BitScanForward( &index, bits );
+		return static_cast<int>( index );
+#else
+		return __builtin_ctz( bits );
+#endif
+	}
+
+	struct IndexEmitter {
+		uint32_t	*mIndices;
+		size_t		mCount;
+		void operator()( size_t base, uint32_t lanes )
+		{
+			for( ; lanes; lanes &= lanes - 1 )
+				mIndices[mCount++] = static_cast<uint32_t>( base + lowestBit( lanes ) );
+		}
+	};
+	struct MaskEmitter {
+		uint64_t	*mWords;
+		size_t		mCount;
+		void operator()( size_t base, uint32_t lanes )
+		{
+			// Blocks are 1, 4 or 8 wide and start at a multiple of their width, so they never straddle a word.
+			mWords[base / 64] |= static_cast<uint64_t>( lanes ) << ( base % 64 );
+			for( ; lanes; lanes &= lanes - 1 )
+				++mCount;
+		}
+	};
+
+	struct Scalar {
+		typedef float Float;
+		static const size_t kWidth = 1;
+		static Float set1( float v ) { return v; }
+		static Float load( const Stream &s, size_t i ) { return s.mData[i * s.mStride]; }
+		static Float add( Float a, Float b ) { return a + b; }
+		static Float sub( Float a, Float b ) { return a - b; }
+		static uint32_t touches( Float minX, Float minY, Float maxX, Float maxY, Float x1, Float y1, Float x2, Float y2 )
+		{ return ( maxX >= x1 && minX <= x2 && maxY >= y1 && minY <= y2 ) ? 1 : 0; }
+	};
+#if defined( MPE_CULLING_SSE )
+	struct Sse {
+		typedef __m128 Float;
+		static const size_t kWidth = 4;
+		static Float set1( float v ) { return _mm_set1_ps( v ); }
+		static Float load( const Stream &s, size_t i )
+		{
+			const float *p = s.mData + i * s.mStride;
+			if( s.mStride == 1 )
+				return _mm_loadu_ps( p );
+			return _mm_set_ps( p[3 * s.mStride], p[2 * s.mStride], p[s.mStride], p[0] );
+		}
+		static Float add( Float a, Float b ) { return _mm_add_ps( a, b ); }
+		static Float sub( Float a, Float b ) { return _mm_sub_ps( a, b ); }
+		static uint32_t touches( Float minX, Float minY, Float maxX, Float maxY, Float x1, Float y1, Float x2, Float y2 )
+		{
+			Float x = _mm_and_ps( _mm_cmpge_ps( maxX, x1 ), _mm_cmple_ps( minX, x2 ) );
+			Float y = _mm_and_ps( _mm_cmpge_ps( maxY, y1 ), _mm_cmple_ps( minY, y2 ) );
+			return static_cast<uint32_t>( _mm_movemask_ps( _mm_and_ps( x, y ) ) );
+		}
+	};
+	typedef Sse Simd;
+#elif defined( MPE_CULLING_AVX )
+	struct Avx {
+		typedef __m256 Float;
+		static const size_t kWidth = 8;
+		static Float set1( float v ) { return _mm256_set1_ps( v ); }
+		static Float load( const Stream &s, size_t i )
+		{
+			const float *p = s.mData + i * s.mStride;
+			if( s.mStride == 1 )
+				return _mm256_loadu_ps( p );
+			size_t n = s.mStride;
+			return _mm256_set_ps( p[7 * n], p[6 * n], p[5 * n], p[4 * n], p[3 * n], p[2 * n], p[n], p[0] );
+		}
+		static Float add( Float a, Float b ) { return _mm256_add_ps( a, b ); }
+		static Float sub( Float a, Float b ) { return _mm256_sub_ps( a, b ); }
+		static uint32_t touches( Float minX, Float minY, Float maxX, Float maxY, Float x1, Float y1, Float x2, Float y2 )
+		{
+			Float x = _mm256_and_ps( _mm256_cmp_ps( maxX, x1, _CMP_GE_OQ ), _mm256_cmp_ps( minX, x2, _CMP_LE_OQ ) );
+			Float y = _mm256_and_ps( _mm256_cmp_ps( maxY, y1, _CMP_GE_OQ ), _mm256_cmp_ps( minY, y2, _CMP_LE_OQ ) );
+			return static_cast<uint32_t>( _mm256_movemask_ps( _mm256_and_ps( x, y ) ) );
+		}
+	};
+	typedef Avx Simd;
+#else
+	typedef Scalar Simd;
+#endif
+
+	//! Tests shapes [begin, end) in blocks of W::kWidth, \a end - begin has to be a multiple of it.
+	template<typename W, typename Emitter>
+	void runBlocks( const ci::Rectf &rect, size_t begin, size_t end, Emitter &emit ) const
+	{
+		typename W::Float x1 = W::set1( rect.x1 ), y1 = W::set1( rect.y1 ), x2 = W::set1( rect.x2 ), y2 = W::set1( rect.y2 );
+		for( size_t i = begin; i < end; i += W::kWidth ) {
+			typename W::Float minX = W::load( mMinX, i ), minY = W::load( mMinY, i );
+			typename W::Float maxX = W::load( mMaxX, i ), maxY = W::load( mMaxY, i );
+			if( mRadius.mData ) {
+				typename W::Float r = W::load( mRadius, i );
+				minX = W::sub( minX, r );
+				minY = W::sub( minY, r );
+				maxX = W::add( maxX, r );
+				maxY = W::add( maxY, r );
+			}
+			uint32_t lanes = W::touches( minX, minY, maxX, maxY, x1, y1, x2, y2 );
+			if( lanes )
+				emit( i, lanes );
+		}
+	}
+
+	template<typename Emitter>
+	void run( const ci::Rectf &rect, float margin, Emitter &emit ) const
+	{
+		ci::Rectf grown( rect.x1 - margin, rect.y1 - margin, rect.x2 + margin, rect.y2 + margin );
+		size_t blocks = mCount - mCount % Simd::kWidth;
+		runBlocks<Simd>( grown, 0, blocks, emit );
+		runBlocks<Scalar>( grown, blocks, mCount, emit );
+	}
+
+	size_t	mCount;
+	Stream	mMinX, mMinY, mMaxX, mMaxY, mRadius;
+};
+
+}
@@ -0,0 +1,40 @@
+//
+//  DoubleBuffer.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <utility>
+
+/*
+
+ DoubleBuffer:
+ Two copies of an app's simulation state for pipelined clients. The UpdateFrameCallback runs
+ on the Client's worker and steps from front() into back(), while draw() reads front() on the
+ render thread. The FrameHandoffCallback calls swap() once the worker is idle, which makes
+ the newly stepped state the one that's drawn.
+
+ */
+
+namespace mpe {
+
+template<typename T>
+class DoubleBuffer {
+public:
+	DoubleBuffer() : mBack( 0 ) {}
+	explicit DoubleBuffer( const T &initial ) : mBack( 0 ) { mBuffers[0] = mBuffers[1] = initial; }
+
+	//! The state being stepped. Only touch it from the UpdateFrameCallback.
+	T&			back() { return mBuffers[mBack]; }
+	//! The state being drawn, and the input of the next step.
+	const T&	front() const { return mBuffers[1 - mBack]; }
+	//! Exchanges front and back. Call it from the FrameHandoffCallback.
+	void		swap() { mBack = 1 - mBack; }
+
+private:
+	T		mBuffers[2];
+	int		mBack;
+};
+
+}
@@ -0,0 +1,81 @@
+//
+//  FrameArena.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <boost/utility/string_ref.hpp>
+
+/*
+
+ FrameArena:
+ Holds the data messages of one frame back to back in a single block of memory. The Client
+ resets it when the next frame arrives, which keeps the capacity, so once the arena has grown
+ to the size of a busy frame receiving messages doesn't allocate anymore.
+
+ */
+
+namespace mpe {
+
+//! A data message as handed to the DataMessageBatchCallback. \a mPayload points into the
+//! FrameArena and is only valid until the next frame arrives.
+struct MessageRecord {
+	uint32_t			mFromClientId;
+	boost::string_ref	mPayload;
+};
+
+class FrameArena {
+public:
+
+	//! Copies \a payload from \a fromClientId to the end of the arena.
+	void push( uint32_t fromClientId, boost::string_ref payload )
+	{
+		size_t needed = mUsed + payload.size();
+		if( needed > mBytes.size() )
+			mBytes.resize( std::max( needed, mBytes.size() * 2 ) );
+		if( ! payload.empty() )
+			std::memcpy( mBytes.data() + mUsed, payload.data(), payload.size() );
+		mOffsets.push_back( mUsed );
+		mRecords.push_back( { fromClientId, boost::string_ref( mBytes.data() + mUsed, payload.size() ) } );
+		mUsed = needed;
+		mIsDirty = true;
+	}
+
+	//! Returns the records pushed since the last reset(). They stay valid until the next push() or reset().
+	const MessageRecord* data()
+	{
+		// Growing mBytes may have moved earlier payloads.
+		if( mIsDirty ) {
+			for( size_t i = 0; i < mRecords.size(); ++i )
+				mRecords[i].mPayload = boost::string_ref( mBytes.data() + mOffsets[i], mRecords[i].mPayload.size() );
+			mIsDirty = false;
+		}
+		return mRecords.data();
+	}
+	size_t	size() const { return mRecords.size(); }
+	bool	empty() const { return mRecords.empty(); }
+
+	//! Forgets every record but keeps the memory for the next frame.
+	void reset()
+	{
+		mUsed = 0;
+		mRecords.clear();
+		mOffsets.clear();
+		mIsDirty = false;
+	}
+
+private:
+	std::vector<char>			mBytes;
+	size_t						mUsed = 0;
+	std::vector<MessageRecord>	mRecords;
+	std::vector<size_t>			mOffsets;
+	bool						mIsDirty = false;
+};
+
+}
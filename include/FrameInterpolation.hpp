@@ -0,0 +1,167 @@
+//
+//  FrameInterpolation.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "cinder/Vector.h"
+
+#include "ReplicatedState.hpp"
+
+/*
+
+ FrameInterpolation:
+ Smooth motion for clients that draw faster than the wall releases frames, like async preview
+ windows. Values only change when a frame arrives, so drawn as they are they move in steps.
+ The Client keeps what registered values were in the frame before the current one and when
+ both frames arrived, and draws can mix the two:
+
+	mClient->registerInterpolated( &mBallPosition );
+	mClient->registerInterpolatedState( "cameraZoom" );
+	...
+	void MyApp::draw()
+	{
+		gl::drawSolidCircle( mClient->getInterpolated( &mBallPosition ), 10 );
+		float zoom = mClient->getInterpolatedState<float>( "cameraZoom" );
+	}
+
+ • Drawing lags up to a frame behind, that's what leaves something to interpolate towards.
+   The alpha is 0 when a frame arrives and reaches 1 one frame interval later.
+
+ • Frames are timed with their presentation time if the server sends one, otherwise when they
+   were parsed. The interval is averaged, so network jitter doesn't show as uneven motion.
+   Frames the Client parses in the same update, e.g. after a stall, are one step.
+
+ • App values are floats or float vectors the app changes while the frame is parsed, e.g. in
+   the DataMessageCallback. State keys are float, double or vector values of ReplicatedState.
+
+ • Nothing is sent, and clients that register nothing don't pay for it.
+
+ */
+
+namespace mpe {
+
+class FrameInterpolation {
+public:
+	FrameInterpolation() : mPreviousTime( 0 ), mCurrentTime( 0 ), mInterval( 0 ) {}
+
+	//! Keeps the value at \a value of the previous frame, until it's removed. It has to outlive that.
+	template<typename T>
+	void add( T *value )
+	{
+		static_assert( std::is_same<T, float>::value || std::is_same<T, ci::vec2>::value || std::is_same<T, ci::vec3>::value ||
+					   std::is_same<T, ci::vec4>::value, "Only floats and float vectors can be interpolated" );
+		remove( value );
+		Entry entry;
+		entry.mValue = reinterpret_cast<float*>( value );
+		entry.mComponents = sizeof( T ) / sizeof( float );
+		memcpy( entry.mPrevious, entry.mValue, sizeof( T ) );
+		mValues.push_back( entry );
+	}
+	void remove( const void *value )
+	{
+		mValues.erase( std::remove_if( mValues.begin(), mValues.end(), [value]( const Entry &entry ) {
+			return entry.mValue == value;
+		}), mValues.end() );
+	}
+	//! Keeps the value of \a key in the ReplicatedState of the previous frame.
+	void add( const std::string &key, const ReplicatedState &state )
+	{
+		auto found = state.getValues().find( key );
+		mPreviousState[key] = found != state.getValues().end() ? found->second : ReplicatedState::Value();
+	}
+	void remove( const std::string &key ) { mPreviousState.erase( key ); }
+
+	bool isEmpty() const { return mValues.empty() && mPreviousState.empty(); }
+
+	//! Called before a frame changes anything, keeps the values of the frame before it.
+	void beginFrame( const ReplicatedState &state )
+	{
+		for( auto & entry : mValues )
+			memcpy( entry.mPrevious, entry.mValue, entry.mComponents * sizeof( float ) );
+		for( auto & previous : mPreviousState ) {
+			auto found = state.getValues().find( previous.first );
+			previous.second = found != state.getValues().end() ? found->second : ReplicatedState::Value();
+		}
+	}
+	//! Called once a frame was parsed, with the local time in microseconds it's for.
+	void endFrame( uint64_t time )
+	{
+		if( mCurrentTime != 0 && time > mCurrentTime ) {
+			double interval = double( time - mCurrentTime );
+			mInterval = mInterval == 0 ? interval : mInterval + ( interval - mInterval ) / kSmoothing;
+		}
+		mPreviousTime = mCurrentTime;
+		mCurrentTime = time;
+	}
+	//! Forgets the previous frame, values show as they are until two frames arrived again.
+	void reset( const ReplicatedState &state )
+	{
+		beginFrame( state );
+		mPreviousTime = mCurrentTime = 0;
+		mInterval = 0;
+	}
+
+	//! Returns how far the local time \a now is from the previous frame to the current one, 0 to 1.
+	float getAlpha( uint64_t now ) const
+	{
+		if( mPreviousTime == 0 || mInterval == 0 )
+			return 1.0f;
+		if( now <= mCurrentTime )
+			return 0.0f;
+		return static_cast<float>( std::min( 1.0, double( now - mCurrentTime ) / mInterval ) );
+	}
+
+	//! Returns the registered value at \a value mixed from the previous frame by \a alpha.
+	template<typename T>
+	T get( const T *value, float alpha ) const
+	{
+		for( auto & entry : mValues ) {
+			if( entry.mValue == reinterpret_cast<const float*>( value ) ) {
+				T previous;
+				memcpy( &previous, entry.mPrevious, sizeof( T ) );
+				return previous + ( *value - previous ) * alpha;
+			}
+		}
+		return *value;
+	}
+	//! Returns the value of the registered \a key mixed from the previous frame by \a alpha. Keys that
+	//! weren't set, or had another type, in the previous frame aren't mixed.
+	template<typename T>
+	T get( const ReplicatedState &state, const std::string &key, float alpha, const T &defaultValue = T() ) const
+	{
+		T current = state.get<T>( key, defaultValue );
+		auto found = mPreviousState.find( key );
+		if( found == mPreviousState.end() || ! state.has( key ) )
+			return current;
+		T previous = ReplicatedState::decode<T>( found->second, current );
+		typedef typename std::conditional<std::is_same<T, double>::value, double, float>::type Scalar;
+		return previous + ( current - previous ) * static_cast<Scalar>( alpha );
+	}
+
+private:
+	static constexpr double kSmoothing = 8.0;
+
+	struct Entry {
+		float	*mValue;
+		size_t	mComponents;
+		float	mPrevious[4];
+	};
+
+	std::vector<Entry>								mValues;
+	std::map<std::string, ReplicatedState::Value>	mPreviousState;
+	uint64_t										mPreviousTime;
+	uint64_t										mCurrentTime;
+	double											mInterval;
+};
+
+}
@@ -0,0 +1,131 @@
+//
+//  IoUringTransport.h
+//  Cinder-MPE
+//
+
+#pragma once
+
+#if defined( __linux__ ) && defined( MPE_HAS_IO_URING )
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+/*
+
+ IoUringTransport:
+ The sockets of the Server on Linux, without a read and a write syscall per connection. Built on
+ the io_uring syscalls directly, so it needs nothing but kernel headers. Define MPE_HAS_IO_URING
+ to build it, the Server falls back to asio when it isn't built or the kernel is older than 6.0.
+
+ • Accepting and receiving are multishot. They're armed once and keep completing, receives into
+   a pool of buffers the kernel picks from, so reading costs no syscalls of its own.
+
+ • Sends are copied into a registered buffer per connection and only queued. submit() hands
+   every queued send to the kernel in a single syscall, call it once per frame release.
+
+ • Completions are read from shared memory by poll(), which calls the handlers on the calling
+   thread. Everything has to happen on that one thread.
+
+ */
+
+namespace mpe {
+
+class IoUringTransport {
+public:
+	//! Connections are numbered by slot, a number is reused once its connection closed.
+	using AcceptHandler	= std::function<void ( uint32_t connection )>;
+	using ReadHandler	= std::function<void ( uint32_t connection, const char *data, size_t size )>;
+	using CloseHandler	= std::function<void ( uint32_t connection )>;
+
+	//! \a maxConnections is fixed, since the send buffers are registered up front.
+	explicit IoUringTransport( size_t maxConnections = 256 );
+	~IoUringTransport();
+	IoUringTransport( const IoUringTransport & ) = delete;
+	IoUringTransport& operator=( const IoUringTransport & ) = delete;
+
+	//! Listens on \a port. Returns false if io_uring or one of the features it needs isn't available.
+	bool	start( uint16_t port );
+	void	stop();
+	bool	isRunning() const { return mRingFd >= 0; }
+
+	void	connectAcceptHandler( const AcceptHandler &handler ) { mAcceptHandler = handler; }
+	void	connectReadHandler( const ReadHandler &handler ) { mReadHandler = handler; }
+	void	connectCloseHandler( const CloseHandler &handler ) { mCloseHandler = handler; }
+
+	//! Queues \a data to be sent to \a connection with the next submit().
+	void	send( uint32_t connection, const std::string &data );
+	//! Submits the queued sends, and with \a wait blocks until something completes.
+	void	submit( bool wait = false );
+	//! Calls the handlers for everything that completed. Returns how many completions there were.
+	size_t	poll();
+	void	close( uint32_t connection );
+
+	//! io_uring_enter calls so far, to check they don't grow with the connections.
+	uint64_t	getSyscallCount() const { return mSyscallCount; }
+
+private:
+	enum Operation : uint8_t { ACCEPT = 1, RECEIVE, SEND, PROVIDE, PROBE, CANCEL };
+
+	struct Connection {
+		int				mFd = -1;
+		uint32_t		mGeneration = 0;
+		std::string		mOutgoing;
+		size_t			mInFlight = 0;		// bytes of mOutgoing being sent from the registered buffer, kept past closing until sent
+		bool			mClosing = false;
+	};
+
+	static uint64_t	userData( Operation op, uint32_t slot, uint32_t generation );
+
+	//! Whether the kernel has every operation the transport uses.
+	bool			supportsOperations();
+	//! Whether it takes the multishot flags, checked once the accept is queued.
+	bool			supportsMultishot();
+	io_uring_sqe*	nextSqe();
+	void			armAccept();
+	void			armReceive( uint32_t slot );
+	void			sendNext( uint32_t slot );
+	void			provideBuffers( uint16_t first, uint16_t count );
+	void			recycleBuffer( uint16_t bufferId );
+	void			closeSlot( uint32_t slot );
+	void			flushQueue( bool wait );
+	int				enter( unsigned toSubmit, unsigned minComplete, unsigned flags );
+
+	int				mRingFd = -1;
+	int				mListenFd = -1;
+	size_t			mMaxConnections;
+
+	// Mapped rings
+	void			*mSqRing = nullptr;
+	size_t			mSqRingSize = 0;
+	void			*mCqRing = nullptr;
+	size_t			mCqRingSize = 0;
+	io_uring_sqe	*mSqes = nullptr;
+	size_t			mSqesSize = 0;
+	unsigned		*mSqHead = nullptr, *mSqTail = nullptr, *mSqArray = nullptr;
+	unsigned		*mCqHead = nullptr, *mCqTail = nullptr;
+	io_uring_cqe	*mCqes = nullptr;
+	unsigned		mSqMask = 0, mSqEntries = 0, mCqMask = 0;
+	unsigned		mSqLocalTail = 0;
+	unsigned		mToSubmit = 0;
+
+	// Receive buffers the kernel picks from, the ones read since the last submit(), and the registered send buffers.
+	char					*mReceiveBuffers = nullptr;
+	std::vector<uint16_t>	mReturnedBuffers;
+	char					*mSendBuffers = nullptr;
+
+	std::vector<Connection>	mConnections;
+	std::vector<uint32_t>	mStarved;			// connections waiting for receive buffers
+	uint64_t				mSyscallCount = 0;
+
+	AcceptHandler		mAcceptHandler;
+	ReadHandler			mReadHandler;
+	CloseHandler		mCloseHandler;
+};
+
+}
+
+#endif
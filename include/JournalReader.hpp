@@ -0,0 +1,158 @@
+//
+//  JournalReader.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <boost/utility/string_ref.hpp>
+
+/*
+
+ JournalReader:
+ Reads a journal recorded with mpe_server.py --journal, see mpe_journal.py for the format.
+ It reads from memory, e.g. a memory mapped file, and doesn't copy anything, so it's cheap
+ enough to drive Protocol::parseClient with recorded traffic in benchmarks and tests:
+
+	JournalReader reader( data, size );
+	reader.seekFrame( 100 );
+	JournalReader::Record record;
+	while( reader.next( record ) ) {
+		if( record.mKind == JournalReader::kOutbound && record.mClientId == clientId )
+			Protocol::parseClient( record.mPayload, handler );
+	}
+
+ Payloads don't include the newline the line was recorded with, but it's still in memory
+ right after them, so parsers that scan past the end of a number stop there.
+
+ */
+
+namespace mpe {
+
+class JournalReader {
+public:
+	static const uint8_t	kInbound = 'I';
+	static const uint8_t	kOutbound = 'O';
+	static const uint8_t	kIndex = 'X';
+	static const uint8_t	kBulkLane = 1;
+	static const uint16_t	kNoClient = 0xFFFF;
+
+	struct Record {
+		uint8_t				mKind = 0;
+		uint8_t				mFlags = 0;
+		uint16_t			mClientId = 0;
+		//! Microseconds since the journal started.
+		uint64_t			mTime = 0;
+		//! The journal frame, counted by release from 1.
+		uint64_t			mFrame = 0;
+		boost::string_ref	mPayload;
+	};
+
+	//! Reads the journal in \a size bytes at \a data, which have to outlive the reader.
+	JournalReader( const void *data, size_t size )
+	: mData( static_cast<const uint8_t*>( data ) ), mSize( size ), mUsed( 0 ), mLastIndex( 0 ), mHeaderSize( 0 ), mOffset( 0 )
+	{
+		if( mSize < kFileHeaderSize || memcmp( mData, "MPEJ", 4 ) != 0 || read<uint16_t>( 4 ) != kVersion )
+			return;
+		mHeaderSize = read<uint16_t>( 6 );
+		mUsed = read<uint64_t>( 16 );
+		mUsed = mUsed < mSize ? mUsed : mSize;
+		mLastIndex = read<uint64_t>( 24 );
+		mOffset = mHeaderSize;
+	}
+
+	//! Returns whether the data is a journal of a version this reader knows.
+	bool	isValid() const { return mHeaderSize != 0; }
+	//! The server's clock in microseconds when the journal started.
+	uint64_t getStartTime() const { return isValid() ? read<uint64_t>( 8 ) : 0; }
+
+	//! Reads the next record that isn't an index block into \a record. Returns false at the end.
+	bool next( Record &record )
+	{
+		while( size_t size = readAt( mOffset, record ) ) {
+			mOffset += size;
+			if( record.mKind != kIndex )
+				return true;
+		}
+		return false;
+	}
+	//! Moves to the first record of \a frame, or to the end if there is none.
+	void seekFrame( uint64_t frame )
+	{
+		mOffset = mHeaderSize;
+		// Walk back through the index blocks to the one that has the frame, then scan from there.
+		for( uint64_t index = mLastIndex; index != 0 && isValid(); ) {
+			uint64_t entries = index + kRecordHeaderSize;
+			if( entries + kIndexHeaderSize > mUsed )
+				break;
+			uint32_t count = read<uint32_t>( entries + 8 );
+			if( count > 0 && read<uint64_t>( entries + kIndexHeaderSize ) <= frame ) {
+				for( uint32_t i = 0; i < count; ++i ) {
+					uint64_t entry = entries + kIndexHeaderSize + i * kIndexEntrySize;
+					if( entry + kIndexEntrySize > mUsed || read<uint64_t>( entry ) > frame )
+						break;
+					mOffset = read<uint64_t>( entry + 8 );
+				}
+				break;
+			}
+			index = read<uint64_t>( entries );
+		}
+		Record record;
+		while( size_t size = readAt( mOffset, record ) ) {
+			if( record.mKind != kIndex && record.mFrame >= frame )
+				break;
+			mOffset += size;
+		}
+	}
+	//! Moves back to the first record.
+	void rewind() { mOffset = mHeaderSize; }
+
+private:
+	static const uint16_t	kVersion = 1;
+	static const size_t		kFileHeaderSize = 32;
+	static const size_t		kRecordHeaderSize = 24;
+	static const size_t		kIndexHeaderSize = 16;
+	static const size_t		kIndexEntrySize = 16;
+
+	template<typename T>
+	T read( uint64_t offset ) const
+	{
+		// Journals are little endian, like every platform MPE runs on.
+		T value;
+		memcpy( &value, mData + offset, sizeof( T ) );
+		return value;
+	}
+
+	//! Reads the record at \a offset and returns its size, or 0 past the end.
+	size_t readAt( uint64_t offset, Record &record ) const
+	{
+		if( ! isValid() || offset + kRecordHeaderSize > mUsed )
+			return 0;
+		uint32_t size = read<uint32_t>( offset );
+		if( offset + kRecordHeaderSize + size > mUsed )
+			return 0;
+		record.mKind = mData[offset + 4];
+		record.mFlags = mData[offset + 5];
+		record.mClientId = read<uint16_t>( offset + 6 );
+		record.mTime = read<uint64_t>( offset + 8 );
+		record.mFrame = read<uint64_t>( offset + 16 );
+		const char *payload = reinterpret_cast<const char*>( mData + offset + kRecordHeaderSize );
+		size_t length = size;
+		if( record.mKind != kIndex && length > 0 && payload[length - 1] == '\n' )
+			--length;
+		record.mPayload = boost::string_ref( payload, length );
+		return kRecordHeaderSize + size;
+	}
+
+	const uint8_t	*mData;
+	size_t			mSize;
+	uint64_t		mUsed;
+	uint64_t		mLastIndex;
+	uint16_t		mHeaderSize;
+	uint64_t		mOffset;
+};
+
+}
@@ -0,0 +1,145 @@
+//
+//  Lz4.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/*
+
+ Lz4:
+ A small, dependency free implementation of the LZ4 block format, which is the codec
+ negotiated for compressed data messages. mpe_server.py has a matching decoder for
+ clients that didn't negotiate it. Compression is greedy with a single hash probe,
+ which is plenty for the repetitive text apps usually sync.
+
+ */
+
+namespace mpe {
+
+//! Returns the worst case compressed size of \a size bytes.
+inline size_t lz4CompressBound( size_t size )
+{
+	return size + size / 255 + 16;
+}
+
+//! Returns the most bytes \a size compressed bytes can decompress to. A match takes a byte
+//! for every 255 bytes it copies, so a larger size announced for them can't be right.
+inline size_t lz4DecompressBound( size_t size )
+{
+	return size * 255;
+}
+
+//! Compresses \a size bytes from \a src into \a dst, which must hold lz4CompressBound( size ) bytes.
+//! Returns the compressed size.
+inline size_t lz4Compress( const uint8_t *src, size_t size, uint8_t *dst )
+{
+	static const size_t kMinMatch = 4, kLastLiterals = 5, kMatchLimit = 12, kHashBits = 12;
+
+	auto read32 = []( const uint8_t *p ) { uint32_t v; std::memcpy( &v, p, sizeof( v ) ); return v; };
+	auto writeLength = []( uint8_t *&out, size_t length ) {
+		for( ; length >= 255; length -= 255 )
+			*out++ = 255;
+		*out++ = static_cast<uint8_t>( length );
+	};
+	auto writeLiterals = [&]( uint8_t *&out, const uint8_t *literals, size_t length, uint8_t matchNibble ) {
+		*out++ = static_cast<uint8_t>( ( length < 15 ? length : 15 ) << 4 ) | matchNibble;
+		if( length >= 15 )
+			writeLength( out, length - 15 );
+		// An empty input has no literals to copy, and maybe no pointer to copy them from.
+		if( length > 0 )
+			std::memcpy( out, literals, length );
+		out += length;
+	};
+
+	uint8_t *out = dst;
+	size_t anchor = 0;
+	if( size > kMatchLimit ) {
+		// Positions are stored + 1, so 0 means empty.
+		uint32_t table[1 << kHashBits] = {};
+		size_t ip = 0;
+		size_t limit = size - kMatchLimit;
+		while( ip < limit ) {
+			uint32_t sequence = read32( src + ip );
+			uint32_t hash = ( sequence * 2654435761u ) >> ( 32 - kHashBits );
+			size_t ref = table[hash];
+			table[hash] = static_cast<uint32_t>( ip + 1 );
+			if( ref == 0 || ip + 1 - ref > 0xFFFF || read32( src + ref - 1 ) != sequence ) {
+				++ip;
+				continue;
+			}
+			--ref;
+			size_t matchLength = kMinMatch;
+			while( ip + matchLength < size - kLastLiterals && src[ref + matchLength] == src[ip + matchLength] )
+				++matchLength;
+
+			size_t extra = matchLength - kMinMatch;
+			writeLiterals( out, src + anchor, ip - anchor, static_cast<uint8_t>( extra < 15 ? extra : 15 ) );
+			size_t offset = ip - ref;
+			*out++ = static_cast<uint8_t>( offset & 0xFF );
+			*out++ = static_cast<uint8_t>( offset >> 8 );
+			if( extra >= 15 )
+				writeLength( out, extra - 15 );
+
+			ip += matchLength;
+			anchor = ip;
+		}
+	}
+	writeLiterals( out, src + anchor, size - anchor, 0 );
+	return out - dst;
+}
+
+//! Decompresses \a size bytes from \a src into \a dst, which must hold exactly \a rawSize bytes.
+//! Returns \a rawSize, or 0 if \a src is malformed.
+inline size_t lz4Decompress( const uint8_t *src, size_t size, uint8_t *dst, size_t rawSize )
+{
+	const uint8_t *ip = src, *end = src + size;
+	uint8_t *op = dst, *outEnd = dst + rawSize;
+	auto readLength = [&]( size_t length ) -> size_t {
+		if( length == 15 ) {
+			uint8_t byte;
+			do {
+				if( ip >= end )
+					return SIZE_MAX;
+				byte = *ip++;
+				length += byte;
+			} while( byte == 255 );
+		}
+		return length;
+	};
+
+	while( ip < end ) {
+		uint8_t token = *ip++;
+		size_t literals = readLength( token >> 4 );
+		if( literals == SIZE_MAX || literals > size_t( end - ip ) || literals > size_t( outEnd - op ) )
+			return 0;
+		if( literals > 0 )
+			std::memcpy( op, ip, literals );
+		ip += literals;
+		op += literals;
+		if( ip >= end )
+			break;
+
+		if( end - ip < 2 )
+			return 0;
+		size_t offset = ip[0] | ( ip[1] << 8 );
+		ip += 2;
+		size_t matchLength = readLength( token & 0x0F );
+		if( matchLength == SIZE_MAX || offset == 0 || offset > size_t( op - dst ) )
+			return 0;
+		matchLength += 4;
+		if( matchLength > size_t( outEnd - op ) )
+			return 0;
+		// Matches may overlap the bytes they produce.
+		const uint8_t *match = op - offset;
+		for( size_t i = 0; i < matchLength; ++i )
+			op[i] = match[i];
+		op += matchLength;
+	}
+	return ( op == outEnd ) ? rawSize : 0;
+}
+
+}
@@ -14,6 +14,10 @@
  ClientBase is a subclass of MessageHandler.
  
  */
+#include <map>
+
+#include <boost/utility/string_ref.hpp>
+
 #include "cinder/app/App.h"
 
 namespace mpe {
@@ -87,8 +91,27 @@ protected:
 	ClientMessageHandler() : MessageHandler() {}
 	
 	//! These are overridden in the MPEClient to handle data received from Server.
-	virtual void receivedStringMessage(const std::string & dataMessage, uint32_t fromClientID ) = 0;
+	//! \a dataMessage points into the line being parsed and is only valid during the call.
+	virtual void receivedDataMessage( boost::string_ref dataMessage, uint32_t fromClientID ) = 0;
 	virtual void receivedResetCommand() = 0;
+	virtual void receivedHandshake( const std::map<std::string, std::string> &options ) = 0;
+	virtual void receivedStateDelta( const std::string &delta ) = 0;
+	//! These are overridden in the MPEClient to keep its estimate of the server clock.
+	virtual void receivedPresentationTime( uint64_t serverTime ) = 0;
+	virtual void receivedClockSample( uint64_t sentTime, uint64_t serverTime ) = 0;
+	//! Overridden in the MPEClient to keep the frame rate the server paces frames at.
+	virtual void receivedFrameRate( float fps ) = 0;
+	//! Overridden in the MPEClient to forget the lines the server received, they won't have to be sent again.
+	virtual void receivedLinesAcknowledged( uint64_t lines ) = 0;
+	//! Overridden in the MPEClient to send its trace events.
+	virtual void receivedTraceRequest() = 0;
+	//! These are overridden in the MPEClient to reassemble data messages sent over the bulk lane.
+	virtual void receivedBulkMessage( uint32_t msgID, uint32_t fromClientID ) = 0;
+	virtual void receivedDataChunk( uint32_t fromClientID, uint32_t msgID, size_t offset, size_t total,
+								    const char *chunk, size_t chunkSize ) = 0;
+	virtual void receivedStreamChunk( uint32_t fromClientID, uint32_t streamID, size_t offset, size_t total,
+									  const char *encoded, size_t encodedSize ) = 0;
+	virtual void bulkLaneAccepted() = 0;
 
 
 private:
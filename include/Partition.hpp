@@ -0,0 +1,152 @@
+//
+//  Partition.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "cinder/Rect.h"
+#include "cinder/Vector.h"
+
+#include "Client.h"
+
+/*
+
+ Partition:
+ Splits a simulation between sync clients, so each one only steps the entities inside its own
+ region instead of the whole master space. Every client adds the same initial entities and
+ keeps the ones it owns. After stepping, exchange() hands the entities that left the region to
+ the neighbor that owns them now, and sends copies of the ones near the border as ghosts, so
+ neighbors can see them when they step the next frame.
+
+ • Regions default to the client's visible rect and have to tile the master space without
+   gaps or overlaps. A point on a shared edge belongs to the region to its right or below.
+   Entities that leave the master space stay with their owner.
+
+ • Migrants and ghosts are sent on two typed channels with region routing, so with a server
+   that routes by viewport each message only reaches the clients it concerns. Without it they
+   are broadcast and every client keeps what's in its region.
+
+ • Entities sent in one frame arrive before the UpdateFrameCallback of the next, so a migrant
+   isn't stepped twice or skipped. Call exchange() at the end of the UpdateFrameCallback. It
+   sends messages, so it doesn't work with pipelined clients.
+
+ */
+
+namespace mpe {
+
+template<typename T>
+class Partition {
+public:
+	//! Returns the position of an entity in master space.
+	using PositionFn = std::function<ci::vec2 ( const T & )>;
+
+	//! Partitions entities of type T by the visible rect of \a client. The channel ids have to be the same on every
+	//! client and can't be used for anything else. Entities within \a margin of the border are sent as ghosts. The
+	//! channel handlers refer to the partition, so it has to live as long as \a client.
+	Partition( Client &client, uint16_t migrantChannelId, uint16_t ghostChannelId, const PositionFn &position, float margin )
+	: Partition( client, migrantChannelId, ghostChannelId, position, margin, client.getVisibleRect() )
+	{}
+	//! Partitions entities of type T by \a region instead of the visible rect.
+	Partition( Client &client, uint16_t migrantChannelId, uint16_t ghostChannelId, const PositionFn &position, float margin,
+			   const ci::Rectf &region )
+	: mClient( client ), mPosition( position ), mMargin( margin ), mRegion( region.canonicalized() )
+	{
+		mClient.registerChannel<Migrant>( migrantChannelId, [this]( const Migrant &migrant, uint32_t fromClientId ) {
+			if( fromClientId != mClient.getClientID() && owns( mPosition( migrant.mEntity ) ) )
+				mOwned.push_back( migrant.mEntity );
+		} );
+		mClient.registerChannel<Ghost>( ghostChannelId, [this]( const Ghost &ghost, uint32_t fromClientId ) {
+			if( fromClientId != mClient.getClientID() && isNearby( mPosition( ghost.mEntity ) ) )
+				mGhosts.push_back( ghost.mEntity );
+		} );
+	}
+	Partition( const Partition & ) = delete;
+	Partition& operator=( const Partition & ) = delete;
+
+	//! Keeps \a entity if it's in this client's region. Add the same entities on every client to distribute them.
+	//! Returns whether it was kept.
+	bool add( const T &entity )
+	{
+		if( ! owns( mPosition( entity ) ) )
+			return false;
+		mOwned.push_back( entity );
+		return true;
+	}
+	//! Forgets every entity and ghost, e.g. when the server resets.
+	void clear()
+	{
+		mOwned.clear();
+		mGhosts.clear();
+	}
+
+	//! The entities this client steps.
+	std::vector<T>&			getOwned() { return mOwned; }
+	const std::vector<T>&	getOwned() const { return mOwned; }
+	//! Read only copies of the neighbors' entities within the margin of this region, as of the last frame.
+	const std::vector<T>&	getGhosts() const { return mGhosts; }
+	//! The part of the master space this client owns.
+	const ci::Rectf&		getRegion() const { return mRegion; }
+
+	//! Sends the entities that left the region to their new owner and the ones near the border to the neighbors.
+	//! Forgets the ghosts of this frame. Call it once per frame, after stepping.
+	void exchange()
+	{
+		mGhosts.clear();
+		size_t kept = 0;
+		for( size_t i = 0; i < mOwned.size(); ++i ) {
+			const T &entity = mOwned[i];
+			ci::vec2 position = mPosition( entity );
+			if( ! owns( position ) && isInMasterSpace( position ) ) {
+				mClient.send( Migrant{ entity }, ci::Rectf( position, position ) );
+				continue;
+			}
+			if( isNearBorder( position ) )
+				mClient.send( Ghost{ entity }, ci::Rectf( position - ci::vec2( mMargin ), position + ci::vec2( mMargin ) ) );
+			if( kept != i )
+				mOwned[kept] = entity;
+			++kept;
+		}
+		mOwned.resize( kept );
+	}
+
+private:
+	struct Migrant {
+		T	mEntity;
+	};
+	struct Ghost {
+		T	mEntity;
+	};
+
+	bool owns( const ci::vec2 &p ) const
+	{
+		// Half open, so a point on a shared edge has a single owner.
+		return p.x >= mRegion.x1 && p.x < mRegion.x2 && p.y >= mRegion.y1 && p.y < mRegion.y2;
+	}
+	bool isInMasterSpace( const ci::vec2 &p ) const
+	{
+		const ci::ivec2 &size = mClient.getMasterSize();
+		return p.x >= 0 && p.x < size.x && p.y >= 0 && p.y < size.y;
+	}
+	bool isNearby( const ci::vec2 &p ) const
+	{
+		return p.x >= mRegion.x1 - mMargin && p.x < mRegion.x2 + mMargin && p.y >= mRegion.y1 - mMargin && p.y < mRegion.y2 + mMargin;
+	}
+	bool isNearBorder( const ci::vec2 &p ) const
+	{
+		return p.x < mRegion.x1 + mMargin || p.x >= mRegion.x2 - mMargin || p.y < mRegion.y1 + mMargin || p.y >= mRegion.y2 - mMargin;
+	}
+
+	Client			&mClient;
+	PositionFn		mPosition;
+	float			mMargin;
+	ci::Rectf		mRegion;
+	std::vector<T>	mOwned;
+	std::vector<T>	mGhosts;
+};
+
+}
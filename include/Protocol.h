@@ -8,8 +8,10 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <iterator>
+#include <map>
 #include <sstream>
 #include <string>
 
@@ -17,6 +19,8 @@
 #include "cinder/Utilities.h"
 #include "cinder/Log.h"
 #include "MessageHandler.hpp"
+#include "Base64.hpp"
+#include "Lz4.hpp"
 
 /*
  
@@ -40,10 +44,32 @@ public:
 	const static std::string CONNECT_ASYNCHRONOUS;
 	const static std::string RESET_ALL;
 	const static std::string TOGGLE_PAUSE;
+	const static std::string BULK_LANE_CONNECT;
+	const static std::string DATA_CHUNK;
+	const static std::string DATA_STREAM;
+	const static std::string HANDSHAKE;
+	const static std::string STATE_DELTA;
+	const static std::string COALESCED_MESSAGE;
+	const static std::string REGION_MESSAGE;
+	const static std::string SUBSCRIBE;
+	const static std::string UNSUBSCRIBE;
+	const static std::string PUBLISH;
+	const static std::string CLOCK_SYNC;
+	const static std::string TRACE;
 	
 	const static std::string kMessageTerminus;
 	const static std::string kDataMessageDelimiter;
 	const static std::string kIncomingMessageDelimiter;
+	const static std::string kBulkReferenceDelimiter;
+	const static std::string kCompressedMessagePrefix;
+	const static std::string kCodecLz4;
+	const static std::string kStateDeltaPrefix;
+	const static std::string kChannelMessagePrefix;
+	const static std::string kPresentationTimeDelimiter;
+	const static std::string kFrameRateDelimiter;
+	const static std::string kReceivedDelimiter;
+	
+	using HandshakeOptions = std::map<std::string, std::string>;
     
     ~Protocol(){};
     
@@ -66,7 +92,12 @@ public:
             CI_LOG_W( termID
             << " are not allowed in broadcast messages."
             << " Replacing with an underscore.\n");
-            std::replace( message.begin(), message.end(), dataMessageDelimiter().at(0), '_' );
+            std::replace( message.begin(), message.end(), messageDelimiter().at(0), '_' );
+        }
+        // A leading compression or channel prefix would change how the message is read
+        if ( isCompressedMessage( message ) || isChannelMessage( message ) )
+        {
+            message[0] = '_';
         }
 		return std::move( message );
     }
@@ -105,6 +136,17 @@ public:
 		messageDelimiter();
     };
 	
+	//! Appends \a options to a connect message as key=value fields. The server answers
+	//! with a HANDSHAKE message holding the options it agreed to.
+	static std::string withHandshakeOptions( std::string connectMessage, const HandshakeOptions &options )
+	{
+		connectMessage.resize( connectMessage.size() - messageDelimiter().size() );
+		for( auto & option : options ) {
+			connectMessage += dataMessageDelimiter() + option.first + "=" + option.second;
+		}
+		return connectMessage + messageDelimiter();
+	}
+	
 	inline static std::string renderComplete( uint32_t clientID, uint64_t frameNum )
     {
         return DONE_RENDERING +
@@ -115,6 +157,22 @@ public:
 		messageDelimiter();
     };
 	
+	//! A renderComplete with the hash of the client's state after the frame, see StateHasher.hpp. The server
+	//! compares the hashes of a frame and reports clients that differ. Format: D|clientID|frameNum|hash in hex
+	inline static std::string renderComplete( uint32_t clientID, uint64_t frameNum, uint64_t stateHash )
+	{
+		char hash[17];
+		snprintf( hash, sizeof( hash ), "%016llx", static_cast<unsigned long long>( stateHash ) );
+		return DONE_RENDERING +
+		dataMessageDelimiter() +
+		std::to_string( clientID ) +
+		dataMessageDelimiter() +
+		std::to_string( frameNum ) +
+		dataMessageDelimiter() +
+		hash +
+		messageDelimiter();
+	}
+	
 	inline static std::string reset()
     {
         return RESET_ALL +
@@ -134,7 +192,12 @@ public:
 	
 	static std::string dataMessage(const std::string & msg, const std::vector<uint32_t> & toClientIDs)
     {
-        std::string sanitizedMessage = cleanMessage( msg );
+        return cleanDataMessage( cleanMessage( msg ), toClientIDs );
+    };
+	
+	//! Like dataMessage, for a message that already went through cleanMessage.
+	static std::string cleanDataMessage( const std::string & sanitizedMessage, const std::vector<uint32_t> & toClientIDs )
+    {
         std::string sendMessage = DATA_MESSAGE + dataMessageDelimiter() + sanitizedMessage;
         for ( int i = 0; i < toClientIDs.size(); ++i ){
             if (i == 0) {
@@ -148,6 +211,264 @@ public:
         sendMessage += messageDelimiter();
         return sendMessage;
     };
+	
+	//! Formats \a rect as x1,y1,x2,y2, for region messages and the aoi handshake option. Nine digits
+	//! round trip a float, %g's six would move the edges of a large master space.
+	static std::string formatRect( const ci::Rectf &rect )
+	{
+		char str[128];
+		std::snprintf( str, sizeof( str ), "%.9g,%.9g,%.9g,%.9g", rect.x1, rect.y1, rect.x2, rect.y2 );
+		return str;
+	}
+	
+	//! A data message for the clients whose viewport intersects \a bounds, in master space.
+	//! Format: W|x1,y1,x2,y2|message. The message must already be clean.
+	inline static std::string regionMessage( const ci::Rectf &bounds, const std::string &msg )
+	{
+		return REGION_MESSAGE +
+		dataMessageDelimiter() +
+		formatRect( bounds ) +
+		dataMessageDelimiter() +
+		msg +
+		messageDelimiter();
+	}
+	
+	//! Subscribes this client to a topic. Format: U|topic. The topic must already be clean.
+	inline static std::string subscribe( const std::string &topic )
+	{
+		return SUBSCRIBE + dataMessageDelimiter() + topic + messageDelimiter();
+	}
+	
+	//! Unsubscribes this client from a topic. Format: X|topic. The topic must already be clean.
+	inline static std::string unsubscribe( const std::string &topic )
+	{
+		return UNSUBSCRIBE + dataMessageDelimiter() + topic + messageDelimiter();
+	}
+	
+	//! A data message for the subscribers of a topic. Format: O|topic|message. Both must already be clean.
+	inline static std::string publishMessage( const std::string &topic, const std::string &msg )
+	{
+		return PUBLISH +
+		dataMessageDelimiter() +
+		topic +
+		dataMessageDelimiter() +
+		msg +
+		messageDelimiter();
+	}
+	
+	//! Returns the frame count of a NEXT_FRAME message, or 0 for any other message.
+	inline static uint64_t frameNumber( boost::string_ref serverMessage )
+	{
+		if( serverMessage.size() <= NEXT_FRAME.size() || ! serverMessage.starts_with( NEXT_FRAME ) ||
+		    serverMessage[NEXT_FRAME.size()] != dataMessageDelimiter()[0] ) {
+			return 0;
+		}
+		return strtoull( serverMessage.data() + NEXT_FRAME.size() + 1, nullptr, 10 );
+	}
+	
+	//! A clock ping stamped with the client's clock in microseconds. Format: Y|clientTime. The server
+	//! answers with Y|clientTime|serverTime right away.
+	inline static std::string clockSync( uint64_t clientTime )
+	{
+		return CLOCK_SYNC + dataMessageDelimiter() + std::to_string( clientTime ) + messageDelimiter();
+	}
+	
+	//! Asks the server to collect a trace from every client that records one. Format: E
+	inline static std::string traceRequest()
+	{
+		return TRACE + messageDelimiter();
+	}
+	
+	//! Trace events of a client, answering the server's E. Long traces are split into lines with \a more set
+	//! on all but the last. \a synchronized says whether the times are on the server clock.
+	//! Format: E|clientID|more|synchronized|event;event... with events as phase,thread,time,duration,frame,name
+	inline static std::string traceEvents( uint32_t clientID, bool more, bool synchronized, const std::string &events )
+	{
+		return TRACE +
+		dataMessageDelimiter() +
+		std::to_string( clientID ) +
+		dataMessageDelimiter() +
+		( more ? "1" : "0" ) +
+		dataMessageDelimiter() +
+		( synchronized ? "1" : "0" ) +
+		dataMessageDelimiter() +
+		events +
+		messageDelimiter();
+	}
+	
+	//! A data message that replaces, or with \a accumulate adds to, the last one this client sent with
+	//! \a coalesceKey in the same frame. Format: L|coalesceKey|l or a|message. Both must already be clean.
+	inline static std::string coalescedMessage( const std::string &coalesceKey, bool accumulate, const std::string &msg )
+	{
+		return COALESCED_MESSAGE +
+		dataMessageDelimiter() +
+		coalesceKey +
+		dataMessageDelimiter() +
+		( accumulate ? "a" : "l" ) +
+		dataMessageDelimiter() +
+		msg +
+		messageDelimiter();
+	}
+	
+	//! Adds the comma separated numbers in \a delta to the ones in \a total, component by component.
+	//! This is how accumulating coalesced messages combine, on the client and on the server.
+	static void accumulateMessage( std::string &total, const std::string &delta )
+	{
+		std::vector<double> sums;
+		for( const std::string *str : { static_cast<const std::string *>( &total ), &delta } ) {
+			const char *number = str->c_str();
+			for( size_t i = 0; *number; ++i ) {
+				char *end;
+				double value = std::strtod( number, &end );
+				if( end == number ) {
+					CI_LOG_E( "Accumulated messages must be comma separated numbers: " << *str );
+					total = delta;
+					return;
+				}
+				if( i < sums.size() )
+					sums[i] += value;
+				else
+					sums.push_back( value );
+				number = ( *end == ',' ) ? end + 1 : end;
+			}
+		}
+		total.clear();
+		char number[32];
+		for( size_t i = 0; i < sums.size(); ++i ) {
+			std::snprintf( number, sizeof( number ), "%.17g", sums[i] );
+			total += ( i == 0 ) ? number : std::string( "," ) + number;
+		}
+	}
+	
+	//! The changes this client made to its ReplicatedState during a frame.
+	inline static std::string stateDelta( const std::string &delta )
+	{
+		return STATE_DELTA +
+		dataMessageDelimiter() +
+		delta +
+		messageDelimiter();
+	}
+	
+	//! Compresses a clean message with the lz4 codec into \a out, as \x1d<rawSize>:<base64>.
+	//! \a scratch is reused between calls. Returns false if compressing doesn't make it smaller.
+	static bool compressMessage( const std::string &sanitizedMessage, std::vector<uint8_t> &scratch, std::string &out )
+	{
+		scratch.resize( lz4CompressBound( sanitizedMessage.size() ) );
+		size_t compressedSize = lz4Compress( reinterpret_cast<const uint8_t *>( sanitizedMessage.data() ),
+											 sanitizedMessage.size(), scratch.data() );
+		auto rawSize = std::to_string( sanitizedMessage.size() );
+		if( kCompressedMessagePrefix.size() + rawSize.size() + 1 + base64EncodedSize( compressedSize ) >= sanitizedMessage.size() )
+			return false;
+		
+		out = kCompressedMessagePrefix + rawSize + ":";
+		base64Encode( scratch.data(), compressedSize, out );
+		return true;
+	}
+	
+	//! Returns whether \a message was compressed by compressMessage.
+	inline static bool isCompressedMessage( boost::string_ref message )
+	{
+		return message.starts_with( kCompressedMessagePrefix );
+	}
+	
+	//! Decompresses \a message into \a out, using \a scratch for the decoded bytes. Returns false if it's malformed.
+	static bool decompressMessage( boost::string_ref message, std::vector<uint8_t> &scratch, std::string &out )
+	{
+		size_t colon = message.find( ':' );
+		if( colon == boost::string_ref::npos )
+			return false;
+		
+		size_t rawSize = strtoull( message.data() + kCompressedMessagePrefix.size(), nullptr, 10 );
+		const char *encoded = message.data() + colon + 1;
+		size_t encodedSize = message.size() - colon - 1;
+		scratch.resize( base64DecodedSize( encoded, encodedSize ) );
+		size_t compressedSize = base64Decode( encoded, encodedSize, scratch.data() );
+		// The size comes from the sender, only trust it as far as the compressed bytes can go.
+		if( rawSize > lz4DecompressBound( compressedSize ) )
+			return false;
+		out.resize( rawSize );
+		return rawSize == 0 || lz4Decompress( scratch.data(), compressedSize, reinterpret_cast<uint8_t *>( &out[0] ), rawSize ) == rawSize;
+	}
+	
+	//! Encodes \a size bytes from \a data as a message on \a channelID into \a out, as \x1e<base64>. The channel ID
+	//! is the first two bytes of the encoded block, little endian. \a scratch is reused between calls.
+	static void channelMessage( uint16_t channelID, const void *data, size_t size, std::vector<uint8_t> &scratch, std::string &out )
+	{
+		scratch.resize( 2 + size );
+		scratch[0] = static_cast<uint8_t>( channelID & 0xFF );
+		scratch[1] = static_cast<uint8_t>( channelID >> 8 );
+		if( size > 0 )
+			std::memcpy( scratch.data() + 2, data, size );
+		out = kChannelMessagePrefix;
+		base64Encode( scratch.data(), scratch.size(), out );
+	}
+	
+	//! Returns whether \a message was encoded by channelMessage.
+	inline static bool isChannelMessage( boost::string_ref message )
+	{
+		return message.starts_with( kChannelMessagePrefix );
+	}
+	
+	//! Decodes a channel message into \a scratch and sets \a channelID. The payload starts at scratch.data() + 2.
+	//! Returns false if it's malformed.
+	static bool decodeChannelMessage( boost::string_ref message, std::vector<uint8_t> &scratch, uint16_t &channelID )
+	{
+		const char *encoded = message.data() + kChannelMessagePrefix.size();
+		size_t encodedSize = message.size() - kChannelMessagePrefix.size();
+		scratch.resize( base64DecodedSize( encoded, encodedSize ) );
+		if( scratch.size() < 2 || base64Decode( encoded, encodedSize, scratch.data() ) != scratch.size() )
+			return false;
+		channelID = static_cast<uint16_t>( scratch[0] | ( scratch[1] << 8 ) );
+		return true;
+	}
+	
+	//! Opens the bulk lane. Sent as the first message on the second connection.
+	inline static std::string bulkLaneConnect( uint32_t clientID )
+	{
+		return BULK_LANE_CONNECT +
+		dataMessageDelimiter() +
+		std::to_string( clientID ) +
+		messageDelimiter();
+	}
+	
+	//! A piece of a large data message, sent on the bulk lane. \a chunk must already be clean.
+	//! Format: C|msgId|offset|total|chunk[|toID_1,toID_2]. Recipients are only sent with the first chunk.
+	static std::string dataChunk( uint32_t msgId, size_t offset, size_t total, const char *chunk, size_t chunkSize,
+								  const std::vector<uint32_t> &toClientIDs )
+	{
+		std::string sendMessage = DATA_CHUNK + dataMessageDelimiter() +
+		std::to_string( msgId ) + dataMessageDelimiter() +
+		std::to_string( offset ) + dataMessageDelimiter() +
+		std::to_string( total ) + dataMessageDelimiter();
+		sendMessage.append( chunk, chunkSize );
+		if( offset == 0 ) {
+			for( size_t i = 0; i < toClientIDs.size(); ++i ) {
+				sendMessage += ( i == 0 ) ? dataMessageDelimiter() : ",";
+				sendMessage += std::to_string( toClientIDs[i] );
+			}
+		}
+		sendMessage += messageDelimiter();
+		return sendMessage;
+	}
+	
+	//! A piece of a binary stream, sent on the bulk lane. \a offset and \a total count decoded bytes.
+	//! Format: M|streamId|offset|total|base64[|toID_1,toID_2]. Recipients are only sent with the first chunk.
+	static void appendStreamChunk( std::string &out, uint32_t streamId, size_t offset, size_t total,
+								   const uint8_t *data, size_t size, const std::vector<uint32_t> &toClientIDs )
+	{
+		out += DATA_STREAM + dataMessageDelimiter() +
+		std::to_string( streamId ) + dataMessageDelimiter() +
+		std::to_string( offset ) + dataMessageDelimiter() +
+		std::to_string( total ) + dataMessageDelimiter();
+		base64Encode( data, size, out );
+		if( offset == 0 ) {
+			for( size_t i = 0; i < toClientIDs.size(); ++i ) {
+				out += ( i == 0 ) ? dataMessageDelimiter() : ",";
+				out += std::to_string( toClientIDs[i] );
+			}
+		}
+		out += messageDelimiter();
+	}
     
     // The TCP client listens to the socket until it reaches the delimiter,
     // at which point the string is parsed.
@@ -167,51 +488,133 @@ public:
 		std::to_string(frameNum);
 	}
 	
-	inline static void parseClient( const std::string & serverMessage, ClientMessageHandler *handler )
+	//! Returns the position of \a c in \a str at or after \a pos, boost::string_ref only searches from the start.
+	inline static size_t find( boost::string_ref str, char c, size_t pos )
+	{
+		size_t found = str.substr( std::min( pos, str.size() ) ).find( c );
+		return ( found == boost::string_ref::npos ) ? found : found + pos;
+	}
+	
+	inline static void parseClient( boost::string_ref serverMessage, ClientMessageHandler *handler )
     {
         // Example server messages:
         // 1) G|19919|fromID,blahblahblah
         // 2) G|7
         // 3) G|21|fromID,blah1234|fromID,blah210|fromID,blah345623232
+        // 4) H|codec=lz4
+        // 5) G|22@81726354|fromID,blah
+        // 6) Y|1200300|81726354
+        // 7) G|23@81743021/30|fromID,blah
+        // 8) G|24~312|fromID,blah
         //
         // Format:
         // [command]|[frame count]|[data message(s)]...
         //
         // • Command is always NEXT_FRAME ("G") in v.2
         //
+        // • HANDSHAKE ("H") answers the options a client connected with, before its first frame.
+        //
+        // • Clients that negotiated clock sync get the frame count followed by @ and the server time
+        //   in microseconds at which the frame should be presented.
+        //
+        // • Clients that negotiated pacing get the server's target frame rate after that, following a /.
+        //
+        // • Clients whose session can resume get the number of lines the server received on the
+        //   connection last, following a ~, so they can forget them.
+        //
+        // • CLOCK_SYNC ("Y") answers a ping with the client time it carried and the server time.
+        //
+        // • TRACE ("E") asks clients that negotiated tracing for their trace events.
+        //
         // • Data Messages will start with the senders Client ID followed by a comma.
         //
+        // • A sender ID of the form fromID#msgID with an empty body references a
+        //   message that was delivered in chunks over the bulk lane.
+        //
+        // • A token starting with $ instead of a sender ID is the merged ReplicatedState
+        //   delta for the frame: G|21|$key=f1.5;other=s%3Btext
+        //
+        // NEXT_FRAME is parsed in place, data messages are handed on as views into serverMessage.
 		
-        std::vector<std::string> tokens = ci::split( serverMessage, dataMessageDelimiter() );
-        std::string command = tokens[0];
+        size_t commandEnd = std::min( serverMessage.find( dataMessageDelimiter()[0] ), serverMessage.size() );
+        boost::string_ref command = serverMessage.substr( 0, commandEnd );
 		
-        if ( command == Protocol::RESET_ALL ) {
-            handler->setCurrentRenderFrame( 1 );
-            handler->receivedResetCommand();
-        }
-        else if ( command == Protocol::NEXT_FRAME ) {
-            std::string frameNum = tokens[1];
-            handler->setCurrentRenderFrame( stol( frameNum ) );
+        if ( command == Protocol::NEXT_FRAME ) {
+            size_t tokenStart = commandEnd + 1;
+            if( tokenStart >= serverMessage.size() ) {
+                CI_LOG_E( "Missing frame number in server message" );
+                return;
+            }
+            // Numbers are followed by a delimiter or the end of the line, so they can be read in place.
+            char *numberEnd;
+            handler->setCurrentRenderFrame( strtoull( serverMessage.data() + tokenStart, &numberEnd, 10 ) );
+            const char *messageEnd = serverMessage.data() + serverMessage.size();
+            if( numberEnd < messageEnd && *numberEnd == kPresentationTimeDelimiter[0] ) {
+                handler->receivedPresentationTime( strtoull( numberEnd + 1, &numberEnd, 10 ) );
+            }
+            if( numberEnd < messageEnd && *numberEnd == kFrameRateDelimiter[0] ) {
+                handler->receivedFrameRate( strtof( numberEnd + 1, &numberEnd ) );
+            }
+            if( numberEnd < messageEnd && *numberEnd == kReceivedDelimiter[0] ) {
+                handler->receivedLinesAcknowledged( strtoull( numberEnd + 1, &numberEnd, 10 ) );
+            }
+            tokenStart = find( serverMessage, dataMessageDelimiter()[0], tokenStart );
 			
-            if ( tokens.size() > 2 ) {
-                // There are additional client messages
-                for ( int i = 2; i < tokens.size(); i++ ) {
-                    // Iterate over the messages and send them out
-                    std::string dataMessage = tokens[i];
-                    size_t firstComma = dataMessage.find_first_of( "," );
-                    if ( firstComma != std::string::npos ) {
-                        int clientID = stoi( dataMessage.substr( 0, firstComma ) );
-                        std::string messageData = dataMessage.substr( firstComma+1 );
-                        handler->receivedStringMessage( messageData, clientID );
-                    }
-                    else {
-                        CI_LOG_E("Couldn't parse data message " << dataMessage );
+            // Iterate over the additional client messages and send them out
+            while( tokenStart != boost::string_ref::npos ) {
+                ++tokenStart;
+                size_t tokenEnd = std::min( find( serverMessage, dataMessageDelimiter()[0], tokenStart ), serverMessage.size() );
+                boost::string_ref dataMessage = serverMessage.substr( tokenStart, tokenEnd - tokenStart );
+                tokenStart = ( tokenEnd < serverMessage.size() ) ? tokenEnd : boost::string_ref::npos;
+				
+                if ( dataMessage.starts_with( kStateDeltaPrefix ) ) {
+                    handler->receivedStateDelta( dataMessage.substr( kStateDeltaPrefix.size() ).to_string() );
+                    continue;
+                }
+                size_t firstComma = dataMessage.find( ',' );
+                if ( firstComma != boost::string_ref::npos ) {
+                    uint32_t clientID = strtoul( dataMessage.data(), nullptr, 10 );
+                    size_t bulkRef = dataMessage.find( kBulkReferenceDelimiter[0] );
+                    if( bulkRef < firstComma ) {
+                        handler->receivedBulkMessage( strtoul( dataMessage.data() + bulkRef + 1, nullptr, 10 ), clientID );
+                        continue;
                     }
+                    handler->receivedDataMessage( dataMessage.substr( firstComma + 1 ), clientID );
+                }
+                else {
+                    CI_LOG_E("Couldn't parse data message " << dataMessage );
                 }
             }
 			
             handler->setFrameIsReady( true );
         }
+        else if ( command == Protocol::HANDSHAKE ) {
+            std::vector<std::string> tokens = ci::split( serverMessage.to_string(), dataMessageDelimiter() );
+            HandshakeOptions options;
+            for ( size_t i = 1; i < tokens.size(); i++ ) {
+                size_t equals = tokens[i].find( '=' );
+                if ( equals != std::string::npos ) {
+                    options[tokens[i].substr( 0, equals )] = tokens[i].substr( equals + 1 );
+                }
+            }
+            handler->receivedHandshake( options );
+        }
+        else if ( command == Protocol::CLOCK_SYNC ) {
+            size_t serverTimeStart = find( serverMessage, dataMessageDelimiter()[0], commandEnd + 1 );
+            if( serverTimeStart == boost::string_ref::npos ) {
+                CI_LOG_E( "Missing server time in clock sync: " << serverMessage );
+                return;
+            }
+            handler->receivedClockSample( strtoull( serverMessage.data() + commandEnd + 1, nullptr, 10 ),
+                                          strtoull( serverMessage.data() + serverTimeStart + 1, nullptr, 10 ) );
+        }
+        else if ( command == Protocol::TRACE ) {
+            handler->receivedTraceRequest();
+        }
+        else if ( command == Protocol::RESET_ALL ) {
+            handler->setCurrentRenderFrame( 1 );
+            handler->receivedResetCommand();
+        }
         else
         {
             CI_LOG_E( "Don't know what to do with server message: " << serverMessage );
@@ -219,6 +622,85 @@ public:
         }
     }
 	
+	//! Calls \a ready with the ( fromID, msgID ) of every bulk message that \a serverMessage references,
+	//! until it returns false. The frame can't be dispatched until all of them have been reassembled.
+	template<typename Predicate>
+	static bool allBulkReferences( boost::string_ref serverMessage, Predicate ready )
+	{
+		if( ! serverMessage.starts_with( NEXT_FRAME ) )
+			return true;
+		
+		// Skip the command and the frame number, then look at the sender ID of every data message.
+		const char delimiter = dataMessageDelimiter()[0];
+		size_t tokenStart = serverMessage.find( delimiter );
+		tokenStart = ( tokenStart == boost::string_ref::npos ) ? tokenStart : find( serverMessage, delimiter, tokenStart + 1 );
+		while( tokenStart != boost::string_ref::npos ) {
+			++tokenStart;
+			size_t comma = find( serverMessage, ',', tokenStart );
+			size_t tokenEnd = find( serverMessage, delimiter, tokenStart );
+			size_t ref = find( serverMessage, kBulkReferenceDelimiter[0], tokenStart );
+			if( ref < comma && comma < tokenEnd ) {
+				uint32_t fromID = strtoul( serverMessage.data() + tokenStart, nullptr, 10 );
+				uint32_t msgID = strtoul( serverMessage.data() + ref + 1, nullptr, 10 );
+				if( ! ready( fromID, msgID ) )
+					return false;
+			}
+			tokenStart = tokenEnd;
+		}
+		return true;
+	}
+	
+	//! Parses a message received on the bulk lane.
+	static void parseBulk( const std::string &serverMessage, ClientMessageHandler *handler )
+	{
+		// Example bulk lane messages:
+		// 1) B
+		// 2) C|fromID|msgID|offset|total|chunk
+		// 3) M|fromID|streamID|offset|total|base64
+		//
+		// • B acknowledges the bulk lane. Nothing is sent on it before that.
+		//
+		// • Chunks of the same message arrive in order. The message is handed to the App
+		//   once a NEXT_FRAME references it as fromID#msgID.
+		//
+		// • Streams share the message IDs of their sender. Their offsets count decoded bytes.
+		//
+		if( serverMessage == BULK_LANE_CONNECT ) {
+			handler->bulkLaneAccepted();
+			return;
+		}
+		
+		// Split by hand, the chunk itself can be large and is only copied once.
+		size_t fields[5];
+		size_t pos = 0;
+		for( auto & field : fields ) {
+			pos = serverMessage.find( dataMessageDelimiter(), pos );
+			if( pos == std::string::npos ) {
+				CI_LOG_E( "Couldn't parse bulk message " << serverMessage.substr( 0, 64 ) );
+				return;
+			}
+			field = ++pos;
+		}
+		bool isStream = serverMessage.compare( 0, fields[0] - 1, DATA_STREAM ) == 0;
+		if( ! isStream && serverMessage.compare( 0, fields[0] - 1, DATA_CHUNK ) != 0 ) {
+			CI_LOG_E( "Don't know what to do with bulk message " << serverMessage.substr( 0, 64 ) );
+			return;
+		}
+		
+		uint32_t fromID = stoul( serverMessage.substr( fields[0], fields[1] - fields[0] - 1 ) );
+		uint32_t msgID = stoul( serverMessage.substr( fields[1], fields[2] - fields[1] - 1 ) );
+		size_t offset = stoull( serverMessage.substr( fields[2], fields[3] - fields[2] - 1 ) );
+		size_t total = stoull( serverMessage.substr( fields[3], fields[4] - fields[3] - 1 ) );
+		if( isStream ) {
+			handler->receivedStreamChunk( fromID, msgID, offset, total,
+										  serverMessage.data() + fields[4], serverMessage.size() - fields[4] );
+		}
+		else {
+			handler->receivedDataChunk( fromID, msgID, offset, total,
+									    serverMessage.data() + fields[4], serverMessage.size() - fields[4] );
+		}
+	}
+	
 	inline static void parseServer( const std::string &clientMessage, ServerMessageHandler *handler )
 	{
 		
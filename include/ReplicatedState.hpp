@@ -0,0 +1,270 @@
+//
+//  ReplicatedState.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "cinder/Vector.h"
+
+/*
+
+ ReplicatedState:
+ A typed key/value store that every client holds a copy of. Values that are set locally
+ are only collected as a delta, which the Client sends once per frame. The server merges
+ the deltas of all clients in client id order and every client applies the merged delta
+ right before its UpdateFrameCallback, so a set() is visible everywhere in the same frame,
+ including on the client that made it.
+
+ Delta format:
+ key=<type><value>;key=<type><value>...
+
+ • Types are b(ool), i(nt), f(loat), d(ouble), s(tring), 2, 3 and 4 for vectors and x for
+   an erased key. Vector components are separated by commas.
+
+ • '%', ';', '=', '|', ',' and newlines are percent encoded in keys and strings, so the server
+   can merge deltas without knowing about types.
+
+ • set() and erase() lock the pending delta, so a pipelined UpdateFrameCallback and the render
+   thread can both change state. Reading values isn't locked, they only change between frames.
+
+ */
+
+namespace mpe {
+
+class ReplicatedState {
+public:
+
+	struct Value {
+		char			mType = 0;
+		double			mNumbers[4] = { 0, 0, 0, 0 };
+		std::string		mString;
+	};
+
+	//! Sets \a key to \a value on every client, starting with the next frame.
+	template<typename T>
+	void set( const std::string &key, const T &value )
+	{
+		Value encoded;
+		Traits<T>::encode( value, encoded );
+		auto entry = serialize( encoded );
+		std::lock_guard<std::mutex> lock( mDirtyMutex );
+		mDirty[escape( key )] = std::move( entry );
+	}
+	//! Erases \a key on every client, starting with the next frame.
+	void erase( const std::string &key )
+	{
+		std::lock_guard<std::mutex> lock( mDirtyMutex );
+		mDirty[escape( key )] = std::string( 1, kErased );
+	}
+
+	//! Returns the value of \a key in the current frame, or \a defaultValue if it isn't set or has a different type.
+	template<typename T>
+	T get( const std::string &key, const T &defaultValue = T() ) const
+	{
+		auto found = mValues.find( key );
+		if( found == mValues.end() )
+			return defaultValue;
+		return decode( found->second, defaultValue );
+	}
+	//! Returns \a value as a T, or \a defaultValue if it has a different type.
+	template<typename T>
+	static T decode( const Value &value, const T &defaultValue = T() )
+	{
+		if( value.mType != Traits<T>::kType )
+			return defaultValue;
+		return Traits<T>::decode( value );
+	}
+	//! Returns whether \a key is set in the current frame.
+	bool has( const std::string &key ) const { return mValues.count( key ) > 0; }
+	//! Returns every key and value in the current frame.
+	const std::map<std::string, Value>& getValues() const { return mValues; }
+
+	//! Returns whether anything was set or erased since the last takeDelta().
+	bool isDirty() const
+	{
+		std::lock_guard<std::mutex> lock( mDirtyMutex );
+		return ! mDirty.empty();
+	}
+	//! Returns the pending changes in delta format and forgets them.
+	std::string takeDelta()
+	{
+		std::lock_guard<std::mutex> lock( mDirtyMutex );
+		std::string delta;
+		for( auto & entry : mDirty ) {
+			if( ! delta.empty() )
+				delta += kEntryDelimiter;
+			delta += entry.first + kKeyDelimiter + entry.second;
+		}
+		mDirty.clear();
+		return delta;
+	}
+	//! Applies a merged delta from the server.
+	void applyDelta( const std::string &delta )
+	{
+		size_t start = 0;
+		while( start < delta.size() ) {
+			size_t end = delta.find( kEntryDelimiter, start );
+			if( end == std::string::npos )
+				end = delta.size();
+			size_t equals = delta.find( kKeyDelimiter, start );
+			if( equals < end ) {
+				auto key = unescape( delta.substr( start, equals - start ) );
+				Value value;
+				if( deserialize( delta.substr( equals + 1, end - equals - 1 ), value ) )
+					mValues[key] = std::move( value );
+				else
+					mValues.erase( key );
+			}
+			start = end + 1;
+		}
+	}
+	//! Forgets every value and pending change. Called when the server resets.
+	void clear()
+	{
+		mValues.clear();
+		std::lock_guard<std::mutex> lock( mDirtyMutex );
+		mDirty.clear();
+	}
+
+private:
+	template<typename T> struct Traits;
+
+	static const char kEntryDelimiter = ';';
+	static const char kKeyDelimiter = '=';
+	static const char kErased = 'x';
+
+	static std::string escape( const std::string &str )
+	{
+		std::string escaped;
+		escaped.reserve( str.size() );
+		for( char c : str ) {
+			if( c == '%' || c == ';' || c == '=' || c == '|' || c == ',' || c == '\n' ) {
+				char hex[4];
+				std::snprintf( hex, sizeof( hex ), "%%%02X", static_cast<unsigned char>( c ) );
+				escaped += hex;
+			}
+			else {
+				escaped += c;
+			}
+		}
+		return escaped;
+	}
+	static std::string unescape( const std::string &str )
+	{
+		std::string unescaped;
+		unescaped.reserve( str.size() );
+		for( size_t i = 0; i < str.size(); ++i ) {
+			if( str[i] == '%' && i + 2 < str.size() ) {
+				unescaped += static_cast<char>( std::strtol( str.substr( i + 1, 2 ).c_str(), nullptr, 16 ) );
+				i += 2;
+			}
+			else {
+				unescaped += str[i];
+			}
+		}
+		return unescaped;
+	}
+
+	static int componentCount( char type )
+	{
+		switch( type ) {
+			case 'b': case 'i': case 'f': case 'd': return 1;
+			case '2': return 2;
+			case '3': return 3;
+			case '4': return 4;
+			default: return 0;
+		}
+	}
+	static std::string serialize( const Value &value )
+	{
+		std::string str( 1, value.mType );
+		if( value.mType == 's' )
+			return str + escape( value.mString );
+
+		// Enough digits to get the exact same value back on every client.
+		char number[32];
+		for( int i = 0; i < componentCount( value.mType ); ++i ) {
+			std::snprintf( number, sizeof( number ), "%.17g", value.mNumbers[i] );
+			if( i > 0 )
+				str += ',';
+			str += number;
+		}
+		return str;
+	}
+	//! Returns false for erased keys.
+	static bool deserialize( const std::string &str, Value &value )
+	{
+		if( str.empty() || str[0] == kErased )
+			return false;
+
+		value.mType = str[0];
+		if( value.mType == 's' ) {
+			value.mString = unescape( str.substr( 1 ) );
+			return true;
+		}
+		const char *number = str.c_str() + 1;
+		for( int i = 0; i < componentCount( value.mType ); ++i ) {
+			char *end;
+			value.mNumbers[i] = std::strtod( number, &end );
+			number = ( *end == ',' ) ? end + 1 : end;
+		}
+		return true;
+	}
+
+	std::map<std::string, Value>		mValues;
+	std::map<std::string, std::string>	mDirty;
+	mutable std::mutex					mDirtyMutex;
+};
+
+template<> struct ReplicatedState::Traits<bool> {
+	static const char kType = 'b';
+	static void encode( bool v, Value &value ) { value.mType = kType; value.mNumbers[0] = v ? 1 : 0; }
+	static bool decode( const Value &value ) { return value.mNumbers[0] != 0; }
+};
+template<> struct ReplicatedState::Traits<int> {
+	static const char kType = 'i';
+	static void encode( int v, Value &value ) { value.mType = kType; value.mNumbers[0] = v; }
+	static int decode( const Value &value ) { return static_cast<int>( value.mNumbers[0] ); }
+};
+template<> struct ReplicatedState::Traits<float> {
+	static const char kType = 'f';
+	static void encode( float v, Value &value ) { value.mType = kType; value.mNumbers[0] = v; }
+	static float decode( const Value &value ) { return static_cast<float>( value.mNumbers[0] ); }
+};
+template<> struct ReplicatedState::Traits<double> {
+	static const char kType = 'd';
+	static void encode( double v, Value &value ) { value.mType = kType; value.mNumbers[0] = v; }
+	static double decode( const Value &value ) { return value.mNumbers[0]; }
+};
+template<> struct ReplicatedState::Traits<std::string> {
+	static const char kType = 's';
+	static void encode( const std::string &v, Value &value ) { value.mType = kType; value.mString = v; }
+	static std::string decode( const Value &value ) { return value.mString; }
+};
+template<> struct ReplicatedState::Traits<ci::vec2> {
+	static const char kType = '2';
+	static void encode( const ci::vec2 &v, Value &value ) { value.mType = kType; value.mNumbers[0] = v.x; value.mNumbers[1] = v.y; }
+	static ci::vec2 decode( const Value &value ) { return ci::vec2( value.mNumbers[0], value.mNumbers[1] ); }
+};
+template<> struct ReplicatedState::Traits<ci::vec3> {
+	static const char kType = '3';
+	static void encode( const ci::vec3 &v, Value &value )
+	{ value.mType = kType; value.mNumbers[0] = v.x; value.mNumbers[1] = v.y; value.mNumbers[2] = v.z; }
+	static ci::vec3 decode( const Value &value ) { return ci::vec3( value.mNumbers[0], value.mNumbers[1], value.mNumbers[2] ); }
+};
+template<> struct ReplicatedState::Traits<ci::vec4> {
+	static const char kType = '4';
+	static void encode( const ci::vec4 &v, Value &value )
+	{ value.mType = kType; value.mNumbers[0] = v.x; value.mNumbers[1] = v.y; value.mNumbers[2] = v.z; value.mNumbers[3] = v.w; }
+	static ci::vec4 decode( const Value &value )
+	{ return ci::vec4( value.mNumbers[0], value.mNumbers[1], value.mNumbers[2], value.mNumbers[3] ); }
+};
+
+}
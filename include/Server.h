@@ -11,12 +11,13 @@
 #include "TcpServer.h"
 
 #include "ServerBase.hpp"
+#include "IoUringTransport.h"
 
 namespace mpe {
 	
 using ServerRef = std::shared_ptr<class Server>;
 	
-class Server : public ServerBase, std::enable_shared_from_this<Server> {
+class Server : public ServerBase, public std::enable_shared_from_this<Server> {
 public:
 	static ServerRef create( const ci::DataSourceRef &jsonSettingsFile, asio::io_service &service = ci::app::App::get()->io_service(), bool thread = false );
 	
@@ -27,6 +28,8 @@ public:
 	
 	struct ClientConnection {
 		ClientConnection( const TcpSessionRef &session, const ServerRef &mParent );
+		//! A connection of the io_uring backend, which delivers its reads through receive().
+		ClientConnection( uint32_t connection, const ServerRef &mParent );
 		
 		~ClientConnection();
 		
@@ -34,7 +37,9 @@ public:
 		void onClose();
 		void onRead( const ci::BufferRef &buffer );
 		void onWrite( size_t bytesTransferred );
+		void receive( const char *data, size_t size );
 		
+		//! Sent right away with asio, with io_uring when the server submits at the end of update().
 		void write( std::string &message );
 		
 		uint32_t getId() const { return mId; }
@@ -42,15 +47,20 @@ public:
 		std::shared_ptr<std::mutex>& getMessageMutex() { return mMessageMutex; }
 		
 	private:
+		void readConnect( const std::string &message );
+		
 		TcpSessionRef					mSession;
 		ServerRef						mParent;
 		std::string						mName;
 		std::deque<std::string>			mMessages;
+		std::string						mPartial;
 		std::shared_ptr<std::mutex>		mMessageMutex;
 		uint64_t						mFrameNumber;
 		uint32_t						mId;
+		uint32_t						mConnection;
 		bool							mIsAsync;
 		bool							mShouldReceiveData;
+		bool							mIsConnected;
 		
 		friend class Server;
 	};
@@ -61,6 +71,8 @@ private:
 	void loadSettings( const ci::DataSourceRef &jsonSettingsFile );
 	
 	void onAccept( TcpSessionRef session );
+	//! Returns false if io_uring isn't built in or available, the server uses asio then.
+	bool startIoUring();
 	void onError( std::string error, size_t bytesTransferred );
 	void onCancel();
 	
@@ -70,11 +82,15 @@ private:
 	TcpServerRef			mTcpServer;
 	Connections				mTcpConnections;
 	uint16_t				mPort;
+	bool					mUseIoUring;
+#if defined( __linux__ ) && defined( MPE_HAS_IO_URING )
+	std::unique_ptr<IoUringTransport>	mIoUring;
+#endif
 	
 	std::deque<std::string> mMessages;
 	std::mutex				mMessagesMutex;
 	
-	const uint16_t			mTotalAllowedConnections;
+	uint16_t				mTotalAllowedConnections;	// settings
 	const uint8_t			mFPSUpdate;
 	bool					mIsThreaded;
 };
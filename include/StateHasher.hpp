@@ -0,0 +1,119 @@
+//
+//  StateHasher.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+/*
+
+ StateHasher:
+ A hash of the app's state that's kept up to date as the state changes, so sync clients can
+ tell the server what they have without sending it. The Client sends it with every frame it
+ confirms and the server reports the first frame and client where the hashes disagree.
+
+	void MyApp::moveBall( Ball &ball, const vec2 &to )
+	{
+		auto & hasher = mClient->getStateHasher();
+		hasher.remove( ball.mId, ball.mPos );
+		ball.mPos = to;
+		hasher.add( ball.mId, ball.mPos );
+	}
+
+ • The hash is the XOR of a mixed hash of every (key, value) that was added and not removed,
+   so the order doesn't matter and a change costs two hashes of the value.
+
+ • Values are hashed by their bytes. They have to be trivially copyable, without padding that
+   differs between clients, and floats only match if they were computed the same way.
+
+ • The Client clears it when the server resets, before the ResetCallback.
+
+ */
+
+namespace mpe {
+
+class StateHasher {
+public:
+	StateHasher() : mHash( 0 ), mIsUsed( false ) {}
+
+	//! Adds \a size bytes at \a data under \a key.
+	void add( uint64_t key, const void *data, size_t size ) { toggle( key, data, size ); }
+	//! Removes what add() added with the same \a key and bytes.
+	void remove( uint64_t key, const void *data, size_t size ) { toggle( key, data, size ); }
+	//! Replaces \a before under \a key with \a after.
+	void replace( uint64_t key, const void *before, const void *after, size_t size )
+	{
+		toggle( key, before, size );
+		toggle( key, after, size );
+	}
+
+	template<typename T>
+	void add( uint64_t key, const T &value )
+	{
+		static_assert( std::is_trivially_copyable<T>::value, "Only trivially copyable values can be hashed by their bytes" );
+		toggle( key, &value, sizeof( T ) );
+	}
+	template<typename T>
+	void remove( uint64_t key, const T &value ) { add( key, value ); }
+	template<typename T>
+	void replace( uint64_t key, const T &before, const T &after )
+	{
+		add( key, before );
+		add( key, after );
+	}
+	void add( uint64_t key, const std::string &value ) { toggle( key, value.data(), value.size() ); }
+	void remove( uint64_t key, const std::string &value ) { toggle( key, value.data(), value.size() ); }
+
+	uint64_t	get() const { return mHash; }
+	//! Whether anything was hashed since the client started, the Client only sends hashes then.
+	bool		isUsed() const { return mIsUsed; }
+	void		clear() { mHash = 0; }
+
+	//! The hash of \a size bytes at \a data, seeded with \a key.
+	static uint64_t hash( uint64_t key, const void *data, size_t size )
+	{
+		const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+		uint64_t h = mix( key ^ ( size * prime ) );
+		const unsigned char *bytes = static_cast<const unsigned char*>( data );
+		while( size >= 8 ) {
+			uint64_t word;
+			memcpy( &word, bytes, 8 );
+			h = ( h ^ mix( word ) ) * prime;
+			bytes += 8;
+			size -= 8;
+		}
+		if( size > 0 ) {
+			uint64_t word = 0;
+			memcpy( &word, bytes, size );
+			h = ( h ^ mix( word ) ) * prime;
+		}
+		return mix( h );
+	}
+
+private:
+	// The splitmix64 finalizer, so a bit that differs flips half of the hash.
+	static uint64_t mix( uint64_t x )
+	{
+		x ^= x >> 30;
+		x *= 0xBF58476D1CE4E5B9ULL;
+		x ^= x >> 27;
+		x *= 0x94D049BB133111EBULL;
+		return x ^ ( x >> 31 );
+	}
+
+	void toggle( uint64_t key, const void *data, size_t size )
+	{
+		mHash ^= hash( key, data, size );
+		mIsUsed = true;
+	}
+
+	uint64_t	mHash;
+	bool		mIsUsed;
+};
+
+}
@@ -0,0 +1,183 @@
+//
+//  Trace.hpp
+//  Cinder-MPE
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ClockSync.hpp"
+
+/*
+
+ Trace:
+ A timeline of what every thread did in which frame, for finding where a wall stutters. Each
+ thread records events into a ring of its own without taking a lock, and the Client sends them
+ to the server when it asks, which merges them with the clients' and its own into one Chrome
+ trace (chrome://tracing or ui.perfetto.dev). See mpe_server.py --trace.
+
+	void MyApp::draw()
+	{
+		MPE_TRACE_SCOPE( "draw" );
+		...
+	}
+
+ • Tracing is off until setEnabled( true ), or "trace" in the Client settings. While it's off a
+   trace point costs a relaxed load and a branch. Define MPE_DISABLE_TRACE to compile them out.
+
+ • Names have to be string literals, since only the pointer is kept, without | , or ;.
+
+ • Times are on the local clock in microseconds. The Client converts them to the server clock
+   when it sends them, so events of different machines line up as well as the clocks do.
+
+ • Each thread keeps its last kCapacity events, older ones are overwritten.
+
+ */
+
+#define MPE_TRACE_CONCAT_( a, b ) a##b
+#define MPE_TRACE_CONCAT( a, b ) MPE_TRACE_CONCAT_( a, b )
+
+#if defined( MPE_DISABLE_TRACE )
+#define MPE_TRACE_SCOPE( name )
+#define MPE_TRACE_INSTANT( name )
+#else
+//! Records the time from here to the end of the enclosing scope as \a name.
+#define MPE_TRACE_SCOPE( name ) ::mpe::Trace::Scope MPE_TRACE_CONCAT( mpeTraceScope, __LINE__ )( name )
+//! Records the moment it's reached as \a name.
+#define MPE_TRACE_INSTANT( name ) ( ::mpe::Trace::isEnabled() ? ::mpe::Trace::instant( name, ::mpe::Trace::getFrame() ) : (void)0 )
+#endif
+
+namespace mpe {
+
+class Trace {
+public:
+	static const size_t kCapacity = 4096;
+
+	struct Event {
+		const char	*mName;
+		uint64_t	mBegin;
+		uint64_t	mDuration;
+		uint64_t	mFrame;
+		uint32_t	mThread;
+		bool		mIsInstant;
+	};
+
+	//! Records the time a scope takes, with the frame that's current when it ends.
+	class Scope {
+	public:
+		explicit Scope( const char *name ) : mName( name ), mBegin( isEnabled() ? ClockSync::now() : 0 ) {}
+		~Scope()
+		{
+			if( mBegin != 0 )
+				complete( mName, mBegin, ClockSync::now(), getFrame() );
+		}
+		Scope( const Scope & ) = delete;
+		Scope& operator=( const Scope & ) = delete;
+
+	private:
+		const char	*mName;
+		uint64_t	mBegin;
+	};
+
+	static bool		isEnabled() { return enabled().load( std::memory_order_relaxed ); }
+	static void		setEnabled( bool enable ) { enabled().store( enable, std::memory_order_relaxed ); }
+	//! The frame events are recorded with. The Client sets it when a frame arrives.
+	static uint64_t	getFrame() { return frame().load( std::memory_order_relaxed ); }
+	static void		setFrame( uint64_t frameNum ) { frame().store( frameNum, std::memory_order_relaxed ); }
+
+	//! Records \a name at this moment on the calling thread.
+	static void instant( const char *name, uint64_t frameNum )
+	{
+		Ring &r = ring();
+		r.push( Event{ name, ClockSync::now(), 0, frameNum, r.mThread, true } );
+	}
+	//! Records \a name from local time \a begin to \a end on the calling thread.
+	static void complete( const char *name, uint64_t begin, uint64_t end, uint64_t frameNum )
+	{
+		Ring &r = ring();
+		r.push( Event{ name, begin, end > begin ? end - begin : 0, frameNum, r.mThread, false } );
+	}
+
+	//! Returns the events every thread still has, oldest first for each thread. Threads keep recording meanwhile.
+	static std::vector<Event> collect()
+	{
+		std::vector<std::shared_ptr<Ring>> rings;
+		{
+			std::lock_guard<std::mutex> lock( registry().mMutex );
+			rings = registry().mRings;
+		}
+		std::vector<Event> events;
+		for( auto &r : rings ) {
+			uint64_t head = r->mHead.load( std::memory_order_acquire );
+			uint64_t first = head > kCapacity ? head - kCapacity : 0;
+			size_t start = events.size();
+			for( uint64_t i = first; i < head; ++i )
+				events.push_back( r->mEvents[i & ( kCapacity - 1 )] );
+			// Events the thread wrote over while they were copied are dropped, they may be torn.
+			uint64_t after = r->mHead.load( std::memory_order_acquire );
+			uint64_t overwritten = after > kCapacity ? after - kCapacity : 0;
+			if( overwritten > first )
+				events.erase( events.begin() + start, events.begin() + start + std::min<uint64_t>( overwritten - first, head - first ) );
+		}
+		return events;
+	}
+
+private:
+	static_assert( ( kCapacity & ( kCapacity - 1 ) ) == 0, "The capacity has to be a power of two" );
+
+	//! Written by its thread only. mHead counts every event ever pushed, the reader finds the last ones from it.
+	struct Ring {
+		Event					mEvents[kCapacity];
+		std::atomic<uint64_t>	mHead{ 0 };
+		uint32_t				mThread = 0;
+
+		void push( const Event &event )
+		{
+			uint64_t head = mHead.load( std::memory_order_relaxed );
+			mEvents[head & ( kCapacity - 1 )] = event;
+			mHead.store( head + 1, std::memory_order_release );
+		}
+	};
+	//! Owns the rings, so the events of threads that ended can still be collected.
+	struct Registry {
+		std::mutex							mMutex;
+		std::vector<std::shared_ptr<Ring>>	mRings;
+	};
+
+	static std::atomic<bool>& enabled()
+	{
+		static std::atomic<bool> sEnabled( false );
+		return sEnabled;
+	}
+	static std::atomic<uint64_t>& frame()
+	{
+		static std::atomic<uint64_t> sFrame( 0 );
+		return sFrame;
+	}
+	static Registry& registry()
+	{
+		static Registry sRegistry;
+		return sRegistry;
+	}
+	static Ring& ring()
+	{
+		// Only a thread's first event takes the lock.
+		thread_local Ring *sRing = nullptr;
+		if( ! sRing ) {
+			auto r = std::make_shared<Ring>();
+			std::lock_guard<std::mutex> lock( registry().mMutex );
+			r->mThread = static_cast<uint32_t>( registry().mRings.size() );
+			registry().mRings.push_back( r );
+			sRing = r.get();
+		}
+		return *sRing;
+	}
+};
+
+}
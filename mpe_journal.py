@@ -0,0 +1,194 @@
+#
+#  mpe_journal.py
+#  The session journal that mpe_server.py records with --journal and mpe_replay.py plays back.
+#
+#  A journal is an append-only file written through a memory map:
+#
+#  File header, 32 bytes:
+#  "MPEJ", u16 version, u16 header size, u64 start time, u64 bytes used, u64 offset of the last index block
+#
+#  Records, one after the other:
+#  u32 payload size, u8 kind, u8 flags, u16 client id, u64 time, u64 frame, payload
+#
+#  • Numbers are little endian, times are microseconds since the start time.
+#
+#  • Kinds are I(nbound) lines from a client, O(utbound) lines to a client and inde(X) blocks.
+#    Lines are stored as they were on the wire, with their newline. FLAG_BULK_LANE marks lines
+#    of a bulk lane connection. Lines from a connection that hasn't sent its client id yet have
+#    NO_CLIENT.
+#
+#  • Frames are numbered by release in the journal, starting at 1, so they keep counting when the
+#    server resets. Every record has the frame it belongs to, a frame starts with its releases.
+#
+#  • Index blocks hold ( frame, offset ) for the frames since the block before, after the offset
+#    of that block: u64 previous index offset, u32 count, u32 reserved, count * ( u64, u64 ). The
+#    header points to the last one, so a reader seeks by walking back from there.
+#
+#  The header is rewritten after every record, so a journal of a server that crashed is readable
+#  up to the last complete record.
+#
+
+import mmap
+import struct
+
+MAGIC = b"MPEJ"
+VERSION = 1
+FILE_HEADER = struct.Struct("<4sHHQQQ")
+RECORD_HEADER = struct.Struct("<IBBHQQ")
+INDEX_HEADER = struct.Struct("<QII")
+INDEX_ENTRY = struct.Struct("<QQ")
+
+KIND_INBOUND = ord("I")
+KIND_OUTBOUND = ord("O")
+KIND_INDEX = ord("X")
+FLAG_BULK_LANE = 1
+NO_CLIENT = 0xFFFF
+
+class Record:
+
+    def __init__(self, offset, kind, flags, client_id, time, frame, payload):
+        self.offset = offset
+        self.kind = kind
+        self.flags = flags
+        self.client_id = client_id
+        self.time = time
+        self.frame = frame
+        self.payload = payload
+
+class JournalWriter:
+
+    def __init__(self, path, start_time, index_interval=64, grow_by=64 << 20):
+        self.file = open(path, "w+b")
+        self.start_time = start_time
+        self.index_interval = index_interval
+        self.grow_by = grow_by
+        self.capacity = 0
+        self.map = None
+        self.used = FILE_HEADER.size
+        self.last_index = 0
+        self.last_time = 0
+        self.frame = 0
+        # ( frame, offset ) of the frames since the last index block
+        self.pending = []
+        self.reserve(self.used)
+        self.writeHeader()
+
+    def reserve(self, size):
+        # The file grows in big steps, remapping on every record would cost more than the writes.
+        if size <= self.capacity:
+            return
+        if self.map is not None:
+            self.map.close()
+        self.capacity = max(size, self.capacity + self.grow_by)
+        self.file.truncate(self.capacity)
+        self.map = mmap.mmap(self.file.fileno(), self.capacity)
+
+    def writeHeader(self):
+        self.map[0:FILE_HEADER.size] = FILE_HEADER.pack(MAGIC, VERSION, FILE_HEADER.size, self.start_time,
+                                                        self.used, self.last_index)
+
+    def append(self, kind, flags, client_id, time, payload):
+        # Returns the offset of the record.
+        offset = self.used
+        start = offset + RECORD_HEADER.size
+        end = start + len(payload)
+        self.reserve(end)
+        self.last_time = max(self.last_time, time - self.start_time)
+        self.map[offset:start] = RECORD_HEADER.pack(len(payload), kind, flags, client_id & 0xFFFF,
+                                                    self.last_time, self.frame)
+        self.map[start:end] = payload
+        self.used = end
+        self.writeHeader()
+        return offset
+
+    def beginFrame(self):
+        # Called right before a frame is released.
+        self.frame += 1
+        self.pending.append((self.frame, self.used))
+        if len(self.pending) >= self.index_interval:
+            self.writeIndex()
+
+    def writeIndex(self):
+        payload = INDEX_HEADER.pack(self.last_index, len(self.pending), 0)
+        payload += b"".join(INDEX_ENTRY.pack(frame, offset) for frame, offset in self.pending)
+        self.last_index = self.append(KIND_INDEX, 0, NO_CLIENT, self.start_time + self.last_time, payload)
+        self.pending = []
+        self.writeHeader()
+
+    def close(self):
+        if self.map is None:
+            return
+        if len(self.pending) > 0:
+            self.writeIndex()
+        self.map.flush()
+        self.map.close()
+        self.map = None
+        self.file.truncate(self.used)
+        self.file.close()
+
+class JournalReader:
+
+    def __init__(self, path):
+        self.file = open(path, "rb")
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, self.header_size, self.start_time, self.used, self.last_index = FILE_HEADER.unpack_from(self.map, 0)
+        if magic != MAGIC or version != VERSION:
+            raise ValueError("Not an MPE journal, or a version this reader doesn't know")
+        self.used = min(self.used, len(self.map))
+
+    def recordAt(self, offset):
+        # Returns the record at offset, or None past the end.
+        if offset + RECORD_HEADER.size > self.used:
+            return None
+        size, kind, flags, client_id, time, frame = RECORD_HEADER.unpack_from(self.map, offset)
+        start = offset + RECORD_HEADER.size
+        if start + size > self.used:
+            return None
+        return Record(offset, kind, flags, client_id, time, frame, self.map[start:start + size])
+
+    def records(self, offset=None):
+        # Yields the records from offset, or from the start, without the index blocks.
+        offset = self.header_size if offset is None else offset
+        while True:
+            record = self.recordAt(offset)
+            if record is None:
+                return
+            offset += RECORD_HEADER.size + len(record.payload)
+            if record.kind != KIND_INDEX:
+                yield record
+
+    def indexEntries(self, offset):
+        # Returns the previous index offset and the ( frame, offset ) entries of an index block.
+        start = offset + RECORD_HEADER.size
+        previous, count, _ = INDEX_HEADER.unpack_from(self.map, start)
+        start += INDEX_HEADER.size
+        return previous, [INDEX_ENTRY.unpack_from(self.map, start + i * INDEX_ENTRY.size) for i in range(count)]
+
+    def seek(self, frame):
+        # Returns the offset of the first record of frame, or of the end if there is none.
+        best = self.header_size
+        index = self.last_index
+        while index != 0:
+            previous, entries = self.indexEntries(index)
+            if len(entries) > 0 and entries[0][0] <= frame:
+                best = max(offset for entry_frame, offset in entries if entry_frame <= frame)
+                break
+            index = previous
+        # Frames after the last index block aren't indexed, they're found by scanning.
+        for record in self.records(best):
+            if record.frame >= frame:
+                return record.offset
+        return self.used
+
+    def frameCount(self):
+        last = 0
+        index = self.last_index
+        if index != 0:
+            last = self.indexEntries(index)[1][-1][0]
+        for record in self.records(self.seek(last)):
+            last = max(last, record.frame)
+        return last
+
+    def close(self):
+        self.map.close()
+        self.file.close()
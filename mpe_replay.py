@@ -0,0 +1,185 @@
+#!/usr/bin/env python
+
+#
+#  mpe_replay.py
+#  Plays back a journal recorded with mpe_server.py --journal.
+#
+#  info    Prints what's in the journal.
+#  server  Connects to a running server as the recorded clients and sends what they sent.
+#          Lines of a sync client wait until that client got as many frames as it had when it
+#          sent them, so the server sees the same lockstep however fast the replay runs. If the
+#          frames don't come, because the server runs with other settings, the count realigns
+#          after --frame-timeout.
+#  client  Listens like a server and sends every client that connects what the server sent it,
+#          so real clients can be benchmarked and profiled against recorded traffic.
+#
+#  --from-frame seeks with the journal's index blocks. Clients still get the lines they connected
+#  with first. --speed 1 replays in real time, 0 as fast as possible.
+#
+
+import argparse
+import socket
+import socketserver
+import threading
+import time
+
+from mpe_journal import JournalReader, KIND_INBOUND, KIND_OUTBOUND, FLAG_BULK_LANE
+
+CONNECT_PREFIXES = (b"S|", b"A|", b"B|")
+HANDSHAKE_PREFIX = b"H|"
+FRAME_PREFIX = b"G|"
+
+parser = argparse.ArgumentParser(description='Plays back a journal recorded by the Most Pixels Ever server.')
+parser.add_argument('mode', choices=['info', 'server', 'client'], help='What to do with the journal, see the top of this file.')
+parser.add_argument('journal', help='The journal file.')
+parser.add_argument('--host', dest='host', default='localhost', help='The server to connect to in server mode.')
+parser.add_argument('--port', dest='port_num', default=9002, help='The port to connect to in server mode, or to listen on in client mode.')
+parser.add_argument('--from-frame', dest='from_frame', default=1, help='The journal frame to start at.')
+parser.add_argument('--speed', dest='speed', default=1.0, help='1 for real time, 2 for twice as fast, 0 for as fast as possible.')
+parser.add_argument('--frame-timeout', dest='frame_timeout', default=2.0, help='Seconds a sync client waits for a frame in server mode before going on without it.')
+args = parser.parse_args()
+
+speed = float(args.speed)
+from_frame = int(args.from_frame)
+
+def preamble(reader, offset, kind, prefixes):
+    # The last line starting with one of prefixes of every client and lane before offset, in order.
+    lines = {}
+    for record in reader.records():
+        if record.offset >= offset:
+            break
+        if record.kind == kind and bytes(record.payload[:2]) in prefixes:
+            lines[(record.client_id, record.flags & FLAG_BULK_LANE)] = record.payload
+    return lines
+
+class Clock:
+
+    # Waits for the time of a record, relative to the first one that's played.
+    def __init__(self):
+        self.start = None
+
+    def wait(self, record_time):
+        if speed <= 0:
+            return
+        if self.start is None:
+            self.start = (time.monotonic(), record_time)
+        due = self.start[0] + (record_time - self.start[1]) / 1000000.0 / speed
+        delay = due - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+def info(reader):
+    counts = {}
+    clients = set()
+    last = None
+    for record in reader.records():
+        counts[chr(record.kind)] = counts.get(chr(record.kind), 0) + 1
+        clients.add(record.client_id)
+        last = record
+    print("Records: %s" % ", ".join("%s=%i" % item for item in sorted(counts.items())))
+    print("Clients: %s" % ", ".join(str(c) for c in sorted(clients)))
+    print("Frames: %i" % reader.frameCount())
+    if last is not None:
+        print("Duration: %.3f s" % (last.time / 1000000.0))
+
+class ServerLane:
+
+    # A connection to the server that plays one recorded client or bulk lane.
+    def __init__(self, key, connect_line):
+        self.key = key
+        self.socket = socket.create_connection((args.host, int(args.port_num)))
+        self.is_sync = connect_line.startswith(b"S|")
+        # Frames received from the server, and frames the client had received in the journal.
+        self.frames = 0
+        self.expected = 0
+        self.buffer = b""
+        self.socket.sendall(connect_line)
+
+    def read(self, timeout):
+        self.socket.settimeout(timeout)
+        try:
+            data = self.socket.recv(65536)
+        except socket.timeout:
+            return
+        if len(data) == 0:
+            raise IOError("The server closed the connection of client %i" % self.key[0])
+        lines = (self.buffer + data).split(b"\n")
+        self.buffer = lines.pop()
+        self.frames += sum(1 for line in lines if line.startswith(FRAME_PREFIX))
+
+    def waitForFrames(self):
+        deadline = time.monotonic() + float(args.frame_timeout)
+        while self.is_sync and self.frames < self.expected:
+            if time.monotonic() > deadline:
+                print("WARNING: Client %i is %i frames behind the journal, going on" % (self.key[0], self.expected - self.frames))
+                self.frames = self.expected
+                return
+            self.read(0.1)
+
+def replayToServer(reader):
+    offset = reader.seek(from_frame)
+    lanes = {}
+    for key, line in preamble(reader, offset, KIND_INBOUND, CONNECT_PREFIXES).items():
+        lanes[key] = ServerLane(key, line)
+    clock = Clock()
+    sent = 0
+    for record in reader.records(offset):
+        key = (record.client_id, record.flags & FLAG_BULK_LANE)
+        if record.kind == KIND_OUTBOUND:
+            if key in lanes and record.payload[:2] == FRAME_PREFIX:
+                lanes[key].expected += 1
+            continue
+        if record.payload[:2] in CONNECT_PREFIXES:
+            if key in lanes:
+                lanes[key].socket.close()
+            lanes[key] = ServerLane(key, record.payload)
+            continue
+        lane = lanes.get(key)
+        if lane is None:
+            continue
+        lane.waitForFrames()
+        clock.wait(record.time)
+        lane.socket.sendall(record.payload)
+        sent += 1
+    print("Sent %i lines" % sent)
+    for lane in lanes.values():
+        lane.socket.close()
+
+def replayToClients(reader):
+    offset = reader.seek(from_frame)
+    handshakes = preamble(reader, offset, KIND_OUTBOUND, (HANDSHAKE_PREFIX,))
+
+    class Handler(socketserver.StreamRequestHandler):
+        def handle(self):
+            connect_line = self.rfile.readline()
+            if connect_line[:2] not in CONNECT_PREFIXES:
+                return
+            key = (int(connect_line.split(b"|")[1]), FLAG_BULK_LANE if connect_line.startswith(b"B|") else 0)
+            print("Client %i connected%s" % (key[0], " its bulk lane" if key[1] else ""))
+            # Whatever the client sends is read and dropped, so it can't block on a full socket.
+            threading.Thread(target=lambda: [None for _ in self.rfile], daemon=True).start()
+            if key in handshakes:
+                self.wfile.write(handshakes[key])
+            clock = Clock()
+            sent = 0
+            for record in reader.records(offset):
+                if record.kind == KIND_OUTBOUND and (record.client_id, record.flags & FLAG_BULK_LANE) == key:
+                    clock.wait(record.time)
+                    self.wfile.write(record.payload)
+                    sent += 1
+            self.wfile.flush()
+            print("Sent %i lines to client %i" % (sent, key[0]))
+
+    socketserver.ThreadingTCPServer.allow_reuse_address = True
+    server = socketserver.ThreadingTCPServer(("", int(args.port_num)), Handler)
+    print("Replaying to clients on port %i" % int(args.port_num))
+    server.serve_forever()
+
+reader = JournalReader(args.journal)
+if args.mode == 'info':
+    info(reader)
+elif args.mode == 'server':
+    replayToServer(reader)
+else:
+    replayToClients(reader)
+reader.close()
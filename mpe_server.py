@@ -9,13 +9,20 @@
 #  https://github.com/wdlindmeier/Most-Pixels-Ever-Cinder
 #
 
-from twisted.internet.protocol import Factory, Protocol
+from twisted.internet.protocol import Factory, Protocol, ReconnectingClientFactory
 from twisted.internet import reactor
 from math import *
 from datetime import *
 from copy import copy
 import sys
 import argparse
+import base64
+import json
+import random
+import signal
+import time
+from collections import deque
+from mpe_journal import JournalWriter, KIND_INBOUND, KIND_OUTBOUND, FLAG_BULK_LANE
 
 # Commands
 CMD_DID_DRAW = "D"
@@ -25,42 +32,745 @@ CMD_BROADCAST = "T"
 CMD_PAUSE = "P"
 CMD_RESET = "R"
 CMD_GO = "G"
+CMD_BULK_LANE = "B"
+CMD_DATA_CHUNK = "C"
+CMD_DATA_STREAM = "M"
+CMD_HANDSHAKE = "H"
+CMD_STATE_DELTA = "K"
+CMD_COALESCED = "L"
+CMD_REGION = "W"
+CMD_SUBSCRIBE = "U"
+CMD_UNSUBSCRIBE = "X"
+CMD_PUBLISH = "O"
+CMD_CLOCK_SYNC = "Y"
+CMD_TRACE = "E"
+CMD_FORWARDED = "F"
+
+# Clients that negotiated clock sync get the frame count followed by this and the
+# server time in microseconds at which every screen should present the frame:
+# "G|framecount@present_time"
+PRESENTATION_TIME_DELIMITER = "@"
+# Clients that negotiated pacing get the target frame rate after that:
+# "G|framecount[@present_time]/fps"
+FRAME_RATE_DELIMITER = "/"
+# Resumable clients get how many of their lines the server has received on the connection
+# after that, so they can forget them: "G|framecount[@present_time][/fps]~lines_received"
+# It's only on frames that go out live, not on the ones recorded for a resume.
+RECEIVED_DELIMITER = "~"
+
+# Lines a resumable client sends after connecting are counted, so it can send the ones the
+# server missed again when it resumes. These aren't counted.
+UNCOUNTED_COMMANDS = (CMD_SYNC_CLIENT_CONNECT, CMD_ASYNC_CLIENT_CONNECT, CMD_BULK_LANE, CMD_CLOCK_SYNC, CMD_FORWARDED)
+
+# A relay sends what its clients send for the whole wall upstream, wrapped in a forward:
+# "F|client_id|line"
+RELAYED_COMMANDS = (CMD_BROADCAST, CMD_COALESCED, CMD_STATE_DELTA, CMD_REGION, CMD_PUBLISH, CMD_SUBSCRIBE,
+                    CMD_UNSUBSCRIBE, CMD_PAUSE, CMD_RESET, CMD_FORWARDED)
+
+# Relays get the messages for some clients with their ids, so they can pass them on:
+# "fromID>toID.toID,message"
+TARGETS_DELIMITER = ">"
+
+# Frames carry the merged replicated state delta as a token that starts with this:
+# "$key=value;key=value"
+STATE_DELTA_PREFIX = "$"
+
+# Data message bodies that start with this are LZ4 compressed:
+# "\x1d<raw_size>:<base64>"
+COMPRESSED_PREFIX = "\x1d"
+CODEC_LZ4 = "lz4"
 
 # Parse the command line arguments
 parser = argparse.ArgumentParser(description='Most Pixels Ever Server, conforms to protocol version 2.0')
 parser.add_argument('--screens', dest='screens', default=-1, help='The number of clients. The server won\'t start the draw loop until all of the clients are connected.')
 parser.add_argument('--port', dest='port_num', default=9002, help='The port number that the clients connect to.')
 parser.add_argument('--framerate', dest='framerate', default=60, help='The target framerate.')
+parser.add_argument('--adaptive', dest='adaptive', action='store_true', help='Lower the framerate when the sync clients can\'t keep up, and raise it again when they can.')
+parser.add_argument('--refresh', dest='refresh', default=None, help='The refresh rate of the displays. Adaptive framerates are this divided by a whole number, the target framerate by default.')
+parser.add_argument('--bulk-chunk', dest='bulk_chunk', default=16384, help='The size in bytes of the chunks sent on a client\'s bulk lane.')
+parser.add_argument('--aoi-cell', dest='aoi_cell', default=1024, help='The size in pixels of the grid cells used to find the viewports a region message touches.')
+parser.add_argument('--present-delay', dest='present_delay', default=16, help='How many milliseconds after a frame is sent clients that sync their clock should present it.')
+parser.add_argument('--resume-window', dest='resume_window', default=10, help='How many seconds the server keeps the session of a client that dropped, so it can resume without a reset.')
+parser.add_argument('--history', dest='history', default=300, help='How many frames the server keeps for each session to replay when a client resumes.')
+parser.add_argument('--trace', dest='trace', default=None, help='A file to write a Chrome trace of the last frames of the server and the clients to, when a client asks or on SIGUSR1.')
+parser.add_argument('--upstream', dest='upstream', default=None, help='host:port of a server to relay for. The clients of a relay take part in the wall of that server, which counts the relay as one sync client.')
+parser.add_argument('--relay-id', dest='relay_id', default=None, help='The client id the relay has upstream.')
+parser.add_argument('--journal', dest='journal', default=None, help='A file to record every line clients send and receive to, for mpe_replay.py.')
+parser.add_argument('--bulk-budget', dest='bulk_budget', default=262144, help='The number of bytes sent on each bulk lane per frame.')
 args = parser.parse_args()
 
 portnum = int(args.port_num)
 screens_required = int(args.screens)
 framerate = int(args.framerate)
 microseconds_per_frame = (1.0 / framerate) * 1000000
+refresh_rate = float(args.refresh) if args.refresh is not None else float(framerate)
+bulk_chunk = int(args.bulk_chunk)
+bulk_budget = int(args.bulk_budget)
+aoi_cell = int(args.aoi_cell)
+present_delay = int(float(args.present_delay) * 1000)
+resume_window = float(args.resume_window)
+history_length = int(args.history)
 framecount = 0
 screens_drawn = 0
 is_paused = False
+journal = None
 last_frame_time = datetime.now()
+pacer = None
+tracer = None
+upstream = None
+
+def serverTime():
+    # The clock that clients sync to, in microseconds.
+    return int(time.monotonic() * 1000000)
+
+def lz4Decompress(src, raw_size):
+    # Decodes an LZ4 block, the codec that Lz4.hpp encodes for the clients.
+    dst = bytearray()
+    i = 0
+    def readLength(length, i):
+        if length == 15:
+            while True:
+                byte = src[i]
+                i += 1
+                length += byte
+                if byte != 255:
+                    break
+        return length, i
+    while i < len(src):
+        token = src[i]
+        i += 1
+        literals, i = readLength(token >> 4, i)
+        dst += src[i:i + literals]
+        i += literals
+        if i >= len(src):
+            break
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        match_length, i = readLength(token & 0x0F, i)
+        match_length += 4
+        start = len(dst) - offset
+        if offset >= match_length:
+            dst += dst[start:start + match_length]
+        else:
+            # The match overlaps the bytes it produces.
+            for k in range(match_length):
+                dst.append(dst[start + k])
+    if len(dst) != raw_size:
+        raise ValueError("Corrupt LZ4 block")
+    return bytes(dst)
+
+def accumulateBody(total, delta):
+    # Adds comma separated numbers component by component, like Protocol::accumulateMessage.
+    try:
+        totals = [float(n) for n in total.split(",")]
+        deltas = [float(n) for n in delta.split(",")]
+    except ValueError:
+        print("ERROR: Accumulated messages must be comma separated numbers: " + delta)
+        return delta
+    sums = [a + b for a, b in zip(totals, deltas)] + totals[len(deltas):] + deltas[len(totals):]
+    return ",".join("%.17g" % n for n in sums)
+
+def decompressBody(body):
+    # Returns the raw body of a compressed data message, or body if it isn't compressed.
+    if not body.startswith(COMPRESSED_PREFIX):
+        return body
+    raw_size, encoded = body[1:].split(":", 1)
+    raw = lz4Decompress(base64.b64decode(encoded), int(raw_size))
+    return raw.decode("utf_8", "surrogateescape")
+
+def checkBody(body, cmd, from_client_id):
+    # Compressed bodies are decompressed when they arrive, so a malformed one is dropped here
+    # instead of failing the frame it would go out in. Returns the raw body, or None.
+    try:
+        return decompressBody(body)
+    except (ValueError, IndexError) as e:
+        print("ERROR: Dropping malformed compressed body for CMD %s from client %i: %s" % (cmd, from_client_id, e))
+        return None
+
+def parseRect(text):
+    # "x1,y1,x2,y2" in master space. Returns a normalized tuple or None.
+    try:
+        x1, y1, x2, y2 = [float(v) for v in text.split(",")]
+    except ValueError:
+        return None
+    return (min(x1, x2), min(y1, y2), max(x1, x2), max(y1, y2))
+
+class ViewportIndex:
+
+    # A uniform grid over master space. Each cell holds the ids of the clients whose
+    # viewport overlaps it, so routing a region message only looks at the viewports
+    # in the cells its bounds cover.
+
+    def __init__(self, cell_size):
+        self.cell_size = float(cell_size)
+        self.rects = {}
+        self.cells = {}
+
+    def cellsFor(self, rect):
+        x1, y1, x2, y2 = [int(floor(v / self.cell_size)) for v in rect]
+        for cx in range(x1, x2 + 1):
+            for cy in range(y1, y2 + 1):
+                yield (cx, cy)
+
+    def insert(self, client_id, rect):
+        self.remove(client_id)
+        self.rects[client_id] = rect
+        for cell in self.cellsFor(rect):
+            self.cells.setdefault(cell, set()).add(client_id)
+
+    def remove(self, client_id):
+        rect = self.rects.pop(client_id, None)
+        if rect is None:
+            return
+        for cell in self.cellsFor(rect):
+            ids = self.cells.get(cell)
+            if ids is not None:
+                ids.discard(client_id)
+                if len(ids) == 0:
+                    del self.cells[cell]
+
+    def query(self, bounds):
+        # Returns the ids of the viewports that intersect bounds, edges included.
+        hits = set()
+        bx1, by1, bx2, by2 = bounds
+        for cell in self.cellsFor(bounds):
+            for client_id in self.cells.get(cell, ()):
+                x1, y1, x2, y2 = self.rects[client_id]
+                if not (x1 > bx2 or x2 < bx1 or y1 > by2 or y2 < by1):
+                    hits.add(client_id)
+        return hits
 
 class BroadcastMessage:
 
-    def __init__(self, body, from_client_id, to_client_ids = []):
+    def __init__(self, body, from_client_id, to_client_ids = [], bulk_id = None, bulk_recipients = ()):
         self.body = body
         self.from_client_id = from_client_id
         self.to_client_ids = to_client_ids
+        # Set when the body was also sent in chunks on the bulk lanes of bulk_recipients.
+        self.bulk_id = bulk_id
+        self.bulk_recipients = set(bulk_recipients)
+        self.raw_body = None
+        # (sender, key, mode) of coalesced messages, so decimated clients can coalesce them across frames.
+        self.coalesce_key = None
+
+    def bodyFor(self, client):
+        # Compressed bodies are forwarded as is to clients that negotiated the codec,
+        # and decompressed once for everybody else.
+        if client.codec == CODEC_LZ4 or not self.body.startswith(COMPRESSED_PREFIX):
+            return self.body
+        if self.raw_body is None:
+            self.raw_body = decompressBody(self.body)
+        return self.raw_body
+
+class BulkMessage:
+
+    def __init__(self, body, from_client_id, msg_id, to_client_ids):
+        # The body is kept as bytes, chunk offsets are byte offsets.
+        self.body = body
+        self.from_client_id = from_client_id
+        self.msg_id = msg_id
+        # Like T, an empty list means whoever receives broadcasts when the message is released,
+        # which includes clients that are away and get the body inline in their recorded frame.
+        self.to_client_ids = to_client_ids
+        self.released = False
+        # Bytes sent so far to every recipient that has a bulk lane. Compressed bodies are
+        # only chunked to clients that negotiated the codec, the others get them inline.
+        compressed = body.startswith(COMPRESSED_PREFIX.encode("utf_8"))
+        self.sent = dict((client_id, 0) for client_id in to_client_ids or MPEServer.receiving_client_ids
+                         if client_id in MPEServer.bulk_lanes
+                         and (not compressed or getattr(MPEServer.clients.get(client_id), "codec", None) == CODEC_LZ4))
+
+    def isSent(self):
+        return all(offset >= len(self.body) for offset in self.sent.values())
+
+    def isReleasable(self):
+        return self.isSent()
+
+    def nextChunks(self, client_id, budget):
+        chunks = []
+        while budget > 0 and self.sent[client_id] < len(self.body):
+            offset = self.sent[client_id]
+            size = min(bulk_chunk, budget, len(self.body) - offset)
+            chunk = self.body[offset:offset + size].decode("utf_8", "surrogateescape")
+            chunks.append("%s|%i|%i|%i|%i|%s" % (CMD_DATA_CHUNK, self.from_client_id, self.msg_id, offset, len(self.body), chunk))
+            self.sent[client_id] = offset + size
+            budget -= size
+        return chunks, budget
+
+    def release(self):
+        return BroadcastMessage(self.body.decode("utf_8", "surrogateescape"), self.from_client_id, self.to_client_ids, self.msg_id, self.sent.keys())
+
+class StreamMessage:
+
+    def __init__(self, from_client_id, msg_id, total, to_client_ids):
+        # Chunks are forwarded as they arrive instead of being reassembled here.
+        # Each entry is (offset, base64 chunk), first is the index of chunks[0].
+        self.chunks = []
+        self.first = 0
+        self.total = total
+        self.received = 0
+        self.from_client_id = from_client_id
+        self.msg_id = msg_id
+        self.to_client_ids = to_client_ids
+        self.released = False
+        # Index of the next chunk for every recipient that has a bulk lane, or had one and may
+        # resume. Those get their chunks once their lane is back.
+        self.sent = dict((client_id, 0) for client_id in to_client_ids
+                         if client_id in MPEServer.bulk_lanes or MPEServer.hadBulkLane(client_id))
+        for client_id in to_client_ids:
+            if client_id not in self.sent:
+                print("ERROR: Client %i has no bulk lane and won't receive stream %i from %i" % (client_id, msg_id, from_client_id))
+
+    def addChunk(self, offset, chunk):
+        self.chunks.append((offset, chunk))
+        padding = len(chunk) - len(chunk.rstrip("="))
+        self.received = offset + len(chunk) // 4 * 3 - padding
+
+    def isSent(self):
+        end = self.first + len(self.chunks)
+        return self.received >= self.total and all(index >= end for index in self.sent.values())
+
+    def isReleasable(self):
+        # Recipients without a lane right now don't hold up the others. They get the release
+        # in their frame and hold it until the rest of the chunks arrive on their next lane.
+        end = self.first + len(self.chunks)
+        return self.received >= self.total and all(index >= end for client_id, index in self.sent.items()
+                                                   if client_id in MPEServer.bulk_lanes)
+
+    def restart(self, client_id):
+        # Chunks in flight on a lane that dropped may be lost, so a recipient that can resume
+        # is sent the stream again from the start, as long as it's still held.
+        if self.first == 0:
+            self.sent[client_id] = 0
+        else:
+            del self.sent[client_id]
+            print("ERROR: Client %i lost its bulk lane during stream %i from %i, which is gone by now" %
+                  (client_id, self.msg_id, self.from_client_id))
+
+    def nextChunks(self, client_id, budget):
+        chunks = []
+        while budget > 0 and self.sent[client_id] < self.first + len(self.chunks):
+            offset, chunk = self.chunks[self.sent[client_id] - self.first]
+            chunks.append("%s|%i|%i|%i|%i|%s" % (CMD_DATA_STREAM, self.from_client_id, self.msg_id, offset, self.total, chunk))
+            self.sent[client_id] += 1
+            budget -= len(chunk)
+        # Drop the chunks every recipient has been sent.
+        if len(self.sent) > 0:
+            done = min(self.sent.values()) - self.first
+        else:
+            done = len(self.chunks)
+        del self.chunks[:done]
+        self.first += done
+        return chunks, budget
+
+    def release(self):
+        if len(self.sent) == 0:
+            return None
+        return BroadcastMessage("", self.from_client_id, list(self.sent.keys()), self.msg_id, self.sent.keys())
+
+class FramePacer:
+
+    # Picks the framerate from how long the sync clients take to draw a frame, measured from
+    # releasing it until the last one is done. Rates are the display refresh divided by a whole
+    # number, so every frame is on screen for the same number of refreshes. A heavier load steps
+    # the rate down after a few frames, a lighter one has to last a couple of seconds, and the
+    # thresholds are apart, so the rate doesn't jitter between two divisors.
+    WINDOW = 30
+    SLOWER_AT = 0.9
+    FASTER_AT = 0.7
+    SLOWER_AFTER = 8
+    FASTER_AFTER_SECONDS = 2.0
+
+    def __init__(self, refresh, max_rate):
+        self.refresh = refresh
+        self.min_divisor = max(1, int(ceil(refresh / max_rate - 1e-6)))
+        self.divisor = self.min_divisor
+        self.samples = deque(maxlen=FramePacer.WINDOW)
+        self.slow_frames = 0
+        self.fast_frames = 0
+
+    def rate(self):
+        return self.refresh / self.divisor
+
+    def period(self):
+        return self.divisor / self.refresh
+
+    def addSample(self, seconds):
+        self.samples.append(seconds)
+        if len(self.samples) < FramePacer.WINDOW:
+            return
+        # A high percentile rather than the maximum, so a single hiccup doesn't cost a rate.
+        load = sorted(self.samples)[int(FramePacer.WINDOW * 0.9)]
+        if load > self.period() * FramePacer.SLOWER_AT:
+            self.slow_frames += 1
+            self.fast_frames = 0
+            if self.slow_frames >= FramePacer.SLOWER_AFTER:
+                self.setDivisor(max(self.divisor + 1, int(ceil(load * self.refresh / FramePacer.SLOWER_AT))))
+        elif self.divisor > self.min_divisor and load < (self.divisor - 1) / self.refresh * FramePacer.FASTER_AT:
+            self.fast_frames += 1
+            self.slow_frames = 0
+            if self.fast_frames >= self.rate() * FramePacer.FASTER_AFTER_SECONDS:
+                self.setDivisor(self.divisor - 1)
+        else:
+            self.slow_frames = 0
+            self.fast_frames = 0
+
+    def setDivisor(self, divisor):
+        self.divisor = divisor
+        self.slow_frames = 0
+        self.fast_frames = 0
+        # The samples at the old rate would count towards the next change as well.
+        self.samples.clear()
+        print("Pacing at %.6g FPS" % self.rate())
+
+class Tracer:
+
+    # Merges a timeline of the last frames into a Chrome trace. The server records when it releases
+    # each frame and when each confirmation arrives, the clients that negotiated tracing record their
+    # own events and send them when asked. Times are microseconds on the server clock.
+    SERVER_PID = 0
+    FRAMES_TID = 0
+    REPLY_TIMEOUT = 3.0
+
+    def __init__(self, path, capacity=65536):
+        self.path = path
+        self.events = deque(maxlen=capacity)
+        self.pending = None
+        self.replies = {}
+        self.timeout = None
+
+    def complete(self, name, tid, begin, end, frame):
+        self.events.append({"name": name, "ph": "X", "pid": Tracer.SERVER_PID, "tid": tid, "ts": begin,
+                            "dur": end - begin, "args": {"frame": frame}})
+
+    def instant(self, name, tid, ts, frame):
+        self.events.append({"name": name, "ph": "i", "s": "t", "pid": Tracer.SERVER_PID, "tid": tid, "ts": ts,
+                            "args": {"frame": frame}})
+
+    def collect(self):
+        if self.pending is not None:
+            print("INFO: Already collecting a trace")
+            return
+        self.pending = set()
+        self.replies = {}
+        for client_id, c in copy(MPEServer.clients).items():
+            if c.wants_trace:
+                self.pending.add(client_id)
+                self.replies[client_id] = (c.client_name, True, [])
+                c.sendMessage(CMD_TRACE)
+        print("Collecting a trace from %i clients" % len(self.pending))
+        if len(self.pending) == 0:
+            self.finish()
+        else:
+            self.timeout = reactor.callLater(Tracer.REPLY_TIMEOUT, self.finish)
+
+    def received(self, client_id, more, synchronized, events):
+        if self.pending is None or client_id not in self.pending:
+            return
+        name, _, client_events = self.replies[client_id]
+        self.replies[client_id] = (name, synchronized, client_events)
+        pid = client_id + 1
+        for token in events.split(";"):
+            if len(token) == 0:
+                continue
+            phase, tid, ts, dur, frame, event_name = token.split(",", 5)
+            event = {"name": event_name, "ph": phase, "pid": pid, "tid": int(tid), "ts": int(ts),
+                     "args": {"frame": int(frame)}}
+            if phase == "X":
+                event["dur"] = int(dur)
+            else:
+                event["s"] = "t"
+            client_events.append(event)
+        if not more:
+            self.pending.discard(client_id)
+            if len(self.pending) == 0:
+                self.timeout.cancel()
+                self.finish()
+
+    def finish(self):
+        if len(self.pending) > 0:
+            print("WARNING: No trace from clients %s" % ", ".join(str(c) for c in sorted(self.pending)))
+        events = list(self.events)
+        metadata = [{"name": "process_name", "ph": "M", "pid": Tracer.SERVER_PID, "args": {"name": "server"}},
+                    {"name": "thread_name", "ph": "M", "pid": Tracer.SERVER_PID, "tid": Tracer.FRAMES_TID,
+                     "args": {"name": "frames"}}]
+        for tid in sorted(set(e["tid"] for e in events if e["tid"] != Tracer.FRAMES_TID)):
+            metadata.append({"name": "thread_name", "ph": "M", "pid": Tracer.SERVER_PID, "tid": tid,
+                             "args": {"name": "D from client %i" % (tid - 1)}})
+        for client_id, (name, synchronized, client_events) in sorted(self.replies.items()):
+            if client_id in self.pending:
+                continue
+            label = "client %i (%s)" % (client_id, name)
+            if not synchronized:
+                label += ", clock not synchronized"
+            metadata.append({"name": "process_name", "ph": "M", "pid": client_id + 1, "args": {"name": label}})
+            events += client_events
+        # Relative to the first event, the server clock's epoch means nothing to the viewer.
+        if len(events) > 0:
+            origin = min(e["ts"] for e in events)
+            for e in events:
+                e["ts"] -= origin
+        with open(self.path, "w") as f:
+            json.dump({"traceEvents": metadata + events, "displayTimeUnit": "ms"}, f)
+        print("Wrote a trace of %i events to %s" % (len(events), self.path))
+        self.pending = None
+        self.timeout = None
+
+class UpstreamConnection(Protocol):
+
+    # The connection of a relay to the server above it. The relay joins as one sync client that
+    # has drawn a frame once all of its own sync clients have, and releases a frame to its
+    # clients when the server releases it.
+    def connectionMade(self):
+        self.buffer = b""
+        upstream.connection = self
+        upstream.resetDelay()
+        upstream.clock_samples = deque(maxlen=8)
+        if upstream.ping_call is not None and upstream.ping_call.active():
+            upstream.ping_call.cancel()
+        options = ["relay=1", "state=1", "aoi=all", "topics=1", "clock=1", "pace=1", "hash=1", "codec=" + CODEC_LZ4]
+        self.send("|".join([CMD_SYNC_CLIENT_CONNECT, "%i" % upstream.relay_id, "relay %i" % upstream.relay_id] + options))
+        upstream.pingClock()
+        print("Relaying for %s as client %i" % (args.upstream, upstream.relay_id))
+
+    def connectionLost(self, reason):
+        if upstream.connection is self:
+            upstream.connection = None
+        print("Lost the upstream server")
+
+    def dataReceived(self, data):
+        self.buffer += data
+        lines = self.buffer.split(b"\n")
+        self.buffer = lines.pop()
+        for line in lines:
+            if len(line) > 0:
+                upstream.messageReceived(line.decode("utf_8", "surrogateescape"))
+
+    def send(self, message):
+        self.transport.write((message + "\n").encode("utf_8", "surrogateescape"))
+
+class Upstream(ReconnectingClientFactory):
+
+    protocol = UpstreamConnection
+    maxDelay = 5
+
+    def __init__(self, relay_id):
+        self.relay_id = relay_id
+        self.connection = None
+        self.confirmed_frame = 0
+        self.is_releasing = False
+        self.is_resetting = False
+        # The frame being released, its presentation time on this server's clock and the rate.
+        self.present_time = None
+        self.rate = None
+        # (round trip, upstream minus local) of the last clock pings
+        self.clock_samples = deque(maxlen=8)
+        self.ping_call = None
+
+    def send(self, message):
+        if self.connection is not None:
+            self.connection.send(message)
+
+    def forward(self, client_id, message):
+        # Forwards that come from a relay further down already carry their client.
+        if message.startswith(CMD_FORWARDED + "|"):
+            self.send(message)
+        else:
+            self.send("%s|%i|%s" % (CMD_FORWARDED, client_id, message))
+
+    def confirm(self, state_hash=None):
+        # Called instead of releasing the next frame, once the clients have drawn this one. The hash
+        # the clients agreed on goes up, so the server above compares it with the other relays'.
+        if framecount > self.confirmed_frame:
+            self.confirmed_frame = framecount
+            if state_hash is not None:
+                self.send("%s|%i|%i|%016x" % (CMD_DID_DRAW, self.relay_id, framecount, state_hash))
+            else:
+                self.send("%s|%i|%i" % (CMD_DID_DRAW, self.relay_id, framecount))
+
+    def pingClock(self):
+        if self.connection is None:
+            return
+        self.send("%s|%i" % (CMD_CLOCK_SYNC, serverTime()))
+        self.ping_call = reactor.callLater(0.1 if len(self.clock_samples) < self.clock_samples.maxlen else 2.0, self.pingClock)
+
+    def toLocalTime(self, upstream_time):
+        # Presentation times are converted with the offset of the ping that took the shortest.
+        if len(self.clock_samples) == 0:
+            return upstream_time
+        return upstream_time - min(self.clock_samples)[1]
+
+    def messageReceived(self, message):
+        global framecount
+        tokens = message.split("|")
+        cmd = tokens[0]
+        if cmd == CMD_GO:
+            # Format:
+            # "G|framecount[@present_time][/fps]|message|message..."
+            # The messages go out with this relay's frame, which has the same number.
+            head = tokens[1]
+            self.rate = None
+            self.present_time = None
+            if FRAME_RATE_DELIMITER in head:
+                head, rate = head.split(FRAME_RATE_DELIMITER, 1)
+                self.rate = float(rate)
+            if PRESENTATION_TIME_DELIMITER in head:
+                head, present_time = head.split(PRESENTATION_TIME_DELIMITER, 1)
+                self.present_time = self.toLocalTime(int(present_time))
+            for token in tokens[2:]:
+                if token.startswith(STATE_DELTA_PREFIX):
+                    MPEServer.state_deltas[-1] = dict(entry.split("=", 1) for entry in token[len(STATE_DELTA_PREFIX):].split(";") if "=" in entry)
+                    continue
+                sender, body = token.split(",", 1)
+                to_client_ids = []
+                if TARGETS_DELIMITER in sender:
+                    sender, targets = sender.split(TARGETS_DELIMITER, 1)
+                    to_client_ids = [int(client_id) for client_id in targets.split(".")]
+                    # Messages for the relay itself, like region messages, are for all of its clients.
+                    if self.relay_id in to_client_ids:
+                        to_client_ids = []
+                MPEServer.message_queue.append(BroadcastMessage(body, int(sender), to_client_ids))
+            framecount = int(head) - 1
+            self.is_releasing = True
+            MPEServer.sendNextFrame()
+            self.is_releasing = False
+            # Without sync clients nobody draws, the frame is done right away.
+            if MPEServer.isNextFrameReady():
+                self.confirm()
+        elif cmd == CMD_RESET:
+            self.confirmed_frame = 0
+            self.is_resetting = True
+            MPEServer.reset()
+            self.is_resetting = False
+        elif cmd == CMD_CLOCK_SYNC:
+            # Format:
+            # "Y|relay_time|upstream_time"
+            received = serverTime()
+            sent = int(tokens[1])
+            self.clock_samples.append((received - sent, int(tokens[2]) - (sent + received) // 2))
+        elif cmd != CMD_HANDSHAKE:
+            print("Unknown message from upstream: " + message)
+
+class CollapsedFrame:
+
+    # The frames a decimated async client skipped, delivered as one with the number of the last.
+    # Messages keep their order, coalesced ones replace or add to the one of an earlier frame,
+    # and the state deltas are merged.
+    def __init__(self):
+        self.head = None
+        self.state = None
+        self.tokens = []
+        # coalesce key: index in tokens
+        self.coalesced = {}
+
+    def add(self, head, state_token, messages):
+        # messages are (coalesce key or None, token) pairs.
+        self.head = head
+        if state_token is not None:
+            entries = dict(entry.split("=", 1) for entry in state_token[len(STATE_DELTA_PREFIX):].split(";") if "=" in entry)
+            if self.state is None:
+                self.state = entries
+            else:
+                self.state.update(entries)
+        for key, token in messages:
+            index = self.coalesced.get(key) if key is not None else None
+            if index is None:
+                if key is not None:
+                    self.coalesced[key] = len(self.tokens)
+                self.tokens.append(token)
+            elif key[2] == "a":
+                sender, body = self.tokens[index].split(",", 1)
+                self.tokens[index] = sender + "," + accumulateBody(body, token.split(",", 1)[1])
+            else:
+                self.tokens[index] = token
+
+    def message(self):
+        state = [MPEServer.encodeState(self.state)] if self.state else []
+        return "|".join([self.head] + state + self.tokens)
+
+class Session:
+
+    # What the server keeps of a client that may drop and come back with its token.
+    def __init__(self, connection):
+        self.token = "%016x" % random.getrandbits(64)
+        # The frames sent to the client, as (framecount, message).
+        self.history = deque(maxlen=history_length)
+        self.connection = connection
+        self.lost_at = None
+        self.receives_broadcasts = False
+        self.had_bulk_lane = False
+
+    def canResumeAfter(self, frame):
+        # Whether the history holds every frame the client missed after frame.
+        if frame == framecount:
+            return True
+        return frame < framecount and len(self.history) > 0 and self.history[0][0] <= frame + 1 \
+            and self.history[-1][0] == framecount
 
 class MPEServer(Protocol):
 
     client_id = -1
     client_name = ""
+    is_bulk_lane = False
+    codec = None
+    wants_state = False
+    needs_state_snapshot = False
+    wants_clock = False
+    wants_pace = False
+    wants_trace = False
+    is_relay = False
+    is_async = False
+    # Decimated delivery of async clients: at most one frame per delivery_interval seconds, and with
+    # "latest" none while the transport can't keep up. Frames that aren't delivered are collapsed.
+    delivery_interval = None
+    latest_only = False
+    write_paused = False
+    collapsed = None
+    last_delivery = 0.0
+    delivery_call = None
+    session = None
+    resuming_after = None
+    lines_received = 0
 
     def connectionMade(self):
+        self.buffer = b""
+        # The clients of a relay that sent something through it.
+        self.relayed_ids = set()
         print("Client connected. Total Clients: %i" % (len(MPEServer.clients) + 1))
 
     def connectionLost(self, reason):
+        if self.is_bulk_lane:
+            print("Bulk lane disconnected for client %i" % self.client_id)
+            if MPEServer.bulk_lanes.get(self.client_id) is self:
+                del MPEServer.bulk_lanes[self.client_id]
+            # Whatever is left goes inline in the frame message. Streams can't go inline.
+            for m in MPEServer.bulk_queue:
+                if isinstance(m, StreamMessage) and self.client_id in m.sent and MPEServer.hadBulkLane(self.client_id):
+                    m.restart(self.client_id)
+                else:
+                    m.sent.pop(self.client_id, None)
+            return
         print("Client disconnected")
-        if MPEServer.clients[self.client_id]:
-            del MPEServer.clients[self.client_id]
+        if self.delivery_call is not None and self.delivery_call.active():
+            self.delivery_call.cancel()
+        if MPEServer.clients.get(self.client_id) is not self:
+            # A resumed session already replaced this connection.
+            return
+        del MPEServer.clients[self.client_id]
+        if self.session is None:
+            # Sessions keep the viewport, for the region messages recorded while the client is away.
+            MPEServer.viewports.remove(self.client_id)
+        if upstream is not None:
+            for topic, subscribers in list(MPEServer.topics.items()):
+                if self.client_id in subscribers:
+                    upstream.forward(self.client_id, "%s|%s" % (CMD_UNSUBSCRIBE, topic))
+        MPEServer.unsubscribeAll(self.client_id)
+        for client_id in self.relayed_ids:
+            MPEServer.unsubscribeAll(client_id)
+        if self.session is not None:
+            # Frames are still recorded for a while, in case the client comes back.
+            self.session.lost_at = time.monotonic()
+            self.session.receives_broadcasts = self.client_id in MPEServer.receiving_client_ids
         if self.client_id in MPEServer.rendering_client_ids:
             MPEServer.rendering_client_ids.remove(self.client_id)
         if self.client_id in MPEServer.receiving_client_ids:
@@ -71,106 +781,549 @@ class MPEServer(Protocol):
             MPEServer.sendNextFrame()
 
     def dataReceived(self, data):
+        # There may be more than 1 message in the mix, and the last one may be incomplete.
+        self.buffer += data
+        lines = self.buffer.split(b"\n")
+        self.buffer = lines.pop()
+        for line in lines:
+            if len(line) > 0:
+                if journal is not None:
+                    self.record(KIND_INBOUND, line + b"\n")
+                # Parse data as utf-8, not byte string. Chunks may split a character,
+                # surrogateescape keeps those bytes intact.
+                self.messageReceived(line.decode("utf_8", "surrogateescape"))
+
+    def messageReceived(self, message):
         global screens_drawn
         global framecount
-        # Parse data as utf-8, not byte string
-        data = data.decode("utf_8")
-        # There may be more than 1 message in the mix
-        messages = data.split("\n")
-        for message in messages:
-            if len(message) < 1:
+        data = message
+
+        tokens = message.split("|")
+        token_count = len(tokens)
+        cmd = tokens[0]
+        if self.session is not None and cmd not in UNCOUNTED_COMMANDS:
+            self.lines_received += 1
+
+        if upstream is not None and cmd in RELAYED_COMMANDS:
+            # The wall is the upstream server's, this relay only keeps the topics to route them down.
+            upstream.forward(self.client_id, message)
+            if cmd not in (CMD_SUBSCRIBE, CMD_UNSUBSCRIBE):
                 return
 
-            tokens = message.split("|")
-            token_count = len(tokens)
-            cmd = tokens[0]
-
-            if cmd == CMD_DID_DRAW:
-                # Format
-                # D|client_id|last_frame_rendered
-                if token_count != 3:
-                    print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
-                client = int(tokens[1])
-                frame_id = int(tokens[2])
-                if frame_id >= framecount:
-                    screens_drawn += 1
-                    if MPEServer.isNextFrameReady():
-                        # all of the frames are drawn, send out the next frames
-                        MPEServer.sendNextFrame()
-
-            elif (cmd == CMD_SYNC_CLIENT_CONNECT) or (cmd == CMD_ASYNC_CLIENT_CONNECT):
-                # Formats
-                # "S|client_id|client_name"
-                # "A|client_id|client_name|should_receive_broadcasts"
-                if token_count < 3 or token_count > 4:
-                    print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
-                self.client_id = int(tokens[1])
-                self.client_name = tokens[2]
-                MPEServer.clients[self.client_id] = self
-
-                client_receives_messages = True
-                if cmd == CMD_SYNC_CLIENT_CONNECT:
+        if cmd == CMD_DID_DRAW:
+            # Format
+            # D|client_id|last_frame_rendered[|state_hash]
+            # Clients that negotiated "hash" may add the hash of their state after the frame, in hex.
+            if token_count not in (3, 4):
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+            client = int(tokens[1])
+            frame_id = int(tokens[2])
+            if frame_id >= framecount:
+                if token_count == 4:
+                    MPEServer.state_hashes[client] = (frame_id, int(tokens[3], 16))
+                screens_drawn += 1
+                if tracer is not None:
+                    tracer.instant("D", client + 1, serverTime(), framecount)
+                if pacer is not None and screens_drawn == len(MPEServer.rendering_client_ids):
+                    pacer.addSample((datetime.now() - last_frame_time).total_seconds())
+                if MPEServer.isNextFrameReady():
+                    # all of the frames are drawn, send out the next frames
+                    MPEServer.sendNextFrame()
+
+        elif (cmd == CMD_SYNC_CLIENT_CONNECT) or (cmd == CMD_ASYNC_CLIENT_CONNECT):
+            # Formats
+            # "S|client_id|client_name[|key=value...]"
+            # "A|client_id|client_name|should_receive_broadcasts[|key=value...]"
+            # Newer clients append options, which are answered with
+            # "H|key=value..." before the client is added.
+            fixed_count = 3 if cmd == CMD_SYNC_CLIENT_CONNECT else 4
+            if token_count < fixed_count:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+            self.client_id = int(tokens[1])
+            self.client_name = tokens[2]
+            self.is_async = cmd == CMD_ASYNC_CLIENT_CONNECT
+            previous = MPEServer.clients.get(self.client_id)
+            MPEServer.clients[self.client_id] = self
+
+            options = dict(t.split("=", 1) for t in tokens[fixed_count:] if "=" in t)
+            if len(options) > 0:
+                self.sendMessage("|".join([CMD_HANDSHAKE] + ["%s=%s" % item for item in self.negotiate(options)]))
+            if previous is not None and previous is not self:
+                # The old connection of a client that came back is dead even if TCP hasn't noticed.
+                previous.transport.loseConnection()
+
+            client_receives_messages = True
+            if cmd == CMD_SYNC_CLIENT_CONNECT:
+                if self.client_id not in MPEServer.rendering_client_ids:
                     MPEServer.rendering_client_ids.append(self.client_id)
-                elif cmd == CMD_ASYNC_CLIENT_CONNECT:
-                    client_receives_messages = tokens[3].lower() == 'true'
+            elif cmd == CMD_ASYNC_CLIENT_CONNECT:
+                client_receives_messages = tokens[3].lower() == 'true'
 
-                if client_receives_messages:
-                    print("New client will receive data")
-                    MPEServer.receiving_client_ids.append(self.client_id)
+            if client_receives_messages and self.client_id not in MPEServer.receiving_client_ids:
+                print("New client will receive data")
+                MPEServer.receiving_client_ids.append(self.client_id)
 
+            if self.resuming_after is not None:
+                MPEServer.handleClientResume(self)
+            else:
                 MPEServer.handleClientAdd(self.client_id)
 
-            elif cmd == CMD_BROADCAST:
-                # Formats:
-                # "T|message message message"
-                # "T|message message message|toID_1,toID_2,toID_3"
-                if token_count < 2 or token_count > 3:
-                    print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
-                to_client_ids = []
-                if token_count == 2:
-                    to_client_ids = MPEServer.receiving_client_ids
-                elif token_count == 3:
-                    to_client_ids = tokens[2].split(",")
-                    to_client_ids = [int(client_id) for client_id in to_client_ids]
-
-                MPEServer.broadcastMessage(tokens[1], self.client_id, to_client_ids)
-
-            elif cmd == CMD_PAUSE:
-                # Format:
-                # P
-                if token_count > 1:
-                    print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
-                MPEServer.togglePause()
-
-            elif cmd == CMD_RESET:
-                # Format:
-                # R
-                if token_count > 1:
-                    print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
-                MPEServer.reset()
+        elif cmd == CMD_BROADCAST:
+            # Formats:
+            # "T|message message message"
+            # "T|message message message|toID_1,toID_2,toID_3"
+            if token_count < 2 or token_count > 3:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+            # An empty list goes to every client that receives broadcasts when the frame is sent,
+            # including ones that are away and may resume.
+            to_client_ids = []
+            if token_count == 3:
+                to_client_ids = tokens[2].split(",")
+                to_client_ids = [int(client_id) for client_id in to_client_ids]
+
+            raw_body = checkBody(tokens[1], cmd, self.client_id)
+            if raw_body is None:
+                return
+            MPEServer.broadcastMessage(tokens[1], self.client_id, to_client_ids, raw_body)
+
+        elif cmd == CMD_BULK_LANE:
+            # Format:
+            # "B|client_id"
+            # Sent on a second connection, which then only carries chunks.
+            if token_count != 2:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            self.client_id = int(tokens[1])
+            self.is_bulk_lane = True
+            MPEServer.bulk_lanes[self.client_id] = self
+            if self.client_id in MPEServer.sessions:
+                MPEServer.sessions[self.client_id].had_bulk_lane = True
+            print("Client %i opened a bulk lane" % self.client_id)
+            self.sendMessage(CMD_BULK_LANE)
 
+        elif cmd == CMD_DATA_CHUNK:
+            # Format:
+            # "C|msg_id|offset|total|chunk"
+            # "C|msg_id|0|total|chunk|toID_1,toID_2,toID_3"
+            if token_count < 5 or token_count > 6:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            key = (self.client_id, int(tokens[1]))
+            offset = int(tokens[2])
+            total = int(tokens[3])
+            if offset == 0:
+                to_client_ids = None
+                if token_count == 6:
+                    to_client_ids = [int(client_id) for client_id in tokens[5].split(",")]
+                MPEServer.bulk_inbound[key] = (bytearray(), to_client_ids)
+            if key not in MPEServer.bulk_inbound:
+                print("ERROR: Chunk for unknown message %i from client %i" % (key[1], key[0]))
+                return
+            body, to_client_ids = MPEServer.bulk_inbound[key]
+            body += tokens[4].encode("utf_8", "surrogateescape")
+            if len(body) >= total:
+                del MPEServer.bulk_inbound[key]
+                if checkBody(bytes(body).decode("utf_8", "surrogateescape"), cmd, key[0]) is None:
+                    return
+                if upstream is not None:
+                    # Relays send bulk messages upstream inline, the server above chunks them again.
+                    line = "%s|%s" % (CMD_BROADCAST, bytes(body).decode("utf_8", "surrogateescape"))
+                    if to_client_ids is not None:
+                        line += "|" + ",".join(str(client_id) for client_id in to_client_ids)
+                    upstream.forward(key[0], line)
+                    return
+                if to_client_ids is None:
+                    to_client_ids = []
+                MPEServer.bulk_queue.append(BulkMessage(bytes(body), key[0], key[1], to_client_ids))
+                if len(MPEServer.rendering_client_ids) == 0:
+                    MPEServer.sendNextFrame()
+
+        elif cmd == CMD_DATA_STREAM:
+            # Format:
+            # "M|stream_id|offset|total|base64"
+            # "M|stream_id|0|total|base64|toID_1,toID_2,toID_3"
+            # Offsets count decoded bytes.
+            if token_count < 5 or token_count > 6:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            if upstream is not None:
+                print("ERROR: Streams can't be relayed, dropping stream %s from client %i" % (tokens[1], self.client_id))
+                return
+            key = (self.client_id, int(tokens[1]))
+            offset = int(tokens[2])
+            if offset == 0:
+                to_client_ids = MPEServer.receiving_client_ids + MPEServer.awayReceivingIds()
+                if token_count == 6:
+                    to_client_ids = [int(client_id) for client_id in tokens[5].split(",")]
+                MPEServer.bulk_inbound[key] = StreamMessage(key[0], key[1], int(tokens[3]), list(to_client_ids))
+                MPEServer.bulk_queue.append(MPEServer.bulk_inbound[key])
+            if key not in MPEServer.bulk_inbound:
+                print("ERROR: Chunk for unknown stream %i from client %i" % (key[1], key[0]))
+                return
+            stream = MPEServer.bulk_inbound[key]
+            stream.addChunk(offset, tokens[4])
+            if stream.received >= stream.total:
+                del MPEServer.bulk_inbound[key]
+            if len(MPEServer.rendering_client_ids) == 0:
+                MPEServer.sendNextFrame()
+
+        elif cmd == CMD_COALESCED:
+            # Format:
+            # "L|coalesce_key|l|message message message"
+            # "L|coalesce_key|a|1.5,-2"
+            # Within a frame the latest message per sender and key replaces the
+            # queued one (l), or is added to it (a), keeping its place in the queue.
+            if token_count != 4:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            raw_body = checkBody(tokens[3], cmd, self.client_id)
+            if raw_body is None:
+                return
+            key = (self.client_id, tokens[1], tokens[2])
+            queued = MPEServer.coalesced.get(key)
+            if queued is not None:
+                if tokens[2] == "a":
+                    queued.body = accumulateBody(queued.body, tokens[3])
+                    queued.raw_body = None
+                else:
+                    queued.body = tokens[3]
+                    queued.raw_body = raw_body
             else:
-                print("Unknown message: " + message)
+                # Like T, an empty list means whoever receives broadcasts when the frame goes out.
+                m = BroadcastMessage(tokens[3], self.client_id, [])
+                m.raw_body = raw_body
+                m.coalesce_key = key
+                MPEServer.coalesced[key] = m
+                MPEServer.message_queue.append(m)
+                if len(MPEServer.rendering_client_ids) == 0:
+                    MPEServer.sendNextFrame()
+
+        elif cmd == CMD_REGION:
+            # Format:
+            # "W|x1,y1,x2,y2|message message message"
+            # The bounds are in master space. The message only goes to receiving clients
+            # whose viewport intersects them, and to those that didn't register one.
+            if token_count != 3:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            bounds = parseRect(tokens[1])
+            if bounds is None:
+                print("ERROR: Malformed bounds for CMD %s. " % cmd, data, tokens)
+                return
+            raw_body = checkBody(tokens[2], cmd, self.client_id)
+            if raw_body is None:
+                return
+            hits = MPEServer.viewports.query(bounds)
+            to_client_ids = [client_id for client_id in MPEServer.receiving_client_ids + MPEServer.awayReceivingIds()
+                             if client_id in hits or client_id not in MPEServer.viewports.rects]
+            # An empty list would mean everybody.
+            if len(to_client_ids) > 0:
+                MPEServer.broadcastMessage(tokens[2], self.client_id, to_client_ids, raw_body)
+
+        elif cmd == CMD_SUBSCRIBE:
+            # Format:
+            # "U|topic"
+            if token_count != 2:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            MPEServer.topics.setdefault(tokens[1], set()).add(self.client_id)
+
+        elif cmd == CMD_UNSUBSCRIBE:
+            # Format:
+            # "X|topic"
+            if token_count != 2:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            subscribers = MPEServer.topics.get(tokens[1], set())
+            subscribers.discard(self.client_id)
+            if len(subscribers) == 0:
+                MPEServer.topics.pop(tokens[1], None)
+
+        elif cmd == CMD_PUBLISH:
+            # Format:
+            # "O|topic|message message message"
+            # Goes to the subscribers of the topic, whether or not they receive broadcasts.
+            if token_count != 3:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            raw_body = checkBody(tokens[2], cmd, self.client_id)
+            if raw_body is None:
+                return
+            # Subscribers behind a relay aren't connected here.
+            to_client_ids = sorted(MPEServer.topics.get(tokens[1], ()))
+            # An empty list would mean everybody.
+            if len(to_client_ids) > 0:
+                MPEServer.broadcastMessage(tokens[2], self.client_id, to_client_ids, raw_body)
+
+        elif cmd == CMD_CLOCK_SYNC:
+            # Format:
+            # "Y|client_time"
+            # Answered right away with "Y|client_time|server_time", both in microseconds.
+            if token_count != 2:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            self.sendMessage("%s|%s|%i" % (CMD_CLOCK_SYNC, tokens[1], serverTime()))
+
+        elif cmd == CMD_TRACE:
+            # Formats:
+            # "E" asks the server to collect a trace.
+            # "E|client_id|more|synchronized|phase,thread,time,duration,frame,name;..." answers the
+            # server's "E". Long traces take several lines, all but the last with more=1.
+            if tracer is None:
+                print("ERROR: A trace was requested but the server has no --trace file.")
+                return
+            if token_count == 1:
+                tracer.collect()
+            elif token_count == 5:
+                tracer.received(int(tokens[1]), tokens[2] == "1", tokens[3] == "1", tokens[4])
+            else:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+
+        elif cmd == CMD_FORWARDED:
+            # Format:
+            # "F|client_id|line"
+            # A line a client of a relay sent, handled as if that client had sent it here.
+            if token_count < 3:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            if not self.is_relay:
+                # Anybody else could send lines in another client's name.
+                print("ERROR: Dropping a forwarded line from client %s, which isn't a relay" % self.client_id)
+                return
+            relay_id = self.client_id
+            self.client_id = int(tokens[1])
+            self.relayed_ids.add(self.client_id)
+            try:
+                self.messageReceived(message.split("|", 2)[2])
+            finally:
+                self.client_id = relay_id
+
+        elif cmd == CMD_STATE_DELTA:
+            # Format:
+            # "K|key=value;key=value"
+            # Keys and values are escaped by the client and opaque to the server,
+            # a value of "x" erases the key.
+            if token_count != 2:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+                return
+            delta = MPEServer.state_deltas.setdefault(self.client_id, {})
+            for entry in tokens[1].split(";"):
+                if "=" in entry:
+                    key, value = entry.split("=", 1)
+                    delta[key] = value
+            if len(MPEServer.rendering_client_ids) == 0:
+                MPEServer.sendNextFrame()
+
+        elif cmd == CMD_PAUSE:
+            # Format:
+            # P
+            if token_count > 1:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+            MPEServer.togglePause()
+
+        elif cmd == CMD_RESET:
+            # Format:
+            # R
+            if token_count > 1:
+                print("ERROR: Incorrect param count for CMD %s. " % cmd, data, tokens)
+            MPEServer.reset()
+
+        else:
+            print("Unknown message: " + message)
 
         # print("Received message: ", data, "FROM", self.client_id)
 
+    def negotiate(self, options):
+        # Returns the (key, value) pairs the server agrees to.
+        agreed = []
+        resume = options.get("resume")
+        if resume is not None:
+            # "1" starts a session, a token from an earlier handshake resumes it after the client's last
+            # frame if the history still has every frame since. The client sends again whatever comes
+            # after the lines the server received on the connection before.
+            session = MPEServer.sessions.get(self.client_id)
+            frame = int(options.get("frame", "-1"))
+            if session is not None and session.token == resume and session.canResumeAfter(frame):
+                old = session.connection
+                received = old.lines_received if old is not None else 0
+                self.resuming_after = frame
+                agreed += [("resumed", "1"), ("received", "%i" % received)]
+            else:
+                if self.client_id in MPEServer.sessions:
+                    MPEServer.dropSession(self.client_id)
+                session = Session(self)
+                MPEServer.sessions[self.client_id] = session
+            session.had_bulk_lane = session.had_bulk_lane or self.client_id in MPEServer.bulk_lanes
+            session.connection = self
+            session.lost_at = None
+            self.session = session
+            agreed.append(("resume", session.token))
+        if CODEC_LZ4 in options.get("codec", "").split(","):
+            self.codec = CODEC_LZ4
+            agreed.append(("codec", CODEC_LZ4))
+        if options.get("state") == "1":
+            # Clients that join without a reset start from a full copy.
+            self.wants_state = True
+            self.needs_state_snapshot = True
+            agreed.append(("state", "1"))
+        aoi = options.get("aoi")
+        if aoi is not None:
+            # "all" or the client's viewport in master space.
+            MPEServer.viewports.remove(self.client_id)
+            rect = parseRect(aoi) if aoi != "all" else None
+            if rect is not None:
+                MPEServer.viewports.insert(self.client_id, rect)
+            agreed.append(("aoi", "1"))
+        if options.get("topics") == "1":
+            agreed.append(("topics", "1"))
+        if options.get("clock") == "1":
+            self.wants_clock = True
+            agreed.append(("clock", "1"))
+        if options.get("relay") == "1":
+            # Relays get the messages for their clients with the ids they're for, see TARGETS_DELIMITER.
+            self.is_relay = True
+            agreed.append(("relay", "1"))
+        if options.get("trace") == "1" and tracer is not None:
+            self.wants_trace = True
+            agreed.append(("trace", "1"))
+        if options.get("pace") == "1":
+            self.wants_pace = True
+            agreed.append(("pace", "1"))
+        if options.get("hash") == "1":
+            agreed.append(("hash", "1"))
+        if self.is_async:
+            # Sync clients get every frame, the wall waits for them anyway.
+            rate = options.get("rate")
+            if rate is not None and float(rate) > 0:
+                self.delivery_interval = 1.0 / float(rate)
+                agreed.append(("rate", rate))
+            if options.get("latest") == "1":
+                # Twisted pauses producers whose transport buffers more than it can send.
+                self.latest_only = True
+                self.transport.registerProducer(self, True)
+                agreed.append(("latest", "1"))
+        return agreed
+
+    def isDecimated(self):
+        return self.delivery_interval is not None or self.latest_only
+
+    def isDeliveryDue(self):
+        if self.write_paused:
+            return False
+        return self.delivery_interval is None or time.monotonic() - self.last_delivery >= self.delivery_interval
+
+    def deliverCollapsed(self):
+        # Sends the frames collapsed so far if the client can take them.
+        if self.collapsed is None or MPEServer.clients.get(self.client_id) is not self:
+            return
+        if not self.isDeliveryDue():
+            self.scheduleDelivery()
+            return
+        if self.delivery_call is not None and self.delivery_call.active():
+            self.delivery_call.cancel()
+        message = self.collapsed.message()
+        self.collapsed = None
+        self.last_delivery = time.monotonic()
+        MPEServer.sendFrame(self, message, True)
+
+    def scheduleDelivery(self):
+        # Collapsed frames go out when they're due, also if the wall stops releasing frames.
+        # Paused clients get them when they resume.
+        if self.delivery_interval is None or self.write_paused:
+            return
+        if self.delivery_call is not None and self.delivery_call.active():
+            return
+        delay = max(0.0, self.last_delivery + self.delivery_interval - time.monotonic())
+        self.delivery_call = reactor.callLater(delay, self.deliverCollapsed)
+
+    def pauseProducing(self):
+        self.write_paused = True
+
+    def resumeProducing(self):
+        self.write_paused = False
+        self.deliverCollapsed()
+
+    def stopProducing(self):
+        pass
+
     def sendMessage(self, message):
         # Must use byte string, not unicode string
-        message = message + "\n"
-        self.transport.write(message.encode('utf_8'))
+        message = (message + "\n").encode('utf_8', 'surrogateescape')
+        if journal is not None:
+            self.record(KIND_OUTBOUND, message)
+        self.transport.write(message)
+
+    def record(self, kind, line):
+        # Connect lines are recorded under the client id they carry.
+        client_id = self.client_id
+        is_connect = line[:2] in (b"S|", b"A|", b"B|")
+        if client_id < 0 and is_connect:
+            client_id = int(line.split(b"|")[1])
+        flags = FLAG_BULK_LANE if self.is_bulk_lane or line[:2] == b"B|" else 0
+        journal.append(kind, flags, client_id, serverTime(), line)
 
     @staticmethod
     def reset():
         global framecount
         global is_paused
+        if upstream is not None and not upstream.is_resetting:
+            # The whole wall starts over, this relay does when the server says so.
+            upstream.send(CMD_RESET)
+            return
         framecount = 0
         screens_drawn = 0
         MPEServer.message_queue = []
+        MPEServer.coalesced = {}
+        MPEServer.bulk_queue = []
+        MPEServer.bulk_inbound = {}
+        MPEServer.state = {}
+        MPEServer.state_deltas = {}
+        MPEServer.state_hashes = {}
+        MPEServer.diverged = {}
+        # Collapsed frames are of before the reset.
+        for c in MPEServer.clients.values():
+            c.collapsed = None
+        # The history is of frames that don't exist anymore. Clients that are away join like new ones.
+        for client_id, session in list(MPEServer.sessions.items()):
+            if session.lost_at is not None:
+                MPEServer.dropSession(client_id)
+            else:
+                session.history.clear()
         MPEServer.sendReset()
         if is_paused:
             print("INFO: Reset was called when server is paused.")
         MPEServer.sendNextFrame()
 
+    @staticmethod
+    def checkStateHashes():
+        # Compares the state hashes sent for the frame that's done and reports the clients that differ
+        # from the most common one, or all of them if there is none, once until the next reset.
+        # Returns the hash if the clients agree, None if they don't or nobody sent one.
+        hashes = dict((client_id, state_hash) for client_id, (frame_id, state_hash) in MPEServer.state_hashes.items() if frame_id == framecount)
+        MPEServer.state_hashes = {}
+        counts = {}
+        for state_hash in hashes.values():
+            counts[state_hash] = counts.get(state_hash, 0) + 1
+        if len(counts) == 0:
+            return None
+        if len(counts) == 1:
+            return list(counts)[0]
+        ranked = sorted(counts.items(), key=lambda item: -item[1])
+        majority = ranked[0][0] if ranked[0][1] > ranked[1][1] else None
+        for client_id, state_hash in sorted(hashes.items()):
+            if state_hash == majority or client_id in MPEServer.diverged:
+                continue
+            MPEServer.diverged[client_id] = framecount
+            if majority is not None:
+                print("ERROR: Client %i diverged in frame %i, its state hash is %016x where %i clients have %016x" %
+                      (client_id, framecount, state_hash, counts[majority], majority))
+            else:
+                print("ERROR: Client %i diverged in frame %i, its state hash is %016x and no hash is the majority" %
+                      (client_id, framecount, state_hash))
+            if tracer is not None:
+                tracer.instant("diverged", client_id + 1, serverTime(), framecount)
+        return None
+
     @staticmethod
     def sendReset():
         for n in MPEServer.receiving_client_ids:
@@ -198,6 +1351,65 @@ class MPEServer(Protocol):
         elif num_sync_clients > screens_required:
             print("ERROR: More than MAX clients have connected.")
 
+    @staticmethod
+    def handleClientResume(client):
+        # Sends the frames the client missed instead of resetting everybody.
+        replayed = 0
+        for frame, message in client.session.history:
+            if frame > client.resuming_after:
+                client.sendMessage(message)
+                replayed += 1
+        print("Resumed client %i (%s), replayed %i frames" % (client.client_id, client.client_name, replayed))
+        client.resuming_after = None
+
+    @staticmethod
+    def expireSessions():
+        now = time.monotonic()
+        for client_id, session in list(MPEServer.sessions.items()):
+            if session.lost_at is not None and now - session.lost_at > resume_window:
+                print("Session of client %i expired" % client_id)
+                MPEServer.dropSession(client_id)
+
+    @staticmethod
+    def dropSession(client_id):
+        # Forgets what was kept for a client that may have resumed.
+        del MPEServer.sessions[client_id]
+        if client_id not in MPEServer.clients:
+            MPEServer.viewports.remove(client_id)
+        for m in MPEServer.bulk_queue:
+            m.sent.pop(client_id, None)
+
+    @staticmethod
+    def awayReceivingIds():
+        # Clients that dropped and may resume, that received broadcasts when they dropped.
+        return [client_id for client_id, session in MPEServer.sessions.items()
+                if session.lost_at is not None and session.receives_broadcasts and client_id not in MPEServer.clients]
+
+    @staticmethod
+    def hadBulkLane(client_id):
+        session = MPEServer.sessions.get(client_id)
+        return session is not None and session.had_bulk_lane
+
+    @staticmethod
+    def sendFrame(client, message, is_connected):
+        # Frames of resumable clients are recorded, also while they're away.
+        if client.session is not None:
+            client.session.history.append((framecount, message))
+        if is_connected:
+            if client.session is not None:
+                # The count ends the frame header, which is the second token.
+                tokens = message.split("|", 2)
+                tokens[1] += RECEIVED_DELIMITER + "%i" % client.lines_received
+                message = "|".join(tokens)
+            client.sendMessage(message)
+
+    @staticmethod
+    def unsubscribeAll(client_id):
+        for topic, subscribers in list(MPEServer.topics.items()):
+            subscribers.discard(client_id)
+            if len(subscribers) == 0:
+                del MPEServer.topics[topic]
+
     @staticmethod
     def isNextFrameReady():
         global screens_drawn
@@ -218,36 +1430,158 @@ class MPEServer(Protocol):
         if is_paused:
             return
 
+        state_hash = MPEServer.checkStateHashes()
+        if upstream is not None and not upstream.is_releasing:
+            # A relay's clients are done with the frame, the server above releases the next one.
+            upstream.confirm(state_hash)
+            return
+
         # Slow down if we've exceeded the target FPS
+        if pacer is not None:
+            microseconds_per_frame = pacer.period() * 1000000
         delta = datetime.now() - last_frame_time
         while delta.seconds < 1 and delta.microseconds < microseconds_per_frame:
             delta = datetime.now() - last_frame_time
 
+        release_start = serverTime()
         screens_drawn = 0
         framecount += 1
+        if journal is not None:
+            journal.beginFrame()
+        MPEServer.sendBulkChunks()
+        state_delta = MPEServer.mergeStateDeltas()
         send_message = CMD_GO + "|%i" % framecount
+        # The same moment for every screen, far enough out for the frame to reach all of them.
+        present_time = serverTime() + present_delay
+        rate = pacer.rate() if pacer is not None else framerate
+        if upstream is not None:
+            # Relays pass on the moment and the rate of the server above.
+            present_time = upstream.present_time if upstream.present_time is not None else present_time
+            rate = upstream.rate if upstream.rate is not None else rate
+        timed_message = send_message + PRESENTATION_TIME_DELIMITER + "%i" % present_time
+        rate = FRAME_RATE_DELIMITER + "%.6g" % rate
         # Copy the clients so in case one disconnects during the loop
         clients = copy(MPEServer.clients)
-        for client_id in clients:
-            c = clients[client_id]
-            if client_id in MPEServer.receiving_client_ids:
+        targets = [(client_id, clients[client_id], client_id in MPEServer.receiving_client_ids, True) for client_id in clients]
+        # Sessions of clients that dropped get their frames recorded until they expire.
+        MPEServer.expireSessions()
+        for client_id, session in MPEServer.sessions.items():
+            if session.lost_at is not None and client_id not in clients:
+                targets.append((client_id, session.connection, session.receives_broadcasts, False))
+        # Clients that don't receive broadcasts still get frames for the topics they subscribed to.
+        subscribers = set()
+        for topic_subscribers in MPEServer.topics.values():
+            subscribers |= topic_subscribers
+        for client_id, c, receives_broadcasts, is_connected in targets:
+            if receives_broadcasts or client_id in subscribers:
+                frame_message = timed_message if c.wants_clock else send_message
+                if c.wants_pace:
+                    frame_message += rate
+                state_token = None
+                if c.wants_state:
+                    if c.needs_state_snapshot:
+                        c.needs_state_snapshot = False
+                        if len(MPEServer.state) > 0:
+                            state_token = MPEServer.encodeState(MPEServer.state)
+                    elif state_delta is not None:
+                        state_token = state_delta
                 client_messages = []
                 for m in MPEServer.message_queue:
-                    if len(m.to_client_ids) == 0 or client_id in m.to_client_ids:
-                        client_messages.append(str(m.from_client_id) + "," + m.body)
+                    if c.is_relay and len(m.to_client_ids) > 0:
+                        # A relay passes it on to whichever of its clients it's for.
+                        client_messages.append((m.coalesce_key, "%i%s%s,%s" % (m.from_client_id, TARGETS_DELIMITER,
+                                                ".".join(str(i) for i in m.to_client_ids), m.bodyFor(c))))
+                    elif (len(m.to_client_ids) == 0 and receives_broadcasts) or client_id in m.to_client_ids:
+                        if m.bulk_id is not None and client_id in m.bulk_recipients:
+                            # The client already has the body from its bulk lane, or gets
+                            # the rest of a stream on its next one.
+                            client_messages.append((None, "%i#%i," % (m.from_client_id, m.bulk_id)))
+                        else:
+                            client_messages.append((m.coalesce_key, str(m.from_client_id) + "," + m.bodyFor(c)))
 
-                if len(client_messages) > 0:
-                    c.sendMessage(send_message + "|" + "|".join(client_messages))
-                else:
-                    c.sendMessage(send_message)
+                if c.isDecimated():
+                    if c.collapsed is None:
+                        c.collapsed = CollapsedFrame()
+                    c.collapsed.add(frame_message, state_token, client_messages)
+                    if is_connected:
+                        c.deliverCollapsed()
+                    else:
+                        # Clients that are away get their frames recorded as they would have got them.
+                        MPEServer.sendFrame(c, c.collapsed.message(), False)
+                        c.collapsed = None
+                    continue
+                tokens = [state_token] if state_token is not None else []
+                tokens += [token for key, token in client_messages]
+                MPEServer.sendFrame(c, "|".join([frame_message] + tokens), is_connected)
 
         MPEServer.message_queue = []
+        MPEServer.coalesced = {}
         last_frame_time = datetime.now()
+        if tracer is not None:
+            tracer.complete("release", Tracer.FRAMES_TID, release_start, serverTime(), framecount)
+
+        # Async only servers have no confirmations to drive the frames that drain the bulk lanes.
+        if len(MPEServer.bulk_queue) > 0 and len(MPEServer.rendering_client_ids) == 0:
+            reactor.callLater(1.0 / framerate, MPEServer.sendNextFrame)
 
     @staticmethod
-    def broadcastMessage(message, from_client_id, to_client_ids):
+    def mergeStateDeltas():
+        # Deltas are merged in client id order, so the last writer is the same on every
+        # server run. Returns the frame's delta token or None.
+        merged = {}
+        for client_id in sorted(MPEServer.state_deltas):
+            merged.update(MPEServer.state_deltas[client_id])
+        MPEServer.state_deltas = {}
+        if len(merged) == 0:
+            return None
+        for key, value in merged.items():
+            if value == "x":
+                MPEServer.state.pop(key, None)
+            else:
+                MPEServer.state[key] = value
+        return MPEServer.encodeState(merged)
+
+    @staticmethod
+    def encodeState(entries):
+        return STATE_DELTA_PREFIX + ";".join("%s=%s" % item for item in sorted(entries.items()))
+
+    @staticmethod
+    def sendBulkChunks():
+        global bulk_chunk
+        global bulk_budget
+        # Every bulk lane gets at most bulk_budget bytes per frame, so a large message
+        # is spread over several frames instead of delaying this one.
+        for client_id, lane in list(MPEServer.bulk_lanes.items()):
+            budget = bulk_budget
+            chunks = []
+            for m in MPEServer.bulk_queue:
+                if budget <= 0:
+                    break
+                if client_id in m.sent:
+                    next_chunks, budget = m.nextChunks(client_id, budget)
+                    chunks += next_chunks
+            if len(chunks) > 0:
+                lane.sendMessage("\n".join(chunks))
+
+        # Messages are released in the same frame for every recipient. Clients hold the frame
+        # until the last chunk has arrived on their bulk lane.
+        # A stream is still in bulk_queue while its sender is uploading it, and is only released
+        # once all of it has arrived and been forwarded.
+        for m in list(MPEServer.bulk_queue):
+            if not m.released and m.isReleasable():
+                m.released = True
+                released = m.release()
+                if released is not None:
+                    MPEServer.message_queue.append(released)
+            if m.released and m.isSent():
+                MPEServer.bulk_queue.remove(m)
+
+    @staticmethod
+    def broadcastMessage(message, from_client_id, to_client_ids, raw_body = None):
         #print("Broadcasting message: " + message + " to client IDs: ", to_client_ids)
         m = BroadcastMessage(message, from_client_id, to_client_ids)
+        # The handlers already decompressed it to check it.
+        m.raw_body = raw_body
         MPEServer.message_queue.append(m)
         # NOTE: If only async clients are connected, send this message now.
         # Otherwise the message wont be sent until the next render frame
@@ -263,10 +1597,48 @@ MPEServer.clients = {}
 MPEServer.rendering_client_ids = []
 MPEServer.receiving_client_ids = []
 MPEServer.message_queue = []
+MPEServer.coalesced = {}
+MPEServer.bulk_lanes = {}
+MPEServer.bulk_queue = []
+MPEServer.bulk_inbound = {}
+MPEServer.state = {}
+MPEServer.state_deltas = {}
+# client id: (frame, hash) of the last state hash, and client id: the frame it first diverged in.
+MPEServer.state_hashes = {}
+MPEServer.diverged = {}
+MPEServer.viewports = ViewportIndex(aoi_cell)
+# Topic name -> set of subscribed client ids
+MPEServer.topics = {}
+# Client id -> Session of clients that can resume
+MPEServer.sessions = {}
+
+if args.journal is not None:
+    journal = JournalWriter(args.journal, serverTime())
+    reactor.addSystemEventTrigger("before", "shutdown", journal.close)
+    print("Recording to %s" % args.journal)
+
+if args.trace is not None:
+    tracer = Tracer(args.trace)
+    if hasattr(signal, "SIGUSR1"):
+        signal.signal(signal.SIGUSR1, lambda signum, frame: reactor.callFromThread(tracer.collect))
+    print("Tracing to %s" % args.trace)
+
+if args.upstream is not None:
+    if args.relay_id is None:
+        print("ERROR: A relay needs a --relay-id for the upstream server.")
+        sys.exit(1)
+    upstream = Upstream(int(args.relay_id))
+    # The server above paces the frames.
+    microseconds_per_frame = 0
+    host, port = args.upstream.rsplit(":", 1)
+    reactor.connectTCP(host, int(port), upstream)
 
 reactor.listenTCP(portnum, factory)
 print("MPE Server started on port %i" % portnum)
 print("Running at max %i FPS" % framerate)
+if args.adaptive:
+    pacer = FramePacer(refresh_rate, framerate)
+    print("Adapting the framerate to divisors of %.6g Hz" % refresh_rate)
 if screens_required > 0:
     print("Waiting for %i clients." % screens_required)
 reactor.run()
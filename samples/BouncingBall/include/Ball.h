@@ -8,51 +8,141 @@
 
 #pragma once
 
-#include "cinder/gl/Batch.h"
+#include <cmath>
+#include <vector>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define BALLS_USE_SSE2
+#endif
+
+#include "cinder/CinderMath.h"
+#include "cinder/Rand.h"
+#include "cinder/Rect.h"
+#include "cinder/Vector.h"
 
 const static uint32_t kDefaultRadius = 30;
 
+//! One ball as an object, the array of structures layout. BallField does the same for many balls
+//! as a structure of arrays, the sample keeps this one to compare the two.
 class Sphere {
 public:
-	
-	Sphere( const ci::vec2 &position, const ci::vec2 &velocity, const ci::vec2 &size, const ci::gl::BatchRef &batch )
-	: mPosition( ci::math<float>::clamp( position.x, kDefaultRadius, size.x - kDefaultRadius),
-				ci::math<float>::clamp( position.y, kDefaultRadius, size.y - kDefaultRadius) ),
-	mVelocity( velocity ), mClientSize( size ), mSphere( batch ) {}
+
+	Sphere( const ci::vec2 &position, const ci::vec2 &velocity, const ci::vec2 &size, float radius = kDefaultRadius )
+	: mPosition( ci::math<float>::clamp( position.x, radius, size.x - radius ),
+				ci::math<float>::clamp( position.y, radius, size.y - radius ) ),
+	mVelocity( velocity ), mClientSize( size ), mDiameter( radius * 2.0f ) {}
 	~Sphere() {}
-	
+
 	inline void update()
 	{
-		float radius = mDiameter * 0.5;
-		
-		if ( mPosition.x < radius || mPosition.x >
-			( mClientSize.x - radius ) ) {
-			std::cout << "Resetting x" << std::endl;
-			mVelocity.x = mVelocity.x * -1;
-		}
-		if ( mPosition.y < radius || mPosition.y >
-			( mClientSize.y - radius ) ) {
-			std::cout << "Resetting y" << std::endl;
-			mVelocity.y = mVelocity.y * -1;
-		}
-		
+		float radius = mDiameter * 0.5f;
+
+		// Heading back in rather than flipping, so a ball that's out by more than a step doesn't get stuck.
+		if ( mPosition.x < radius )
+			mVelocity.x = std::fabs( mVelocity.x );
+		if ( mPosition.x > ( mClientSize.x - radius ) )
+			mVelocity.x = -std::fabs( mVelocity.x );
+		if ( mPosition.y < radius )
+			mVelocity.y = std::fabs( mVelocity.y );
+		if ( mPosition.y > ( mClientSize.y - radius ) )
+			mVelocity.y = -std::fabs( mVelocity.y );
+
 		mPosition += mVelocity;
 	}
-	
-	inline void draw()
-	{
-		using namespace ci;
-		
-		gl::pushModelMatrix();
-		gl::translate( mPosition );
-		mSphere->draw();
-		gl::popModelMatrix();
-	}
-	
+
+	const ci::vec2&	getPosition() const { return mPosition; }
+
 private:
 	ci::vec2			mPosition;
 	ci::vec2			mVelocity;
-	ci::ivec2			mClientSize;
+	ci::vec2			mClientSize;
 	float				mDiameter;
-	ci::gl::BatchRef	mSphere;
+};
+
+//! Balls of one radius as a structure of arrays, stepped four at a time with SSE2 where it's available.
+//! The scalar path does the same IEEE operations in the same order, so every client computes the same
+//! positions whichever path it takes.
+class BallField {
+public:
+	BallField() : mCount( 0 ), mRadius( kDefaultRadius ) {}
+
+	//! Places \a count balls at random in \a size with speeds from 1 to 5. Clients that seed \a rand the same get the same balls.
+	void reset( size_t count, const ci::vec2 &size, float radius, ci::Rand &rand )
+	{
+		mCount = count;
+		mRadius = radius;
+		mSize = size;
+		// Padded to whole vectors, the padding balls don't move and aren't drawn.
+		size_t padded = ( count + 3 ) & ~size_t( 3 );
+		mX.assign( padded, size.x * 0.5f );
+		mY.assign( padded, size.y * 0.5f );
+		mVelocityX.assign( padded, 0.0f );
+		mVelocityY.assign( padded, 0.0f );
+		for( size_t i = 0; i < count; ++i ) {
+			mX[i] = rand.nextFloat( radius, size.x - radius );
+			mY[i] = rand.nextFloat( radius, size.y - radius );
+			ci::vec2 velocity = rand.nextVec2() * rand.nextFloat( 1.0f, 5.0f );
+			mVelocityX[i] = velocity.x;
+			mVelocityY[i] = velocity.y;
+		}
+	}
+
+	void update()
+	{
+		step( mX.data(), mVelocityX.data(), mX.size(), mRadius, mSize.x - mRadius );
+		step( mY.data(), mVelocityY.data(), mY.size(), mRadius, mSize.y - mRadius );
+	}
+
+	//! Writes the positions of the balls that touch \a bounds to \a positions, at most \a capacity. Returns how many.
+	size_t cull( const ci::Rectf &bounds, ci::vec2 *positions, size_t capacity ) const
+	{
+		float x1 = bounds.x1 - mRadius, x2 = bounds.x2 + mRadius;
+		float y1 = bounds.y1 - mRadius, y2 = bounds.y2 + mRadius;
+		size_t visible = 0;
+		for( size_t i = 0; i < mCount && visible < capacity; ++i ) {
+			if( mX[i] >= x1 && mX[i] <= x2 && mY[i] >= y1 && mY[i] <= y2 )
+				positions[visible++] = ci::vec2( mX[i], mY[i] );
+		}
+		return visible;
+	}
+
+	size_t	size() const { return mCount; }
+	float	getRadius() const { return mRadius; }
+
+private:
+	//! Moves one axis of every ball, turning the ones past \a lower or \a upper back in.
+	static void step( float *position, float *velocity, size_t count, float lower, float upper )
+	{
+#if defined( BALLS_USE_SSE2 )
+		const __m128 signBit = _mm_set1_ps( -0.0f );
+		const __m128 lowerBound = _mm_set1_ps( lower );
+		const __m128 upperBound = _mm_set1_ps( upper );
+		for( size_t i = 0; i < count; i += 4 ) {
+			__m128 p = _mm_loadu_ps( position + i );
+			__m128 v = _mm_loadu_ps( velocity + i );
+			__m128 speed = _mm_andnot_ps( signBit, v );
+			__m128 below = _mm_cmplt_ps( p, lowerBound );
+			__m128 above = _mm_cmpgt_ps( p, upperBound );
+			v = _mm_or_ps( _mm_and_ps( below, speed ), _mm_andnot_ps( below, v ) );
+			v = _mm_or_ps( _mm_and_ps( above, _mm_or_ps( speed, signBit ) ), _mm_andnot_ps( above, v ) );
+			_mm_storeu_ps( position + i, _mm_add_ps( p, v ) );
+			_mm_storeu_ps( velocity + i, v );
+		}
+#else
+		for( size_t i = 0; i < count; ++i ) {
+			float speed = std::fabs( velocity[i] );
+			if( position[i] < lower )
+				velocity[i] = speed;
+			if( position[i] > upper )
+				velocity[i] = -speed;
+			position[i] += velocity[i];
+		}
+#endif
+	}
+
+	std::vector<float>	mX, mY, mVelocityX, mVelocityY;
+	size_t				mCount;
+	float				mRadius;
+	ci::vec2			mSize;
 };
@@ -1,7 +1,12 @@
+#include <algorithm>
+
 #include "cinder/app/App.h"
 #include "cinder/app/RendererGl.h"
 #include "cinder/gl/gl.h"
 #include "cinder/gl/GlslProg.h"
+#include "cinder/Json.h"
+#include "cinder/Log.h"
+#include "cinder/Timer.h"
 
 #include "cinder/Rand.h"
 #include "cinder/Rect.h"
@@ -14,8 +19,13 @@ using namespace ci;
 using namespace ci::app;
 using namespace std;
 
+// How many frames of update times go into each report in headless mode.
+const static size_t kReportFrames = 300;
+
 class BouncingBallApp : public App {
 public:
+	BouncingBallApp() : mBallCount( 1000 ), mBallRadius( kDefaultRadius ), mUseObjects( false ), mIsHeadless( false ) {}
+
 	void setup() override;
 	void mouseDown( MouseEvent event ) override;
 	void draw() override;
@@ -27,26 +37,36 @@ public:
 	// called updateFrame.
 	void updateFrame( uint64_t frameNum );
 	
+	void loadBenchmarkSettings( const DataSourceRef &settingsJsonFile );
 	void setupGl();
+	void reportUpdateTimes();
 	
 	void reset();
 	void dataMessage( const std::string &message, const uint32_t id );
 	
 	mpe::ClientRef			mMpeClient;
+	// The balls as one object each, or as a structure of arrays. "layout" in the settings picks one.
 	std::vector<::Sphere>	mSpheres;
+	BallField				mBalls;
 	Rand					mRand;
-	gl::BatchRef			mSphereBatch;
+	gl::BatchRef			mBallBatch;
+	gl::VboRef				mInstanceVbo;
 	gl::GlslProgRef			mGlsl;
-	CameraPersp				mCam;
+
+	size_t					mBallCount;
+	float					mBallRadius;
+	bool					mUseObjects;
+	bool					mIsHeadless;
+	std::vector<double>		mUpdateTimes;
+	std::vector<vec2>		mVisiblePositions;
 };
 
 void BouncingBallApp::setup()
 {
-	randSeed( 5 );
-	
 	// Construct the name of the settings file, CLIENT_ID is a preprocessor variable
 	// that changes for each build.
 	auto settingsFile = "settings." + to_string( CLIENT_ID ) + ".json";
+	loadBenchmarkSettings( loadAsset( settingsFile ) );
 	// Initialize and setup the MPE Client
 	mMpeClient = mpe::Client::create( loadAsset( settingsFile ) );
 	// Pass the function callbacks to MPE Client
@@ -54,31 +74,88 @@ void BouncingBallApp::setup()
 	mMpeClient->setUpdateFrameCallback( &BouncingBallApp::updateFrame, this );
 	mMpeClient->setResetCallback( &BouncingBallApp::reset, this );
 	
-	// Initialize some gl specific stuff
-	gl::viewport( mMpeClient->getGlWindowInfo() );
-	gl::scissor( mMpeClient->getGlWindowInfo() );
+	if( mIsHeadless ) {
+		// Nothing is drawn, so the frame rate shouldn't hold back how fast the server can step us.
+		disableFrameRate();
+		mUpdateTimes.reserve( kReportFrames );
+	}
+	else {
+		// Initialize some gl specific stuff
+		gl::viewport( mMpeClient->getGlWindowInfo() );
+		gl::scissor( mMpeClient->getGlWindowInfo() );
 
-	setupGl();
+		setupGl();
+	}
 	
 	// Initialize the resettable member functions using the reset function.
 	reset();
+}
 	
-	gl::enableDepthRead();
-	gl::enableDepthWrite();
+void BouncingBallApp::loadBenchmarkSettings( const DataSourceRef &settingsJsonFile )
+{
+	try {
+		JsonTree benchmark = JsonTree( settingsJsonFile ).getChild( "settings" ).getChild( "benchmark" );
+		mBallCount = benchmark.getValueForKey<size_t>( "balls" );
+		mBallRadius = benchmark.getValueForKey<float>( "radius" );
+		mUseObjects = benchmark.getValueForKey<std::string>( "layout" ) == "objects";
+		mIsHeadless = benchmark.getValueForKey<bool>( "headless" );
+	}
+	catch( JsonTree::ExcChildNotFound e ) {
+		// Not required
+		CI_LOG_V( "Using default benchmark settings" );
+	}
+	CI_LOG_I( "Bouncing " << mBallCount << " balls as " << ( mUseObjects ? "objects" : "arrays" )
+			  << ( mIsHeadless ? ", headless" : "" ) );
 }
 
 void BouncingBallApp::setupGl()
 {
-	// Create our sphere that we can draw multiple times
-	mSphereBatch = gl::Batch::create( geom::Sphere().radius( kDefaultRadius ), gl::getStockShader( gl::ShaderDef().lambert() ) );
+	// One circle drawn once per visible ball, offset by a per instance position.
+	mGlsl = gl::GlslProg::create( gl::GlslProg::Format()
+		.vertex( CI_GLSL( 150,
+			uniform mat4	ciModelViewProjection;
+			in vec4			ciPosition;
+			in vec2			vInstancePosition;
+			void main( void ) {
+				gl_Position = ciModelViewProjection * ( ciPosition + vec4( vInstancePosition, 0.0, 0.0 ) );
+			}
+		) )
+		.fragment( CI_GLSL( 150,
+			out vec4		oColor;
+			void main( void ) {
+				oColor = vec4( 1.0 );
+			}
+		) ) );
+
+	mVisiblePositions.resize( mBallCount );
+	mInstanceVbo = gl::Vbo::create( GL_ARRAY_BUFFER, mBallCount * sizeof( vec2 ), nullptr, GL_DYNAMIC_DRAW );
+	geom::BufferLayout instanceLayout;
+	instanceLayout.append( geom::Attrib::CUSTOM_0, 2, 0, 0, 1 /* per instance */ );
+	auto mesh = gl::VboMesh::create( geom::Circle().radius( mBallRadius ).subdivisions( 16 ) );
+	mesh->appendVbo( instanceLayout, mInstanceVbo );
+	mBallBatch = gl::Batch::create( mesh, mGlsl, { { geom::Attrib::CUSTOM_0, "vInstancePosition" } } );
 }
 
 void BouncingBallApp::reset()
 {
+	// Every client seeds the same so they all start with the same balls.
+	mRand.seed( 5 );
 	mSpheres.clear();
+	mUpdateTimes.clear();
 	
-	mSpheres.push_back( ::Sphere( vec2( mMpeClient->getMasterSize() ) / 2.0f,
-								 vec2(10.0f, 10.0f), mMpeClient->getMasterSize(), mSphereBatch ) );
+	vec2 masterSize( mMpeClient->getMasterSize() );
+	if( mUseObjects ) {
+		mSpheres.reserve( mBallCount );
+		for( size_t i = 0; i < mBallCount; ++i ) {
+			vec2 position( mRand.nextFloat( mBallRadius, masterSize.x - mBallRadius ),
+						   mRand.nextFloat( mBallRadius, masterSize.y - mBallRadius ) );
+			vec2 velocity = mRand.nextVec2() * mRand.nextFloat( 1.0f, 5.0f );
+			mSpheres.push_back( ::Sphere( position, velocity, masterSize, mBallRadius ) );
+		}
+	}
+	else {
+		mBalls.reset( mBallCount, masterSize, mBallRadius, mRand );
+	}
 }
 
 void BouncingBallApp::mouseDown( MouseEvent event )
@@ -93,21 +170,64 @@ void BouncingBallApp::dataMessage( const std::string &message, const uint32_t id
 
 void BouncingBallApp::updateFrame( uint64_t frameNum )
 {
-	for( auto & sphere : mSpheres ) {
-		sphere.update();
+	Timer timer( true );
+	if( mUseObjects ) {
+		for( auto & sphere : mSpheres ) {
+			sphere.update();
+		}
+	}
+	else {
+		mBalls.update();
 	}
+
+	if( mIsHeadless ) {
+		mUpdateTimes.push_back( timer.getSeconds() );
+		if( mUpdateTimes.size() == kReportFrames )
+			reportUpdateTimes();
+	}
+}
+
+void BouncingBallApp::reportUpdateTimes()
+{
+	std::sort( mUpdateTimes.begin(), mUpdateTimes.end() );
+	double total = 0;
+	for( auto time : mUpdateTimes )
+		total += time;
+	CI_LOG_I( mBallCount << " balls, update over " << mUpdateTimes.size() << " frames (ms): mean "
+			  << total * 1000.0 / mUpdateTimes.size() << ", median " << mUpdateTimes[mUpdateTimes.size() / 2] * 1000.0
+			  << ", p99 " << mUpdateTimes[mUpdateTimes.size() * 99 / 100] * 1000.0 << ", max " << mUpdateTimes.back() * 1000.0 );
+	mUpdateTimes.clear();
 }
 
 void BouncingBallApp::draw()
 {
+	if( mIsHeadless ) {
+		// There's nothing to draw, so a frame is done as soon as it's updated.
+		mMpeClient->doneRendering();
+		return;
+	}
+
 	gl::clear( Color( 0, 0, 0 ) );
 	
 	gl::setMatricesWindowPersp( getWindowSize() );
 	auto localOrigin = vec2( mMpeClient->getVisibleRect().x1, mMpeClient->getVisibleRect().y1 );
 	gl::translate( vec3( localOrigin.x * -1.0f, localOrigin.y * -1.0f, 0.0f ) );
 	
-	for( auto & sphere : mSpheres ) {
-		sphere.draw();
+	// Only the balls that touch this client's part of the wall are uploaded and drawn.
+	size_t visible = 0;
+	if( mUseObjects ) {
+		Rectf bounds = mMpeClient->getVisibleRect().inflated( vec2( mBallRadius ) );
+		for( auto & sphere : mSpheres ) {
+			if( bounds.contains( sphere.getPosition() ) )
+				mVisiblePositions[visible++] = sphere.getPosition();
+		}
+	}
+	else {
+		visible = mBalls.cull( mMpeClient->getVisibleRect(), mVisiblePositions.data(), mVisiblePositions.size() );
+	}
+	if( visible > 0 ) {
+		mInstanceVbo->bufferSubData( 0, visible * sizeof( vec2 ), mVisiblePositions.data() );
+		mBallBatch->drawInstanced( static_cast<GLsizei>( visible ) );
 	}
 	
 	mMpeClient->doneRendering();
@@ -7,6 +7,7 @@
 //
 
 #include "cinder/app/App.h"
+#include "cinder/CinderMath.h"
 #include "cinder/Json.h"
 #include "Protocol.h"
 
@@ -22,10 +23,23 @@ namespace mpe {
 	
 Client::Client( const DataSourceRef &jsonSettingsFile, asio::io_service &service, bool thread )
 : ClientBase(), mIsConnected(false), mPort( 0 ), mHostname( "" ),
-	mTcpClient( TcpClient::create( service ) ),
+	mTcpClient( TcpClient::create( service ) ), mBulkTcpClient( TcpClient::create( service ) ),
+	mAutoReconnect( true ), mShouldReconnect( false ), mIsConnecting( false ), mNextReconnect( 0 ), mReconnectDelay( 0 ),
+	mReconnectRandom( std::random_device()() ), mSessionResumed( false ), mLastFrameReceived( 0 ),
+	mRecordOutbox( false ), mHandshakePending( false ), mOutboxLines( 0 ), mResendOutboxLines( 0 ),
+	mBulkLaneReady( false ), mUseBulkLane( false ), mBulkThreshold( 16384 ), mBulkChunkSize( 16384 ),
+	mBulkFrameBudget( 262144 ), mNextBulkMessageId( 0 ),
+	mStateNegotiated( false ),
+	mRegionRoutingNegotiated( false ),
+	mTopicsNegotiated( false ),
+	mClockNegotiated( false ), mNextClockPing( 0 ), mPresentationTime( 0 ), mWaitForPresentation( false ),
+	mTargetFrameRate( 0 ), mTraceNegotiated( false ), mStateHashNegotiated( false ),
+	mOfferCompression( false ), mCompressionNegotiated( false ), mCompressionThreshold( 512 ),
+	mIsPipelined( false ), mPipelineStarted( false ), mPipelineFrame( 0 ), mPipelineBusy( false ), mPipelineQuit( false ),
 	mIsThreaded( thread ), mMessageMutex( make_shared<std::mutex>() ),
+	mViewportsDoneFrame( 0 ), mCameraFov( 60.0f ), mCameraNear( 0.0f ), mCameraFar( 0.0f ), mMasterSize( 0 ),
 	mLastFrameConfirmed( 0 ), mClientName( "" ), mClientID( 0 ),
-	mIsAsync( false ), mAsyncReceivesData( false )
+	mIsAsync( false ), mAsyncReceivesData( false ), mAsyncDeliveryRate( 0 ), mAsyncLatestOnly( false )
 {
 	loadSettings( jsonSettingsFile );
 	
@@ -37,6 +51,7 @@ Client::Client( const DataSourceRef &jsonSettingsFile, asio::io_service &service
 Client::~Client()
 {
 	stop();
+	setPipelined( false );
 }
 	
 ClientRef Client::create( const ci::DataSourceRef &jsonSettingsFile, asio::io_service &service, bool thread )
@@ -46,8 +61,21 @@ ClientRef Client::create( const ci::DataSourceRef &jsonSettingsFile, asio::io_se
 	
 void Client::setupCamera( const ClientRef &client, ci::CameraPersp &cam, float zPosition )
 {
-	auto masterSize = client->getMasterSize();
-	auto viewportRect = client->getVisibleRect();
+	setupCamera( client, 0, cam, zPosition );
+}
+	
+void Client::setupCamera( const ClientRef &client, size_t viewportIndex, ci::CameraPersp &cam, float zPosition )
+{
+	// Everything but the distance was worked out in updateTransforms, moving the eye along z keeps the orientation.
+	const Transforms &transforms = client->mTransforms.at( viewportIndex );
+	cam.setAspectRatio( transforms.mAspectRatio );
+	cam.setOrientation( transforms.mOrientation );
+	cam.setEyePoint( vec3( vec2( client->getMasterSize() ) * 0.5f, zPosition ) );
+	cam.setLensShift( transforms.mLensShift );
+}
+	
+void Client::setupCamera( const ci::ivec2 &masterSize, const ci::Rectf &viewportRect, ci::CameraPersp &cam, float zPosition )
+{
 	auto localSize = viewportRect.getSize();
 	auto localOrigin = vec2( viewportRect.x1, viewportRect.y1 );
 	
@@ -73,7 +101,56 @@ void Client::setupCamera( const ClientRef &client, ci::CameraPersp &cam, float z
 	
 ci::mat4 Client::getClientModelTransform( const ClientRef &client )
 {
+	return client->getModelMatrix();
+}
 	
+void Client::setVisibleRect( const ci::Rectf &rect )
+{
+	// The viewports are what the transforms are built from, a single one is the visible rect itself.
+	const Rectf previous = mLocalViewportRect;
+	float scaleX = previous.getWidth() > 0 ? rect.getWidth() / previous.getWidth() : 1.0f;
+	float scaleY = previous.getHeight() > 0 ? rect.getHeight() / previous.getHeight() : 1.0f;
+	for( auto & viewport : mViewports ) {
+		viewport = Rectf( rect.x1 + ( viewport.x1 - previous.x1 ) * scaleX, rect.y1 + ( viewport.y1 - previous.y1 ) * scaleY,
+						  rect.x1 + ( viewport.x2 - previous.x1 ) * scaleX, rect.y1 + ( viewport.y2 - previous.y1 ) * scaleY );
+	}
+	mLocalViewportRect = rect;
+	updateTransforms();
+}
+	
+void Client::updateTransforms()
+{
+	mTransforms.assign( getNumViewports(), Transforms() );
+	if( mMasterSize.x <= 0 || mMasterSize.y <= 0 )
+		return;
+	
+	// Like gl::setMatricesWindowPersp, the eye is in front of the center of the master space, at the distance
+	// where the field of view covers its height, and y points down. Every viewport shares the eye and gets
+	// its own off axis frustum, so the image lines up across screens.
+	vec2 master( mMasterSize );
+	float distance = ( master.y * 0.5f ) / tan( toRadians( mCameraFov ) * 0.5f );
+	float nearClip = mCameraNear > 0 ? mCameraNear : distance * 0.01f;
+	float farClip = mCameraFar > 0 ? mCameraFar : distance * 100.0f;
+	vec3 center( master * 0.5f, 0.0f );
+	mat4 view = glm::lookAt( center + vec3( 0, 0, distance ), center, vec3( 0, 1, 0 ) )
+		* glm::scale( vec3( 1, -1, 1 ) ) * glm::translate( vec3( 0, -master.y, 0 ) );
+	float toNear = nearClip / distance;
+	
+	for( size_t i = 0; i < mTransforms.size(); ++i ) {
+		const Rectf &rect = getViewportRect( i );
+		mTransforms[i].mModel = glm::translate( vec3( -rect.x1, -rect.y1, 0 ) );
+		mTransforms[i].mView = view;
+		mTransforms[i].mProjection = glm::frustum( ( rect.x1 - center.x ) * toNear, ( rect.x2 - center.x ) * toNear,
+												   ( center.y - rect.y2 ) * toNear, ( center.y - rect.y1 ) * toNear,
+												   nearClip, farClip );
+		
+		// What setupCamera applies to an app's own CameraPersp.
+		CameraPersp camera;
+		setupCamera( mMasterSize, rect, camera, distance );
+		mTransforms[i].mAspectRatio = camera.getAspectRatio();
+		mTransforms[i].mOrientation = camera.getOrientation();
+		mTransforms[i].mLensShift = camera.getLensShift();
+	}
 }
 	
 void Client::start( const std::string &hostname, uint16_t port )
@@ -85,11 +162,28 @@ void Client::start( const std::string &hostname, uint16_t port )
 	
 void Client::stop()
 {
+	finishPipelinedUpdate();
+	mShouldReconnect = false;
 	mIsConnected = false;
+	mBulkLaneReady = false;
+	mCompressionNegotiated = false;
+	mStateNegotiated = false;
+	mRegionRoutingNegotiated = false;
+	mTopicsNegotiated = false;
+	mClockNegotiated = false;
+	mClockSync.reset();
+	{
+		std::lock_guard<std::mutex> guard( *mMessageMutex );
+		mClockArrivals.clear();
+	}
 	if( mTcpSession ) {
 		mTcpSession->close();
 		mTcpSession.reset();
 	}
+	if( mBulkSession ) {
+		mBulkSession->close();
+		mBulkSession.reset();
+	}
 }
 
 void Client::update()
@@ -97,74 +191,529 @@ void Client::update()
 	mFrameIsReady = false;
 	
 	if ( isConnected() ) {
+		// Messages reach the app on this thread, never while the worker steps.
+		finishPipelinedUpdate();
+		// Frames parsed in one update are one step for interpolation, from the state the update before left.
+		bool interpolating = false;
 		{
+			MPE_TRACE_SCOPE( "parse" );
 			std::lock_guard<std::mutex> guard( *mMessageMutex );
-			if ( mMessages.size() ) {
-				// There may be more than 1 message in the read.
-				while( ! mMessages.empty() ) {
-					auto & message = mMessages.front();
-					if ( message.size() > 0) {
-						CI_LOG_V("I'm about to parse a message");
-						Protocol::parseClient( message, this );
+			// There may be more than 1 message in the read, each one is parsed where it is.
+			size_t start = 0, end;
+			while( ( end = mInbound.find( Protocol::messageDelimiter(), start ) ) != std::string::npos ) {
+				boost::string_ref message( mInbound.data() + start, end - start );
+				// Frames replayed when a session resumes may overlap the ones we have.
+				uint64_t frame = Protocol::frameNumber( message );
+				if( frame != 0 && frame <= mLastFrameReceived ) {
+					start = end + 1;
+					continue;
+				}
+				// A frame that references bulk messages waits until they're reassembled.
+				if( ! hasBulkPayloads( message ) ) {
+					break;
+				}
+				if ( ! message.empty() ) {
+					if ( frame != 0 && ! interpolating && ! mInterpolation.isEmpty() ) {
+						mInterpolation.beginFrame( mState );
+						interpolating = true;
 					}
-					CI_LOG_V("Current message" + message );
-					mMessages.pop_front();
+					Protocol::parseClient( message, this );
+					dispatchFrameMessages();
+				}
+				start = end + 1;
+				// Sync clients render every frame, the ones replayed after a resume too, so the rest wait for the next update.
+				if( mFrameIsReady && ! mIsAsync ) {
+					break;
 				}
-				
 			}
+			mInbound.erase( 0, start );
+		}
+		
+		sendClockPing();
+		sendBulkChunks();
+		reportStreamProgress();
+		
+		if ( mFrameIsReady && ! mPendingStateDelta.empty() ) {
+			mState.applyDelta( mPendingStateDelta );
+			mPendingStateDelta.clear();
 		}
 		
+		if ( interpolating ) {
+			// Presentation times are evenly spaced, arrivals jitter with the network.
+			mInterpolation.endFrame( hasPresentationTime() ? mClockSync.toLocal( mPresentationTime ) : ClockSync::now() );
+		}
 		
 		if ( mFrameIsReady && ! mIsAsync ) {
 			// You always need an updateCallback if synchronous.
 			CI_ASSERT( mUpdateCallback );
 			CI_LOG_V("I'm updating the current frame.");
-			mUpdateCallback( getCurrentRenderFrame() );
+			if ( mWaitForPresentation ) {
+				MPE_TRACE_SCOPE( "waitForPresentation" );
+				waitForPresentationTime();
+			}
+			if ( mIsPipelined ) {
+				if ( mFrameHandoffCallback )
+					mFrameHandoffCallback();
+				startPipelinedUpdate( getCurrentRenderFrame() );
+			}
+			else {
+				MPE_TRACE_SCOPE( "update" );
+				mUpdateCallback( getCurrentRenderFrame() );
+			}
+		}
+		
+		// A running worker may still set state, finishPipelinedUpdate sends it.
+		if ( ! mPipelineStarted ) {
+			sendCoalescedMessages();
+			sendStateDelta();
 		}
 	}
-	else {
-//		if( mTcp ) {
-//			start();
-//		}
+	else if ( mShouldReconnect && ! mIsConnecting && ClockSync::now() >= mNextReconnect ) {
+		reconnect();
 	}
 }
 	
 void Client::togglePause()
 {
 	auto msg = Protocol::togglePause();
-	mTcpSession->write( TcpSession::stringToBuffer( msg ) );
+	write( msg );
 }
 
 void Client::resetAll()
 {
 	auto msg = Protocol::reset();
-	mTcpSession->write( TcpSession::stringToBuffer( msg ) );
+	write( msg );
+}
+	
+void Client::write( std::string &msg )
+{
+	static const size_t kMaxOutboxLines = 4096;
+	// Writes are only kept while the server may resume the session.
+	if( mRecordOutbox ) {
+		size_t lines = std::count( msg.begin(), msg.end(), Protocol::messageDelimiter()[0] );
+		std::lock_guard<std::mutex> lock( mOutboxMutex );
+		mOutbox.push_back( { msg, mOutboxLines, lines } );
+		mOutboxLines += lines;
+		while( mOutbox.size() > 1 && mOutboxLines - mOutbox.front().mFirstLine > kMaxOutboxLines ) {
+			mOutbox.pop_front();
+		}
+	}
+	// While reconnecting, lines only go to the outbox and are sent once the session resumes.
+	if( mIsConnected && mTcpSession ) {
+		mTcpSession->write( TcpSession::stringToBuffer( msg ) );
+	}
+}
+	
+void Client::reconnect()
+{
+	// The delay doubles with every try. Picking it at random from its upper half keeps the clients of a wall that
+	// lost the server together from all coming back at once.
+	static const uint64_t kMinDelay = 100000, kMaxDelay = 5000000;
+	mReconnectDelay = std::min( std::max( mReconnectDelay * 2, kMinDelay ), kMaxDelay );
+	std::uniform_int_distribution<uint64_t> jitter( mReconnectDelay / 2, mReconnectDelay );
+	mNextReconnect = ClockSync::now() + jitter( mReconnectRandom );
+	
+	mIsConnected = false;
+	if( mTcpSession ) {
+		mTcpSession->close();
+		mTcpSession.reset();
+	}
+	if( mBulkSession ) {
+		mBulkSession->close();
+		mBulkSession.reset();
+	}
+	mBulkLaneReady = false;
+	
+	CI_LOG_I( "Reconnecting to " << mHostname << " on " << mPort );
+	mIsConnecting = true;
+	mTcpClient->connect( mHostname, mPort );
+}
+	
+void Client::resendOutbox( size_t received )
+{
+	std::string msgs;
+	{
+		std::lock_guard<std::mutex> lock( mOutboxMutex );
+		size_t firstKept = mResendOutbox.empty() ? mResendOutboxLines : mResendOutbox.front().mFirstLine;
+		if( received < firstKept ) {
+			CI_LOG_W( "Lost " << firstKept - received << " lines while reconnecting" );
+		}
+		for( auto & entry : mResendOutbox ) {
+			if( entry.mFirstLine + entry.mLineCount <= received )
+				continue;
+			// The server may have received the first lines of a write.
+			size_t start = 0;
+			for( size_t skip = received > entry.mFirstLine ? received - entry.mFirstLine : 0; skip > 0; --skip ) {
+				start = entry.mLines.find( Protocol::messageDelimiter(), start ) + 1;
+			}
+			msgs.append( entry.mLines, start, std::string::npos );
+		}
+		mResendOutbox.clear();
+	}
+	if( ! msgs.empty() ) {
+		write( msgs );
+	}
 }
 	
 void Client::sendMessage( const std::string &message )
 {
-	auto msg = Protocol::dataMessage( message );
-	mTcpSession->write( TcpSession::stringToBuffer( msg ) );
+	sendMessage( message, std::vector<uint32_t>() );
 }
 
 void Client::sendMessage( const std::string &message, const std::vector<uint32_t> &clientIds )
 {
-	auto msg = Protocol::dataMessage( message, clientIds );
-	mTcpSession->write( TcpSession::stringToBuffer( msg ) );
+	sendCleanMessage( Protocol::cleanMessage( message ), clientIds );
+}
+	
+void Client::compressMessage( std::string &sanitizedMessage )
+{
+	if( mCompressionNegotiated && sanitizedMessage.size() >= mCompressionThreshold &&
+	    Protocol::compressMessage( sanitizedMessage, mCompressScratch, mCompressedMessage ) ) {
+		sanitizedMessage.swap( mCompressedMessage );
+	}
+}
+	
+void Client::sendCleanMessage( std::string sanitizedMessage, const std::vector<uint32_t> &clientIds )
+{
+	compressMessage( sanitizedMessage );
+	if( mBulkLaneReady && sanitizedMessage.size() >= mBulkThreshold ) {
+		queueBulkMessage( std::move( sanitizedMessage ), clientIds );
+		return;
+	}
+	auto msg = Protocol::cleanDataMessage( sanitizedMessage, clientIds );
+	write( msg );
+}
+	
+void Client::sendCoalescedMessage( const std::string &message, const std::string &coalesceKey, CoalesceMode mode )
+{
+	bool accumulate = ( mode == CoalesceMode::ACCUMULATE );
+	auto key = Protocol::cleanMessage( coalesceKey );
+	// Cleaned first, what accumulating keeps of a message that isn't numbers still goes on the wire.
+	auto cleanMessage = Protocol::cleanMessage( message );
+	for( auto & coalesced : mCoalescedMessages ) {
+		if( coalesced.mKey == key && coalesced.mAccumulate == accumulate ) {
+			if( accumulate )
+				Protocol::accumulateMessage( coalesced.mMessage, cleanMessage );
+			else
+				coalesced.mMessage = std::move( cleanMessage );
+			return;
+		}
+	}
+	mCoalescedMessages.push_back( { std::move( key ), std::move( cleanMessage ), accumulate } );
+}
+	
+void Client::registerChannel( uint16_t channelId, size_t type, size_t size, const ChannelHandler &handler )
+{
+	if( channelId >= mChannels.size() )
+		mChannels.resize( channelId + 1 );
+	mChannels[channelId].mSize = size;
+	mChannels[channelId].mHandler = handler;
+	
+	if( type >= mChannelIds.size() )
+		mChannelIds.resize( type + 1, -1 );
+	mChannelIds[type] = channelId;
+}
+	
+void Client::sendChannelMessage( size_t type, const void *data, size_t size, const std::vector<uint32_t> &clientIds )
+{
+	if( type >= mChannelIds.size() || mChannelIds[type] < 0 ) {
+		CI_LOG_E( "No channel registered for this type, call registerChannel first." );
+		return;
+	}
+	// Channel messages are base64, so they don't need cleaning.
+	Protocol::channelMessage( static_cast<uint16_t>( mChannelIds[type] ), data, size, mChannelScratch, mChannelMessage );
+	sendCleanMessage( mChannelMessage, clientIds );
+}
+	
+void Client::sendChannelMessage( size_t type, const void *data, size_t size, const ci::Rectf &bounds )
+{
+	if( type >= mChannelIds.size() || mChannelIds[type] < 0 ) {
+		CI_LOG_E( "No channel registered for this type, call registerChannel first." );
+		return;
+	}
+	Protocol::channelMessage( static_cast<uint16_t>( mChannelIds[type] ), data, size, mChannelScratch, mChannelMessage );
+	sendCleanMessage( mChannelMessage, bounds );
+}
+	
+void Client::receivedChannelMessage( boost::string_ref dataMessage, uint32_t fromClientId )
+{
+	uint16_t channelId;
+	if( ! Protocol::decodeChannelMessage( dataMessage, mChannelScratch, channelId ) ) {
+		CI_LOG_E( "Couldn't decode channel message from " << fromClientId );
+		return;
+	}
+	if( channelId >= mChannels.size() || ! mChannels[channelId].mHandler ) {
+		CI_LOG_W( "No handler registered for channel " << channelId );
+		return;
+	}
+	auto & channel = mChannels[channelId];
+	if( mChannelScratch.size() - 2 != channel.mSize ) {
+		CI_LOG_E( "Channel " << channelId << " expects " << channel.mSize << " bytes, got " << mChannelScratch.size() - 2 );
+		return;
+	}
+	channel.mHandler( mChannelScratch.data() + 2, fromClientId );
+}
+	
+void Client::sendMessage( const std::string &message, const ci::Rectf &bounds )
+{
+	sendCleanMessage( Protocol::cleanMessage( message ), bounds );
+}
+	
+void Client::sendCleanMessage( std::string sanitizedMessage, const ci::Rectf &bounds )
+{
+	if( ! mRegionRoutingNegotiated ) {
+		sendCleanMessage( std::move( sanitizedMessage ), std::vector<uint32_t>() );
+		return;
+	}
+	
+	compressMessage( sanitizedMessage );
+	auto msg = Protocol::regionMessage( bounds.canonicalized(), sanitizedMessage );
+	write( msg );
+}
+	
+void Client::subscribe( const std::string &topic )
+{
+	auto sanitizedTopic = Protocol::cleanMessage( topic );
+	if( ! mTopics.insert( sanitizedTopic ).second )
+		return;
+	if( mTcpSession ) {
+		auto msg = Protocol::subscribe( sanitizedTopic );
+		write( msg );
+	}
+}
+	
+void Client::unsubscribe( const std::string &topic )
+{
+	auto sanitizedTopic = Protocol::cleanMessage( topic );
+	if( mTopics.erase( sanitizedTopic ) == 0 )
+		return;
+	if( mTcpSession ) {
+		auto msg = Protocol::unsubscribe( sanitizedTopic );
+		write( msg );
+	}
+}
+	
+void Client::publish( const std::string &topic, const std::string &message )
+{
+	if( ! mTopicsNegotiated ) {
+		sendMessage( message );
+		return;
+	}
+	
+	auto sanitizedMessage = Protocol::cleanMessage( message );
+	compressMessage( sanitizedMessage );
+	auto msg = Protocol::publishMessage( Protocol::cleanMessage( topic ), sanitizedMessage );
+	write( msg );
+}
+	
+void Client::sendCoalescedMessages()
+{
+	if( mCoalescedMessages.empty() || ! mTcpSession )
+		return;
+	
+	std::string msgs;
+	for( auto & coalesced : mCoalescedMessages ) {
+		msgs += Protocol::coalescedMessage( coalesced.mKey, coalesced.mAccumulate, coalesced.mMessage );
+	}
+	mCoalescedMessages.clear();
+	write( msgs );
+}
+	
+void Client::queueBulkMessage( std::string message, const std::vector<uint32_t> &clientIds )
+{
+	auto total = message.size();
+	mBulkOutgoing.push_back( { mNextBulkMessageId++, std::move( message ), 0, clientIds, StreamReader(), total, SendProgressCallback() } );
+}
+	
+uint32_t Client::sendStream( size_t totalSize, const StreamReader &reader, const SendProgressCallback &progress,
+							 const std::vector<uint32_t> &clientIds )
+{
+	CI_ASSERT( reader );
+	if( ! mUseBulkLane ) {
+		CI_LOG_E( "Streams need the bulk lane, enable it in the settings file." );
+	}
+	auto streamId = mNextBulkMessageId++;
+	mBulkOutgoing.push_back( { streamId, std::string(), 0, clientIds, reader, totalSize, progress } );
+	return streamId;
+}
+	
+uint32_t Client::sendStream( const ci::BufferRef &buffer, const SendProgressCallback &progress,
+							 const std::vector<uint32_t> &clientIds )
+{
+	auto data = static_cast<const uint8_t *>( buffer->getData() );
+	return sendStream( buffer->getSize(), [buffer, data]( uint8_t *dst, size_t offset, size_t size ) {
+		std::copy( data + offset, data + offset + size, dst );
+	}, progress, clientIds );
+}
+	
+void Client::sendBulkChunks()
+{
+	if( ! mBulkLaneReady || mBulkOutgoing.empty() )
+		return;
+	
+	// Everything that fits in this update's budget goes out in one write.
+	std::string chunks;
+	size_t budget = mBulkFrameBudget;
+	while( budget > 0 && ! mBulkOutgoing.empty() ) {
+		auto & outgoing = mBulkOutgoing.front();
+		if( outgoing.mReader ) {
+			// The budget counts encoded bytes, base64 turns every 3 bytes into 4.
+			size_t chunkSize = std::min( { std::max<size_t>( std::min( mBulkChunkSize, budget ) / 4 * 3, 3 ),
+										   outgoing.mTotal - outgoing.mOffset } );
+			mStreamScratch.resize( chunkSize );
+			outgoing.mReader( mStreamScratch.data(), outgoing.mOffset, chunkSize );
+			Protocol::appendStreamChunk( chunks, outgoing.mId, outgoing.mOffset, outgoing.mTotal,
+										 mStreamScratch.data(), chunkSize, outgoing.mClientIds );
+			outgoing.mOffset += chunkSize;
+			budget -= std::min( budget, base64EncodedSize( chunkSize ) );
+		}
+		else {
+			size_t chunkSize = std::min( { mBulkChunkSize, budget, outgoing.mTotal - outgoing.mOffset } );
+			chunks += Protocol::dataChunk( outgoing.mId, outgoing.mOffset, outgoing.mTotal,
+										   outgoing.mPayload.data() + outgoing.mOffset, chunkSize, outgoing.mClientIds );
+			outgoing.mOffset += chunkSize;
+			budget -= chunkSize;
+		}
+		if( outgoing.mProgress ) {
+			outgoing.mProgress( outgoing.mId, outgoing.mOffset, outgoing.mTotal );
+		}
+		if( outgoing.mOffset == outgoing.mTotal ) {
+			mBulkOutgoing.pop_front();
+		}
+	}
+	mBulkSession->write( TcpSession::stringToBuffer( chunks ) );
+}
+	
+bool Client::hasBulkPayloads( boost::string_ref message )
+{
+	// Payloads that failed to reassemble don't hold the frame, it goes through without them.
+	return Protocol::allBulkReferences( message, [this]( uint32_t fromId, uint32_t msgId ) {
+		auto ref = std::make_pair( fromId, msgId );
+		auto found = mBulkIncoming.find( ref );
+		if( found != mBulkIncoming.end() && ( found->second.mFailed || found->second.mPayload.size() == found->second.mTotal ) ) {
+			return true;
+		}
+		auto stream = mStreamIncoming.find( ref );
+		return stream != mStreamIncoming.end() && ( stream->second.mFailed || stream->second.mReceived == stream->second.mTotal );
+	} );
+}
+	
+void Client::reportStreamProgress()
+{
+	if( ! mStreamProgressCallback )
+		return;
+	
+	std::lock_guard<std::mutex> guard( *mMessageMutex );
+	for( auto & stream : mStreamIncoming ) {
+		auto & incoming = stream.second;
+		if( incoming.mReported != incoming.mReceived ) {
+			incoming.mReported = incoming.mReceived;
+			mStreamProgressCallback( stream.first.first, stream.first.second, incoming.mReceived, incoming.mTotal );
+		}
+	}
 }
 	
 void Client::doneRendering()
 {
+	// A pipelined frame is done once the worker has stepped it too.
+	finishPipelinedUpdate();
 	if( mTcpSession ) {
 		if( mLastFrameConfirmed < mCurrentRenderFrame ) {
 			CI_LOG_V("Confirming done with render");
-			auto msg = Protocol::renderComplete( mClientID, mCurrentRenderFrame );
-			mTcpSession->write( TcpSession::stringToBuffer( msg ) );
+			MPE_TRACE_INSTANT( "doneRendering" );
+			auto msg = mStateHashNegotiated && mStateHasher.isUsed() ?
+				Protocol::renderComplete( mClientID, mCurrentRenderFrame, mStateHasher.get() ) :
+				Protocol::renderComplete( mClientID, mCurrentRenderFrame );
+			write( msg );
 			mLastFrameConfirmed = mCurrentRenderFrame;
 		}
 	}
 }
 	
+void Client::setPipelined( bool pipelined )
+{
+	if( pipelined == mIsPipelined )
+		return;
+	
+	if( pipelined ) {
+		mPipelineQuit = false;
+		mPipelineThread = std::thread( &Client::runPipeline, this );
+	}
+	else {
+		finishPipelinedUpdate();
+		{
+			std::lock_guard<std::mutex> lock( mPipelineMutex );
+			mPipelineQuit = true;
+		}
+		mPipelineCondition.notify_all();
+		mPipelineThread.join();
+	}
+	mIsPipelined = pipelined;
+}
+	
+void Client::startPipelinedUpdate( uint64_t frame )
+{
+	{
+		std::lock_guard<std::mutex> lock( mPipelineMutex );
+		mPipelineFrame = frame;
+		mPipelineBusy = true;
+	}
+	mPipelineStarted = true;
+	mPipelineCondition.notify_all();
+}
+	
+void Client::finishPipelinedUpdate()
+{
+	if( ! mPipelineStarted )
+		return;
+	
+	{
+		std::unique_lock<std::mutex> lock( mPipelineMutex );
+		mPipelineCondition.wait( lock, [this] { return ! mPipelineBusy; } );
+	}
+	mPipelineStarted = false;
+	sendCoalescedMessages();
+	sendStateDelta();
+}
+	
+void Client::runPipeline()
+{
+	std::unique_lock<std::mutex> lock( mPipelineMutex );
+	while( true ) {
+		mPipelineCondition.wait( lock, [this] { return mPipelineBusy || mPipelineQuit; } );
+		if( ! mPipelineBusy )
+			return;
+		
+		uint64_t frame = mPipelineFrame;
+		lock.unlock();
+		{
+			MPE_TRACE_SCOPE( "update" );
+			mUpdateCallback( frame );
+		}
+		lock.lock();
+		mPipelineBusy = false;
+		mPipelineCondition.notify_all();
+	}
+}
+	
+void Client::doneRendering( size_t viewportIndex )
+{
+	if( mViewports.size() <= 1 ) {
+		doneRendering();
+		return;
+	}
+	
+	if( mViewportsDoneFrame != mCurrentRenderFrame ) {
+		mViewportsDone.assign( mViewports.size(), false );
+		mViewportsDoneFrame = mCurrentRenderFrame;
+	}
+	mViewportsDone.at( viewportIndex ) = true;
+	// The server gets one confirmation per process, once every window has drawn the frame.
+	if( std::find( mViewportsDone.begin(), mViewportsDone.end(), false ) == mViewportsDone.end() ) {
+		doneRendering();
+	}
+}
+	
 void Client::loadSettings( const ci::DataSourceRef &settingsJsonFile )
 {
 	JsonTree settingsDoc = JsonTree(settingsJsonFile).getChild( "settings" );
@@ -188,6 +737,25 @@ void Client::loadSettings( const ci::DataSourceRef &settingsJsonFile )
 			CI_LOG_V("No asynchreceive flag set, assuming false");
 			mAsyncReceivesData = false;
 		}
+		
+		// Observers that don't need every frame get them at most this often, the frames in
+		// between collapsed into one. With asynchlatest only while they keep up with the server.
+		try {
+			JsonTree node = settingsDoc.getChild( "asynchrate" );
+			mAsyncDeliveryRate = node.getValue<float>();
+		}
+		catch ( JsonTree::ExcChildNotFound e ) {
+			// Not required
+			CI_LOG_V("No asynchrate set, receiving every frame");
+		}
+		try {
+			JsonTree node = settingsDoc.getChild( "asynchlatest" );
+			mAsyncLatestOnly = node.getValue<bool>();
+		}
+		catch ( JsonTree::ExcChildNotFound e ) {
+			// Not required
+			CI_LOG_V("No asynchlatest flag set, assuming false");
+		}
 	}
 	
 	try {
@@ -222,23 +790,106 @@ void Client::loadSettings( const ci::DataSourceRef &settingsJsonFile )
 		CI_LOG_E( "Could not find server and port settings.\n" );
 	}
 	
-	try {
-		JsonTree localDimensions = settingsDoc["local_dimensions"];
-		JsonTree localLocation = settingsDoc["local_location"];
-		uint32_t width = localDimensions["width"].getValue<uint32_t>();
-		uint32_t height = localDimensions["height"].getValue<uint32_t>();
-		int x = localLocation["x"].getValue<int>();
-		int y = localLocation["y"].getValue<int>();
-		mLocalViewportRect = Rectf( x, y, x+width, y+height );
+	// A bezel hides the edges of a screen's slot in master space, so less of it is drawn. Overlapping
+	// projectors draw past the edges of their slot. Both are optional and given per side in master pixels.
+	// Sides a viewport entry doesn't give default to the top level ones.
+	const JsonTree &topLevel = settingsDoc;
+	auto compensate = [&topLevel]( Rectf rect, const JsonTree &node ) {
+		for( auto & edges : { std::make_pair( "bezel", -1.0f ), std::make_pair( "overlap", 1.0f ) } ) {
+			auto read = [&]( const char *side ) {
+				for( const JsonTree *source : { &node, &topLevel } ) {
+					if( source->hasChild( edges.first ) && source->getChild( edges.first ).hasChild( side ) )
+						return source->getChild( edges.first )[side].getValue<float>();
+				}
+				return 0.0f;
+			};
+			rect.x1 -= edges.second * read( "left" );
+			rect.y1 -= edges.second * read( "top" );
+			rect.x2 += edges.second * read( "right" );
+			rect.y2 += edges.second * read( "bottom" );
+		}
+		return rect;
+	};
+	
+	if( settingsDoc.hasChild( "viewports" ) ) {
+		// One process can drive several windows, each with its own part of the master space. They're
+		// only used if every entry is complete, a half set up wall falls back to the single viewport.
+		std::vector<Rectf> viewports;
+		for( auto & viewport : settingsDoc.getChild( "viewports" ) ) {
+			try {
+				JsonTree localDimensions = viewport["local_dimensions"];
+				JsonTree localLocation = viewport["local_location"];
+				int x = localLocation["x"].getValue<int>();
+				int y = localLocation["y"].getValue<int>();
+				viewports.push_back( compensate( Rectf( x, y, x + localDimensions["width"].getValue<uint32_t>(),
+														y + localDimensions["height"].getValue<uint32_t>() ), viewport ) );
+			}
+			catch ( JsonTree::ExcChildNotFound e ) {
+				CI_LOG_E( e.what() << " Viewport " << viewports.size() << " is incomplete, ignoring the 'viewports' settings." );
+				viewports.clear();
+				break;
+			}
+		}
+		mViewports = std::move( viewports );
+	}
+	else {
+		// Not required
+		CI_LOG_V("No 'viewports' settings, using local_dimensions and local_location.");
+	}
+	
+	if ( ! mViewports.empty() ) {
+		// The visible rect covers every viewport, the windows are sized by the app.
+		mLocalViewportRect = mViewports.front();
+		for( auto & viewport : mViewports ) {
+			mLocalViewportRect.include( viewport );
+		}
+	}
+	else {
+		try {
+			JsonTree localDimensions = settingsDoc["local_dimensions"];
+			JsonTree localLocation = settingsDoc["local_location"];
+			uint32_t width = localDimensions["width"].getValue<uint32_t>();
+			uint32_t height = localDimensions["height"].getValue<uint32_t>();
+			int x = localLocation["x"].getValue<int>();
+			int y = localLocation["y"].getValue<int>();
+			mLocalViewportRect = compensate( Rectf( x, y, x+width, y+height ), settingsDoc );
 		
-		// Force the window size based on the settings XML.
-		ci::app::setWindowSize( width, height );
+			// Force the window size based on the settings XML. Bezels and overlaps change how much of the
+			// master space it shows, not how big the screen is.
+			ci::app::setWindowSize( width, height );
+		}
+		catch ( JsonTree::ExcChildNotFound e ) {
+			if ( !mIsAsync ) {
+				// Async controller doesn't need to know about the dimensions
+				CI_LOG_E(e.what() << " Could not find local dimensions settings for synchronous client.\n");
+			}
+		}
+	}
+	
+	try {
+		JsonTree bulkLane = settingsDoc.getChild( "bulk_lane" );
+		mUseBulkLane = bulkLane["enabled"].getValue<bool>();
+		if( bulkLane.hasChild( "threshold" ) )
+			mBulkThreshold = bulkLane["threshold"].getValue<uint32_t>();
+		if( bulkLane.hasChild( "chunk_size" ) )
+			mBulkChunkSize = std::max<size_t>( bulkLane["chunk_size"].getValue<uint32_t>(), 1 );
+		if( bulkLane.hasChild( "frame_budget" ) )
+			mBulkFrameBudget = std::max<size_t>( bulkLane["frame_budget"].getValue<uint32_t>(), 1 );
 	}
 	catch ( JsonTree::ExcChildNotFound e ) {
-		if ( !mIsAsync ) {
-			// Async controller doesn't need to know about the dimensions
-			CI_LOG_E(e.what() << " Could not find local dimensions settings for synchronous client.\n");
-		}
+		// Not required
+		CI_LOG_V("No 'bulk_lane' settings. Every message goes on the control lane.");
+	}
+	
+	try {
+		JsonTree compression = settingsDoc.getChild( "compression" );
+		mOfferCompression = compression["codec"].getValue<string>() == Protocol::kCodecLz4;
+		if( compression.hasChild( "threshold" ) )
+			mCompressionThreshold = compression["threshold"].getValue<uint32_t>();
+	}
+	catch ( JsonTree::ExcChildNotFound e ) {
+		// Not required
+		CI_LOG_V("No 'compression' settings. Data messages are sent raw.");
 	}
 	
 	try {
@@ -254,6 +905,59 @@ void Client::loadSettings( const ci::DataSourceRef &settingsJsonFile )
 		}
 	}
 	
+	try {
+		JsonTree reconnect = settingsDoc.getChild( "reconnect" );
+		mAutoReconnect = reconnect.getValue<bool>();
+	}
+	catch ( JsonTree::ExcChildNotFound e ) {
+		// Not required
+		CI_LOG_V("No 'reconnect' flag set, reconnecting when the connection drops.");
+	}
+	
+	try {
+		JsonTree waitForPresentation = settingsDoc.getChild( "waitForPresentation" );
+		mWaitForPresentation = waitForPresentation.getValue<bool>();
+	}
+	catch ( JsonTree::ExcChildNotFound e ) {
+		// Not required
+		CI_LOG_V("No 'waitForPresentation' flag set, frames are updated as soon as they arrive.");
+	}
+	
+	try {
+		JsonTree trace = settingsDoc.getChild( "trace" );
+		Trace::setEnabled( trace.getValue<bool>() );
+	}
+	catch ( JsonTree::ExcChildNotFound e ) {
+		// Not required
+		CI_LOG_V("No 'trace' flag set, tracing is off.");
+	}
+	
+	try {
+		JsonTree pipelined = settingsDoc.getChild( "pipelined" );
+		if ( pipelined.getValue<bool>() && ! mIsAsync ) {
+			setPipelined( true );
+		}
+	}
+	catch ( JsonTree::ExcChildNotFound e ) {
+		// Not required
+		CI_LOG_V("No 'pipelined' flag set, updating on the render thread.");
+	}
+	
+	try {
+		JsonTree camera = settingsDoc.getChild( "camera" );
+		if( camera.hasChild( "fov" ) )
+			mCameraFov = camera["fov"].getValue<float>();
+		if( camera.hasChild( "near" ) )
+			mCameraNear = camera["near"].getValue<float>();
+		if( camera.hasChild( "far" ) )
+			mCameraFar = camera["far"].getValue<float>();
+	}
+	catch ( JsonTree::ExcChildNotFound e ) {
+		// Not required
+		CI_LOG_V("No 'camera' settings, using a 60 degree field of view.");
+	}
+	updateTransforms();
+	
 	try {
 		JsonTree fullscreenNode = settingsDoc.getChild("go_fullscreen");
 		bool boolFull = fullscreenNode.getValue<bool>();
@@ -284,6 +988,9 @@ void Client::start()
 	if( mIsConnected ) {
 		stop();
 	}
+	mShouldReconnect = mAutoReconnect;
+	mReconnectDelay = 0;
+	mIsConnecting = true;
 	
 	mTcpClient->connectConnectEventHandler( &Client::onConnect, this );
 	mTcpClient->connectErrorEventHandler( &Client::onError, this );
@@ -297,6 +1004,29 @@ void Client::onConnect( TcpSessionRef session )
 	CI_LOG_V( "Established Connection with " << mHostname << " on " << mPort );
 	
 	mTcpSession = session;
+	mIsConnecting = false;
+	mReconnectDelay = 0;
+	{
+		std::lock_guard<std::mutex> lock( mOutboxMutex );
+		mResendOutbox.swap( mOutbox );
+		mResendOutboxLines = mOutboxLines;
+		mOutbox.clear();
+		mOutboxLines = 0;
+		// Until the handshake tells whether the server keeps a session for us. Acknowledgements parsed before
+		// it are of the connection that dropped.
+		mRecordOutbox = mAutoReconnect;
+		mHandshakePending = true;
+	}
+	{
+		// The last line of a dropped connection may be cut off, complete ones are still parsed.
+		std::lock_guard<std::mutex> guard( *mMessageMutex );
+		size_t lineStart = mInbound.rfind( Protocol::messageDelimiter() );
+		lineStart = ( lineStart == std::string::npos ) ? 0 : lineStart + 1;
+		if( lineStart < mInbound.size() && mInbound[lineStart] == Protocol::CLOCK_SYNC[0] && ! mClockArrivals.empty() ) {
+			mClockArrivals.pop_back();
+		}
+		mInbound.resize( lineStart );
+	}
 	mIsConnected = true;
 	
 	auto weak = std::weak_ptr<Client>( shared_from_this() );
@@ -314,15 +1044,61 @@ void Client::onConnect( TcpSessionRef session )
 	mTcpSession->connectWriteEventHandler( &Client::onWrite, this );
 	
 	sendClientId();
+	
+	if( mUseBulkLane ) {
+		mBulkTcpClient->connectConnectEventHandler( &Client::onBulkConnect, this );
+		mBulkTcpClient->connectErrorEventHandler( &Client::onError, this );
+		mBulkTcpClient->connect( mHostname, mPort );
+	}
+}
+	
+void Client::onBulkConnect( TcpSessionRef session )
+{
+	CI_LOG_V( "Established bulk lane with " << mHostname << " on " << mPort );
+	
+	mBulkSession = session;
+	mBulkSession->connectErrorEventHandler( &Client::onError, this );
+	mBulkSession->connectReadEventHandler( &Client::onBulkRead, this );
+	
+	auto msg = Protocol::bulkLaneConnect( mClientID );
+	mBulkSession->write( TcpSession::stringToBuffer( msg ) );
+	mBulkSession->read( Protocol::messageDelimiter() );
 }
 	
 void Client::onRead( const ci::BufferRef &buffer )
 {
 	std::lock_guard<std::mutex> guard( *mMessageMutex );
-	auto msg = TcpSession::bufferToString( buffer );
-	CI_LOG_V("Received a message " << msg);
-	auto msgs = ci::split( msg, Protocol::messageDelimiter() );
-	mMessages.push_back( msgs[0] );
+	// Clock ping answers are timed here rather than when they're parsed, which may be a frame later.
+	const char *data = static_cast<const char *>( buffer->getData() );
+	const char *end = data + buffer->getSize();
+	bool isLineStart = mInbound.empty() || mInbound.back() == Protocol::messageDelimiter()[0];
+	for( const char *line = data; line < end; ) {
+		if( isLineStart && *line == Protocol::CLOCK_SYNC[0] )
+			mClockArrivals.push_back( ClockSync::now() );
+		const char *lineEnd = static_cast<const char *>( memchr( line, Protocol::messageDelimiter()[0], end - line ) );
+		if( ! lineEnd )
+			break;
+		if( isLineStart && Trace::isEnabled() && *line == Protocol::NEXT_FRAME[0] )
+			Trace::instant( "receive", Protocol::frameNumber( boost::string_ref( line, lineEnd - line ) ) );
+		line = lineEnd + 1;
+		isLineStart = true;
+	}
+	// A read can end in the middle of the next line, update only parses up to the last delimiter.
+	mInbound.append( data, buffer->getSize() );
+}
+	
+void Client::onBulkRead( const ci::BufferRef &buffer )
+{
+	{
+		std::lock_guard<std::mutex> guard( *mMessageMutex );
+		auto msg = TcpSession::bufferToString( buffer );
+		auto end = msg.find( Protocol::messageDelimiter() );
+		if( end != std::string::npos ) {
+			msg.resize( end );
+		}
+		Protocol::parseBulk( msg, this );
+	}
+	mBulkSession->read( Protocol::messageDelimiter() );
 }
 	
 void Client::onWrite( size_t bytesTransferred )
@@ -333,24 +1109,112 @@ void Client::onWrite( size_t bytesTransferred )
 	
 void Client::onError( std::string err, size_t bytesTransferred )
 {
+	// A failed connect is tried again from update.
+	mIsConnecting = false;
 	CI_LOG_E( err << " Bytes Transferred: " << bytesTransferred );
 }
 
 void Client::sendClientId()
 {
+	Protocol::HandshakeOptions options;
+	options["state"] = "1";
+	// Rendering clients register their viewport for area of interest routing. Async clients have
+	// no screen, they take part to learn whether region messages are routed, and receive all of them.
+	options["aoi"] = mIsAsync ? "all" : Protocol::formatRect( mLocalViewportRect );
+	options["topics"] = "1";
+	options["clock"] = "1";
+	options["pace"] = "1";
+	if( ! mIsAsync ) {
+		options["hash"] = "1";
+	}
+	else {
+		if( mAsyncDeliveryRate > 0 ) {
+			options["rate"] = std::to_string( mAsyncDeliveryRate );
+		}
+		if( mAsyncLatestOnly ) {
+			options["latest"] = "1";
+		}
+	}
+	if( Trace::isEnabled() ) {
+		options["trace"] = "1";
+	}
+	if( mAutoReconnect ) {
+		// A token from the last connection asks the server to resume its session after the last frame we got.
+		options["resume"] = mResumeToken.empty() ? "1" : mResumeToken;
+		if( ! mResumeToken.empty() ) {
+			options["frame"] = std::to_string( mLastFrameReceived );
+		}
+	}
+	if( mOfferCompression ) {
+		options["codec"] = Protocol::kCodecLz4;
+	}
+	
 	if (mIsAsync) {
-		auto msg = Protocol::asyncClientID( mClientID, mClientName, mAsyncReceivesData );
+		auto msg = Protocol::withHandshakeOptions( Protocol::asyncClientID( mClientID, mClientName, mAsyncReceivesData ), options );
 		mTcpSession->write( TcpSession::stringToBuffer( msg ) );
 	}
 	else {
-		auto msg = Protocol::syncClientID( mClientID, mClientName );
+		auto msg = Protocol::withHandshakeOptions( Protocol::syncClientID( mClientID, mClientName ), options );
 		mTcpSession->write( TcpSession::stringToBuffer( msg ) );
 	}
+	// Subscriptions belong to the connection, so they're renewed whenever we connect.
+	for( auto & topic : mTopics ) {
+		auto msg = Protocol::subscribe( topic );
+		write( msg );
+	}
+}
+	
+void Client::receivedHandshake( const std::map<std::string, std::string> &options )
+{
+	auto codec = options.find( "codec" );
+	mCompressionNegotiated = mOfferCompression && codec != options.end() && codec->second == Protocol::kCodecLz4;
+	auto state = options.find( "state" );
+	mStateNegotiated = state != options.end() && state->second == "1";
+	auto aoi = options.find( "aoi" );
+	mRegionRoutingNegotiated = aoi != options.end() && aoi->second == "1";
+	auto topics = options.find( "topics" );
+	mTopicsNegotiated = topics != options.end() && topics->second == "1";
+	auto clock = options.find( "clock" );
+	mClockNegotiated = clock != options.end() && clock->second == "1";
+	mNextClockPing = 0;
+	// A server that paces sends its rate with the first frame.
+	mTargetFrameRate = 0;
+	auto trace = options.find( "trace" );
+	mTraceNegotiated = trace != options.end() && trace->second == "1";
+	auto hash = options.find( "hash" );
+	mStateHashNegotiated = hash != options.end() && hash->second == "1";
+	auto resume = options.find( "resume" );
+	mResumeToken = ( resume != options.end() ) ? resume->second : "";
+	auto resumed = options.find( "resumed" );
+	mSessionResumed = resumed != options.end() && resumed->second == "1";
+	mHandshakePending = false;
+	if( mResumeToken.empty() ) {
+		// The server doesn't resume sessions, so nothing has to be kept for it.
+		std::lock_guard<std::mutex> lock( mOutboxMutex );
+		mRecordOutbox = false;
+		mOutbox.clear();
+	}
+	if( mSessionResumed ) {
+		auto received = options.find( "received" );
+		resendOutbox( received != options.end() ? strtoull( received->second.c_str(), nullptr, 10 ) : 0 );
+		CI_LOG_I( "Resumed session after frame " << mLastFrameReceived );
+	}
+	else {
+		// A new session starts over, whatever the last one missed is gone.
+		std::lock_guard<std::mutex> lock( mOutboxMutex );
+		mResendOutbox.clear();
+		mLastFrameReceived = 0;
+	}
+	CI_LOG_V( "Handshake complete, compression " << ( mCompressionNegotiated ? "on" : "off" ) );
 }
 	
 void Client::setCurrentRenderFrame( uint64_t frameNum )
 {
 	MessageHandler::setCurrentRenderFrame( frameNum );
+	mLastFrameReceived = frameNum;
+	Trace::setFrame( frameNum );
+	mPresentationTime = 0;
+	mFrameArena.reset();
 	// mLastFrameConfirmed has to reset when the current render frame is set to keep them in line.
 	mLastFrameConfirmed = mCurrentRenderFrame - 1;
 }
@@ -358,14 +1222,260 @@ void Client::setCurrentRenderFrame( uint64_t frameNum )
 void Client::receivedResetCommand()
 {
 	CI_LOG_V("Received Reset command, Current Frame number: " << mCurrentRenderFrame );
+	// Frames count from 1 again.
+	mLastFrameReceived = 0;
+	// The server forgets the replicated state when it resets.
+	mState.clear();
+	mPendingStateDelta.clear();
+	// The server drops partially sent bulk messages when it resets.
+	mBulkIncoming.clear();
+	mStreamIncoming.clear();
+	// The app rebuilds its state from scratch, and hashes it again as it does.
+	mStateHasher.clear();
+	mInterpolation.reset( mState );
 	if( mResetCallback )
 		mResetCallback();
 }
 	
-void Client::receivedStringMessage( const std::string &dataMessage, const uint32_t fromClientId )
+void Client::receivedPresentationTime( uint64_t serverTime )
+{
+	mPresentationTime = serverTime;
+}
+	
+void Client::receivedFrameRate( float fps )
 {
-	if( mDataMessageCallback )
-		mDataMessageCallback( dataMessage, fromClientId );
+	mTargetFrameRate = fps;
+}
+	
+void Client::receivedLinesAcknowledged( uint64_t lines )
+{
+	if( mHandshakePending )
+		return;
+	std::lock_guard<std::mutex> lock( mOutboxMutex );
+	while( ! mOutbox.empty() && mOutbox.front().mFirstLine + mOutbox.front().mLineCount <= lines ) {
+		mOutbox.pop_front();
+	}
+}
+	
+void Client::requestTrace()
+{
+	if( ! mTraceNegotiated ) {
+		CI_LOG_W( "The server doesn't collect traces, or tracing was off when connecting" );
+		return;
+	}
+	auto msg = Protocol::traceRequest();
+	write( msg );
+}
+	
+void Client::receivedTraceRequest()
+{
+	static const size_t kEventsPerLine = 512;
+	auto events = Trace::collect();
+	bool synchronized = mClockSync.isSynchronized();
+	std::string line;
+	for( size_t i = 0; i < events.size() || i == 0; i += kEventsPerLine ) {
+		line.clear();
+		for( size_t j = i; j < std::min( i + kEventsPerLine, events.size() ); ++j ) {
+			const Trace::Event &event = events[j];
+			uint64_t begin = synchronized ? mClockSync.toServer( event.mBegin ) : event.mBegin;
+			if( j != i )
+				line += ';';
+			line += event.mIsInstant ? "i," : "X,";
+			line += std::to_string( event.mThread ) + ',' + std::to_string( begin ) + ',' + std::to_string( event.mDuration ) + ',' +
+					std::to_string( event.mFrame ) + ',' + event.mName;
+		}
+		auto msg = Protocol::traceEvents( mClientID, i + kEventsPerLine < events.size(), synchronized, line );
+		write( msg );
+	}
+	CI_LOG_I( "Sent " << events.size() << " trace events" );
+}
+	
+void Client::receivedClockSample( uint64_t sentTime, uint64_t serverTime )
+{
+	if( mClockArrivals.empty() ) {
+		CI_LOG_W( "Clock sample without an arrival time" );
+		return;
+	}
+	uint64_t received = mClockArrivals.front();
+	mClockArrivals.pop_front();
+	mClockSync.addSample( sentTime, serverTime, received );
+}
+	
+void Client::sendClockPing()
+{
+	// A burst fills the estimate's window quickly, after that a ping now and then follows the drift.
+	static const size_t kBurstSamples = 8;
+	static const uint64_t kBurstInterval = 100000, kInterval = 2000000;
+	uint64_t now = ClockSync::now();
+	if( ! mClockNegotiated || ! mTcpSession || now < mNextClockPing )
+		return;
+	
+	// Pings aren't kept for resending, a late answer would only make a bad sample. The server doesn't count them.
+	auto msg = Protocol::clockSync( now );
+	if( mIsConnected )
+		mTcpSession->write( TcpSession::stringToBuffer( msg ) );
+	mNextClockPing = now + ( mClockSync.getSampleCount() < kBurstSamples ? kBurstInterval : kInterval );
+}
+	
+std::chrono::steady_clock::time_point Client::getPresentationTime() const
+{
+	if( ! hasPresentationTime() )
+		return std::chrono::steady_clock::now();
+	return std::chrono::steady_clock::time_point( std::chrono::microseconds( mClockSync.toLocal( mPresentationTime ) ) );
+}
+	
+void Client::waitForPresentationTime() const
+{
+	if( ! hasPresentationTime() )
+		return;
+	// A wrong estimate shouldn't stall the app.
+	auto latest = std::chrono::steady_clock::now() + std::chrono::seconds( 1 );
+	std::this_thread::sleep_until( std::min( getPresentationTime(), latest ) );
+}
+	
+void Client::receivedStateDelta( const std::string &delta )
+{
+	// Several frames may be parsed in one update, their deltas are applied in order.
+	if( ! mPendingStateDelta.empty() )
+		mPendingStateDelta += ';';
+	mPendingStateDelta += delta;
+}
+	
+void Client::sendStateDelta()
+{
+	if( ! mState.isDirty() || ! mTcpSession )
+		return;
+	
+	if( ! mStateNegotiated ) {
+		CI_LOG_W( "The server doesn't replicate state, dropping changes." );
+		mState.takeDelta();
+		return;
+	}
+	auto msg = Protocol::stateDelta( mState.takeDelta() );
+	write( msg );
+}
+	
+void Client::receivedDataMessage( boost::string_ref dataMessage, const uint32_t fromClientId )
+{
+	if( Protocol::isCompressedMessage( dataMessage ) ) {
+		if( ! Protocol::decompressMessage( dataMessage, mDecompressScratch, mDecompressedMessage ) ) {
+			CI_LOG_E( "Couldn't decompress data message from " << fromClientId );
+			return;
+		}
+		dataMessage = mDecompressedMessage;
+	}
+	
+	if( Protocol::isChannelMessage( dataMessage ) ) {
+		receivedChannelMessage( dataMessage, fromClientId );
+		return;
+	}
+	mFrameArena.push( fromClientId, dataMessage );
+}
+	
+void Client::dispatchFrameMessages()
+{
+	if( mFrameArena.empty() )
+		return;
+	
+	const MessageRecord *records = mFrameArena.data();
+	if( mDataMessageBatchCallback )
+		mDataMessageBatchCallback( records, mFrameArena.size() );
+	if( mDataMessageCallback ) {
+		for( size_t i = 0; i < mFrameArena.size(); ++i ) {
+			// Reusing one string keeps the capacity from frame to frame.
+			mDispatchMessage.assign( records[i].mPayload.data(), records[i].mPayload.size() );
+			mDataMessageCallback( mDispatchMessage, records[i].mFromClientId );
+		}
+	}
+}
+	
+void Client::receivedBulkMessage( uint32_t msgId, uint32_t fromClientId )
+{
+	auto key = std::make_pair( fromClientId, msgId );
+	auto stream = mStreamIncoming.find( key );
+	if( stream != mStreamIncoming.end() ) {
+		auto buffer = std::move( stream->second.mBuffer );
+		bool failed = stream->second.mFailed;
+		mStreamIncoming.erase( stream );
+		if( failed ) {
+			CI_LOG_E( "Dropped stream " << msgId << " from " << fromClientId << ", it couldn't be reassembled" );
+			return;
+		}
+		if( mStreamMessageCallback )
+			mStreamMessageCallback( buffer, fromClientId );
+		return;
+	}
+	
+	auto found = mBulkIncoming.find( key );
+	if( found == mBulkIncoming.end() ) {
+		CI_LOG_E( "Missing bulk message " << msgId << " from " << fromClientId );
+		return;
+	}
+	auto payload = std::move( found->second.mPayload );
+	bool failed = found->second.mFailed;
+	mBulkIncoming.erase( found );
+	if( failed ) {
+		CI_LOG_E( "Dropped bulk message " << msgId << " from " << fromClientId << ", it couldn't be reassembled" );
+		return;
+	}
+	receivedDataMessage( payload, fromClientId );
+}
+	
+void Client::receivedStreamChunk( uint32_t fromClientId, uint32_t streamId, size_t offset, size_t total,
+								  const char *encoded, size_t encodedSize )
+{
+	// mMessageMutex is held by onBulkRead.
+	auto & incoming = mStreamIncoming[std::make_pair( fromClientId, streamId )];
+	if( offset == 0 ) {
+		incoming.mBuffer = mStreamAllocator ? mStreamAllocator( fromClientId, streamId, total ) : ci::Buffer::create( total );
+		incoming.mReceived = 0;
+		incoming.mReported = 0;
+		incoming.mTotal = total;
+		incoming.mFailed = false;
+	}
+	if( incoming.mFailed )
+		return;
+	if( ! incoming.mBuffer || incoming.mBuffer->getSize() < total || offset != incoming.mReceived ||
+	    offset + base64DecodedSize( encoded, encodedSize ) > total ) {
+		CI_LOG_E( "Can't place chunk at " << offset << " of stream " << streamId << " from " << fromClientId );
+		// The frame that references the stream goes through without it, instead of waiting for good.
+		incoming.mFailed = true;
+		incoming.mBuffer.reset();
+		return;
+	}
+	// Decoded straight into its place in the preallocated buffer.
+	auto dst = static_cast<uint8_t *>( incoming.mBuffer->getData() ) + offset;
+	size_t decoded = base64Decode( encoded, encodedSize, dst );
+	if( decoded == 0 && encodedSize > 0 ) {
+		CI_LOG_E( "Can't decode chunk at " << offset << " of stream " << streamId << " from " << fromClientId );
+		incoming.mFailed = true;
+		incoming.mBuffer.reset();
+		return;
+	}
+	incoming.mReceived += decoded;
+}
+	
+void Client::receivedDataChunk( uint32_t fromClientId, uint32_t msgId, size_t offset, size_t total,
+							    const char *chunk, size_t chunkSize )
+{
+	// mMessageMutex is held by onBulkRead.
+	auto & incoming = mBulkIncoming[std::make_pair( fromClientId, msgId )];
+	if( offset == 0 ) {
+		incoming.mPayload.clear();
+		incoming.mPayload.reserve( total );
+		incoming.mTotal = total;
+		incoming.mFailed = false;
+	}
+	if( incoming.mFailed )
+		return;
+	if( offset != incoming.mPayload.size() || offset + chunkSize > incoming.mTotal ) {
+		CI_LOG_E( "Out of order chunk for bulk message " << msgId << " from " << fromClientId );
+		// The frame that references the message goes through without it, instead of waiting for good.
+		incoming.mFailed = true;
+		incoming.mPayload.clear();
+		return;
+	}
+	incoming.mPayload.append( chunk, chunkSize );
 }
 	
 
@@ -0,0 +1,477 @@
+//
+//  IoUringTransport.cpp
+//  Cinder-MPE
+//
+
+#include "IoUringTransport.h"
+
+#if defined( __linux__ ) && defined( MPE_HAS_IO_URING )
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace mpe {
+
+namespace {
+
+const unsigned	kQueueDepth = 1024;
+const unsigned	kReceiveBufferCount = 512;
+const size_t	kReceiveBufferSize = 16384;
+const size_t	kSendBufferSize = 65536;		// per connection
+const uint16_t	kBufferGroup = 0;
+
+inline unsigned loadAcquire( const unsigned *p )
+{
+	return reinterpret_cast<const std::atomic<unsigned>*>( p )->load( std::memory_order_acquire );
+}
+inline void storeRelease( unsigned *p, unsigned value )
+{
+	reinterpret_cast<std::atomic<unsigned>*>( p )->store( value, std::memory_order_release );
+}
+
+void* mapRing( int fd, size_t size, off_t offset )
+{
+	void *ptr = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset );
+	return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+}
+
+IoUringTransport::IoUringTransport( size_t maxConnections )
+: mMaxConnections( maxConnections )
+{
+}
+
+IoUringTransport::~IoUringTransport()
+{
+	stop();
+}
+
+uint64_t IoUringTransport::userData( Operation op, uint32_t slot, uint32_t generation )
+{
+	return ( uint64_t( op ) << 56 ) | ( uint64_t( slot & 0xFFFFFF ) << 32 ) | generation;
+}
+
+int IoUringTransport::enter( unsigned toSubmit, unsigned minComplete, unsigned flags )
+{
+	++mSyscallCount;
+	int result;
+	do {
+		result = static_cast<int>( syscall( __NR_io_uring_enter, mRingFd, toSubmit, minComplete, flags, nullptr, 0 ) );
+	} while( result < 0 && errno == EINTR );
+	return result;
+}
+
+bool IoUringTransport::start( uint16_t port )
+{
+	io_uring_params params;
+	memset( &params, 0, sizeof( params ) );
+	// Multishot receives complete often, the completion queue is made deeper than the submission queue.
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = kQueueDepth * 4;
+	mRingFd = static_cast<int>( syscall( __NR_io_uring_setup, kQueueDepth, &params ) );
+	if( mRingFd < 0 )
+		return false;
+	if( ! supportsOperations() ) {
+		stop();
+		return false;
+	}
+
+	mSqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
+	if( params.features & IORING_FEAT_SINGLE_MMAP )
+		mSqRingSize = mCqRingSize = std::max( mSqRingSize, mCqRingSize );
+	mSqRing = mapRing( mRingFd, mSqRingSize, IORING_OFF_SQ_RING );
+	mCqRing = ( params.features & IORING_FEAT_SINGLE_MMAP ) ? mSqRing : mapRing( mRingFd, mCqRingSize, IORING_OFF_CQ_RING );
+	mSqesSize = params.sq_entries * sizeof( io_uring_sqe );
+	mSqes = static_cast<io_uring_sqe*>( mapRing( mRingFd, mSqesSize, IORING_OFF_SQES ) );
+	if( ! mSqRing || ! mCqRing || ! mSqes ) {
+		stop();
+		return false;
+	}
+	char *sq = static_cast<char*>( mSqRing );
+	mSqHead = reinterpret_cast<unsigned*>( sq + params.sq_off.head );
+	mSqTail = reinterpret_cast<unsigned*>( sq + params.sq_off.tail );
+	mSqArray = reinterpret_cast<unsigned*>( sq + params.sq_off.array );
+	mSqMask = *reinterpret_cast<unsigned*>( sq + params.sq_off.ring_mask );
+	mSqEntries = params.sq_entries;
+	mSqLocalTail = *mSqTail;
+	char *cq = static_cast<char*>( mCqRing );
+	mCqHead = reinterpret_cast<unsigned*>( cq + params.cq_off.head );
+	mCqTail = reinterpret_cast<unsigned*>( cq + params.cq_off.tail );
+	mCqes = reinterpret_cast<io_uring_cqe*>( cq + params.cq_off.cqes );
+	mCqMask = *reinterpret_cast<unsigned*>( cq + params.cq_off.ring_mask );
+
+	// The receive buffers are provided with an operation rather than a registered buffer ring,
+	// which some kernels accept but never pick from.
+	mReceiveBuffers = static_cast<char*>( mmap( nullptr, kReceiveBufferCount * kReceiveBufferSize, PROT_READ | PROT_WRITE,
+												MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) );
+	if( mReceiveBuffers == MAP_FAILED ) {
+		mReceiveBuffers = nullptr;
+		stop();
+		return false;
+	}
+	mReturnedBuffers.clear();
+	provideBuffers( 0, kReceiveBufferCount );
+
+	// Send buffers are registered once, so the kernel doesn't map the pages of every send.
+	mSendBuffers = static_cast<char*>( mmap( nullptr, mMaxConnections * kSendBufferSize, PROT_READ | PROT_WRITE,
+											 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) );
+	if( mSendBuffers == MAP_FAILED ) {
+		mSendBuffers = nullptr;
+		stop();
+		return false;
+	}
+	iovec sendBuffers = { mSendBuffers, mMaxConnections * kSendBufferSize };
+	++mSyscallCount;
+	if( syscall( __NR_io_uring_register, mRingFd, IORING_REGISTER_BUFFERS, &sendBuffers, 1 ) < 0 ) {
+		stop();
+		return false;
+	}
+
+	mListenFd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	int yes = 1;
+	setsockopt( mListenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( yes ) );
+	sockaddr_in address;
+	memset( &address, 0, sizeof( address ) );
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl( INADDR_ANY );
+	address.sin_port = htons( port );
+	if( mListenFd < 0 || bind( mListenFd, reinterpret_cast<sockaddr*>( &address ), sizeof( address ) ) < 0 ||
+	    listen( mListenFd, SOMAXCONN ) < 0 ) {
+		stop();
+		return false;
+	}
+
+	mConnections.assign( mMaxConnections, Connection() );
+	armAccept();
+	if( ! supportsMultishot() ) {
+		stop();
+		return false;
+	}
+	return true;
+}
+
+bool IoUringTransport::supportsOperations()
+{
+	const uint8_t operations[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_WRITE_FIXED, IORING_OP_PROVIDE_BUFFERS };
+	std::vector<char> storage( sizeof( io_uring_probe ) + 256 * sizeof( io_uring_probe_op ), 0 );
+	io_uring_probe *probe = reinterpret_cast<io_uring_probe*>( storage.data() );
+	++mSyscallCount;
+	if( syscall( __NR_io_uring_register, mRingFd, IORING_REGISTER_PROBE, probe, 256 ) < 0 )
+		return false;
+	for( uint8_t op : operations ) {
+		if( op > probe->last_op || ! ( probe->ops[op].flags & IO_URING_OP_SUPPORTED ) )
+			return false;
+	}
+	return true;
+}
+
+bool IoUringTransport::supportsMultishot()
+{
+	// Kernels before 5.19 don't know multishot accept, and before 6.0 multishot receive, but they
+	// have both operations. They refuse the flags while preparing the request, which completes
+	// with -EINVAL during the submit. A receive is armed on a socket pair to find out, and the
+	// pair is shut down right after, so it completes and is dropped by poll().
+	int pair[2];
+	if( socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair ) < 0 )
+		return false;
+	io_uring_sqe *sqe = nextSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = pair[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = kBufferGroup;
+	sqe->user_data = userData( PROBE, 0, 0 );
+	submit();
+	shutdown( pair[1], SHUT_RDWR );
+	::close( pair[0] );
+	::close( pair[1] );
+
+	bool supported = true;
+	for( unsigned head = *mCqHead; head != loadAcquire( mCqTail ); ++head ) {
+		const io_uring_cqe &cqe = mCqes[head & mCqMask];
+		Operation op = static_cast<Operation>( cqe.user_data >> 56 );
+		if( ( op == ACCEPT || op == PROBE ) && cqe.res == -EINVAL )
+			supported = false;
+	}
+	return supported;
+}
+
+void IoUringTransport::stop()
+{
+	for( uint32_t slot = 0; slot < mConnections.size(); ++slot ) {
+		if( mConnections[slot].mFd >= 0 )
+			::close( mConnections[slot].mFd );
+	}
+	mConnections.clear();
+	mStarved.clear();
+	// The armed accept holds the listening socket until the kernel is done tearing the ring down,
+	// which it finishes later. Cancelling it first frees the port by the time stop() returns.
+	if( mListenFd >= 0 ) {
+		io_uring_sqe *sqe = nextSqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = userData( ACCEPT, 0, 0 );
+		sqe->user_data = userData( CANCEL, 0, 0 );
+		flushQueue( true );
+	}
+	if( mListenFd >= 0 )
+		::close( mListenFd );
+	mListenFd = -1;
+	// Closing the ring cancels whatever is still armed.
+	if( mRingFd >= 0 )
+		::close( mRingFd );
+	mRingFd = -1;
+	if( mSqes )
+		munmap( mSqes, mSqesSize );
+	if( mCqRing && mCqRing != mSqRing )
+		munmap( mCqRing, mCqRingSize );
+	if( mSqRing )
+		munmap( mSqRing, mSqRingSize );
+	mSqes = nullptr;
+	mSqRing = mCqRing = nullptr;
+	if( mReceiveBuffers )
+		munmap( mReceiveBuffers, kReceiveBufferCount * kReceiveBufferSize );
+	if( mSendBuffers )
+		munmap( mSendBuffers, mMaxConnections * kSendBufferSize );
+	mReceiveBuffers = mSendBuffers = nullptr;
+}
+
+io_uring_sqe* IoUringTransport::nextSqe()
+{
+	// A full queue is submitted early, that's the only time a frame takes more than one syscall.
+	if( mSqLocalTail - loadAcquire( mSqHead ) >= mSqEntries )
+		flushQueue( false );
+	unsigned index = mSqLocalTail & mSqMask;
+	io_uring_sqe *sqe = &mSqes[index];
+	memset( sqe, 0, sizeof( *sqe ) );
+	mSqArray[index] = index;
+	++mSqLocalTail;
+	++mToSubmit;
+	return sqe;
+}
+
+void IoUringTransport::armAccept()
+{
+	io_uring_sqe *sqe = nextSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = mListenFd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = userData( ACCEPT, 0, 0 );
+}
+
+void IoUringTransport::armReceive( uint32_t slot )
+{
+	io_uring_sqe *sqe = nextSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = mConnections[slot].mFd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = kBufferGroup;
+	sqe->user_data = userData( RECEIVE, slot, mConnections[slot].mGeneration );
+}
+
+void IoUringTransport::sendNext( uint32_t slot )
+{
+	Connection &connection = mConnections[slot];
+	if( connection.mInFlight > 0 || connection.mOutgoing.empty() || connection.mFd < 0 )
+		return;
+	char *buffer = mSendBuffers + slot * kSendBufferSize;
+	connection.mInFlight = std::min( connection.mOutgoing.size(), kSendBufferSize );
+	memcpy( buffer, connection.mOutgoing.data(), connection.mInFlight );
+
+	io_uring_sqe *sqe = nextSqe();
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = connection.mFd;
+	sqe->addr = reinterpret_cast<uint64_t>( buffer );
+	sqe->len = static_cast<uint32_t>( connection.mInFlight );
+	sqe->buf_index = 0;
+	sqe->user_data = userData( SEND, slot, connection.mGeneration );
+}
+
+void IoUringTransport::provideBuffers( uint16_t first, uint16_t count )
+{
+	io_uring_sqe *sqe = nextSqe();
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = reinterpret_cast<uint64_t>( mReceiveBuffers + size_t( first ) * kReceiveBufferSize );
+	sqe->len = kReceiveBufferSize;
+	sqe->off = first;
+	sqe->buf_group = kBufferGroup;
+	sqe->user_data = userData( PROVIDE, 0, 0 );
+}
+
+void IoUringTransport::recycleBuffer( uint16_t bufferId )
+{
+	mReturnedBuffers.push_back( bufferId );
+}
+
+void IoUringTransport::send( uint32_t connection, const std::string &data )
+{
+	if( connection >= mConnections.size() || mConnections[connection].mFd < 0 )
+		return;
+	mConnections[connection].mOutgoing += data;
+	sendNext( connection );
+}
+
+void IoUringTransport::submit( bool wait )
+{
+	if( mRingFd < 0 )
+		return;
+	// Buffers that were read go back in runs of consecutive ids, usually a few operations for all of them.
+	if( ! mReturnedBuffers.empty() ) {
+		std::sort( mReturnedBuffers.begin(), mReturnedBuffers.end() );
+		size_t first = 0;
+		for( size_t i = 1; i <= mReturnedBuffers.size(); ++i ) {
+			if( i == mReturnedBuffers.size() || mReturnedBuffers[i] != mReturnedBuffers[i - 1] + 1 ) {
+				provideBuffers( mReturnedBuffers[first], static_cast<uint16_t>( i - first ) );
+				first = i;
+			}
+		}
+		mReturnedBuffers.clear();
+	}
+	for( uint32_t slot : mStarved ) {
+		if( mConnections[slot].mFd >= 0 )
+			armReceive( slot );
+	}
+	mStarved.clear();
+	if( mToSubmit > 0 || wait )
+		flushQueue( wait );
+}
+
+void IoUringTransport::flushQueue( bool wait )
+{
+	storeRelease( mSqTail, mSqLocalTail );
+	unsigned toSubmit = mToSubmit;
+	mToSubmit = 0;
+	enter( toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0 );
+}
+
+size_t IoUringTransport::poll()
+{
+	size_t count = 0;
+	unsigned head = *mCqHead;
+	while( head != loadAcquire( mCqTail ) ) {
+		io_uring_cqe cqe = mCqes[head & mCqMask];
+		++head;
+		// The slot is released right away so handlers can queue more.
+		storeRelease( mCqHead, head );
+		++count;
+
+		Operation op = static_cast<Operation>( cqe.user_data >> 56 );
+		uint32_t slot = static_cast<uint32_t>( ( cqe.user_data >> 32 ) & 0xFFFFFF );
+		uint32_t generation = static_cast<uint32_t>( cqe.user_data );
+		bool armed = ( cqe.flags & IORING_CQE_F_MORE ) != 0;
+
+		if( op == PROVIDE || op == PROBE || op == CANCEL )
+			continue;
+		if( op == ACCEPT ) {
+			if( cqe.res >= 0 ) {
+				// A slot that closed with a send in flight waits for it, the kernel still reads its send buffer.
+				uint32_t free = 0;
+				while( free < mConnections.size() && ( mConnections[free].mFd >= 0 || mConnections[free].mInFlight > 0 ) )
+					++free;
+				if( free == mConnections.size() ) {
+					::close( cqe.res );
+				}
+				else {
+					Connection &connection = mConnections[free];
+					connection.mFd = cqe.res;
+					connection.mOutgoing.clear();
+					connection.mInFlight = 0;
+					connection.mClosing = false;
+					armReceive( free );
+					if( mAcceptHandler )
+						mAcceptHandler( free );
+				}
+			}
+			// -EINVAL would fail again on every poll, supportsMultishot() rules out the kernels that return it.
+			if( ! armed && mListenFd >= 0 && cqe.res != -EINVAL )
+				armAccept();
+			continue;
+		}
+
+		// Completions of a connection that closed since are dropped, their buffers still go back.
+		bool current = slot < mConnections.size() && mConnections[slot].mGeneration == generation && mConnections[slot].mFd >= 0;
+		if( op == RECEIVE ) {
+			if( cqe.res > 0 && ( cqe.flags & IORING_CQE_F_BUFFER ) ) {
+				uint16_t bufferId = static_cast<uint16_t>( cqe.flags >> IORING_CQE_BUFFER_SHIFT );
+				if( current && mReadHandler )
+					mReadHandler( slot, mReceiveBuffers + size_t( bufferId ) * kReceiveBufferSize, cqe.res );
+				recycleBuffer( bufferId );
+			}
+			else if( cqe.flags & IORING_CQE_F_BUFFER ) {
+				recycleBuffer( static_cast<uint16_t>( cqe.flags >> IORING_CQE_BUFFER_SHIFT ) );
+			}
+			if( ! current )
+				continue;
+			if( cqe.res == 0 || ( cqe.res < 0 && cqe.res != -ENOBUFS ) )
+				closeSlot( slot );
+			else if( cqe.res == -ENOBUFS )
+				// Armed again once the buffers read meanwhile went back with the next submit().
+				mStarved.push_back( slot );
+			else if( ! armed )
+				armReceive( slot );
+		}
+		else if( op == SEND ) {
+			if( ! current ) {
+				// The slot closed meanwhile and wasn't reused, its send buffer is free now.
+				if( slot < mConnections.size() )
+					mConnections[slot].mInFlight = 0;
+				continue;
+			}
+			Connection &connection = mConnections[slot];
+			connection.mInFlight = 0;
+			if( cqe.res < 0 ) {
+				closeSlot( slot );
+				continue;
+			}
+			connection.mOutgoing.erase( 0, cqe.res );
+			if( connection.mClosing && connection.mOutgoing.empty() )
+				closeSlot( slot );
+			else
+				sendNext( slot );
+		}
+	}
+	return count;
+}
+
+void IoUringTransport::close( uint32_t connection )
+{
+	if( connection >= mConnections.size() || mConnections[connection].mFd < 0 )
+		return;
+	// What was sent before closing still goes out.
+	if( mConnections[connection].mOutgoing.empty() )
+		closeSlot( connection );
+	else
+		mConnections[connection].mClosing = true;
+}
+
+void IoUringTransport::closeSlot( uint32_t slot )
+{
+	Connection &connection = mConnections[slot];
+	// The armed receive holds the socket open past close(), shutting it down sends the FIN and ends the receive.
+	shutdown( connection.mFd, SHUT_RDWR );
+	::close( connection.mFd );
+	connection.mFd = -1;
+	connection.mOutgoing.clear();
+	connection.mClosing = false;
+	++connection.mGeneration;
+	mStarved.erase( std::remove( mStarved.begin(), mStarved.end(), slot ), mStarved.end() );
+	if( mCloseHandler )
+		mCloseHandler( slot );
+}
+
+}
+
+#endif
@@ -17,8 +17,28 @@ const std::string Protocol::NEXT_FRAME = "G";
 const std::string Protocol::CONNECT_ASYNCHRONOUS = "A";
 const std::string Protocol::RESET_ALL = "R";
 const std::string Protocol::TOGGLE_PAUSE = "P";
+const std::string Protocol::BULK_LANE_CONNECT = "B";
+const std::string Protocol::DATA_CHUNK = "C";
+const std::string Protocol::DATA_STREAM = "M";
+const std::string Protocol::HANDSHAKE = "H";
+const std::string Protocol::STATE_DELTA = "K";
+const std::string Protocol::COALESCED_MESSAGE = "L";
+const std::string Protocol::REGION_MESSAGE = "W";
+const std::string Protocol::SUBSCRIBE = "U";
+const std::string Protocol::UNSUBSCRIBE = "X";
+const std::string Protocol::PUBLISH = "O";
+const std::string Protocol::CLOCK_SYNC = "Y";
+const std::string Protocol::TRACE = "E";
 	
 const std::string Protocol::kMessageTerminus = "\n";
 const std::string Protocol::kDataMessageDelimiter = "|";
+const std::string Protocol::kBulkReferenceDelimiter = "#";
+const std::string Protocol::kCompressedMessagePrefix = "\x1d";
+const std::string Protocol::kCodecLz4 = "lz4";
+const std::string Protocol::kStateDeltaPrefix = "$";
+const std::string Protocol::kChannelMessagePrefix = "\x1e";
+const std::string Protocol::kPresentationTimeDelimiter = "@";
+const std::string Protocol::kFrameRateDelimiter = "/";
+const std::string Protocol::kReceivedDelimiter = "~";
 
 }
@@ -9,31 +9,16 @@
 #include "Server.h"
 #include "Protocol.h"
 
+#include "cinder/Json.h"
+
 namespace mpe {
 
 Server::ClientConnection::ClientConnection( const TcpSessionRef &session, const ServerRef &parent )
-: mSession( session ), mParent( parent ), mId( 0 ), mIsAsync( false ), mMessageMutex( new std::mutex() )
+: mSession( session ), mParent( parent ), mId( 0 ), mConnection( 0 ), mIsAsync( false ), mIsConnected( true ), mMessageMutex( new std::mutex() )
 {
 	mSession->connectReadEventHandler( [&]( const ci::BufferRef &buffer ) {
 		auto msgs = ci::split( TcpSession::bufferToString( buffer ), Protocol::messageDelimiter() );
-		
-		auto msg = ci::split( msgs[0], Protocol::dataMessageDelimiter() );
-		
-		if( msg[0] == Protocol::CONNECT_ASYNCHRONOUS && msg.size() == 4 ) {
-			mIsAsync = true;
-			mId = atoi( msg[1].c_str() );
-			mName = msg[2];
-			mShouldReceiveData = (msg[3] == "true");
-		}
-		else if( msg[0] == Protocol::CONNECT_SYNCHRONOUS && msg.size() == 3 ) {
-			mIsAsync = false;
-			mId = atoi( msg[1].c_str() );
-			mName = msg[2];
-			mShouldReceiveData = true;
-		}
-		else {
-			CI_LOG_E("This message doesn't contain what is needed" << buffer);
-		}
+		readConnect( msgs[0] );
 		// Now that we have our info let's connect the normal onRead callback
 		mSession->connectReadEventHandler( &ClientConnection::onRead, this );
 	});
@@ -44,6 +29,33 @@ Server::ClientConnection::ClientConnection( const TcpSessionRef &session, const
 	mSession->read( Protocol::messageDelimiter() );
 }
 	
+Server::ClientConnection::ClientConnection( uint32_t connection, const ServerRef &parent )
+: mParent( parent ), mId( 0 ), mConnection( connection ), mIsAsync( false ), mShouldReceiveData( false ), mIsConnected( false ),
+	mMessageMutex( new std::mutex() )
+{
+}
+	
+void Server::ClientConnection::readConnect( const std::string &message )
+{
+	auto msg = ci::split( message, Protocol::dataMessageDelimiter() );
+	
+	if( msg[0] == Protocol::CONNECT_ASYNCHRONOUS && msg.size() == 4 ) {
+		mIsAsync = true;
+		mId = atoi( msg[1].c_str() );
+		mName = msg[2];
+		mShouldReceiveData = (msg[3] == "true");
+	}
+	else if( msg[0] == Protocol::CONNECT_SYNCHRONOUS && msg.size() == 3 ) {
+		mIsAsync = false;
+		mId = atoi( msg[1].c_str() );
+		mName = msg[2];
+		mShouldReceiveData = true;
+	}
+	else {
+		CI_LOG_E("This message doesn't contain what is needed" << message);
+	}
+}
+	
 Server::ClientConnection::~ClientConnection()
 {
 	if( mSession )
@@ -57,6 +69,37 @@ void Server::ClientConnection::onRead( const ci::BufferRef &buffer )
 	mMessages.insert( mMessages.end(), msgs.begin(), msgs.end() );
 }
 	
+void Server::ClientConnection::receive( const char *data, size_t size )
+{
+	std::lock_guard<std::mutex> lock( *mMessageMutex );
+	// Reads end anywhere, the rest of a line waits for the next one.
+	mPartial.append( data, size );
+	size_t begin = 0, end;
+	while( ( end = mPartial.find( Protocol::messageDelimiter(), begin ) ) != std::string::npos ) {
+		std::string message = mPartial.substr( begin, end - begin );
+		begin = end + Protocol::messageDelimiter().size();
+		if( ! mIsConnected ) {
+			readConnect( message );
+			mIsConnected = true;
+		}
+		else {
+			mMessages.push_back( std::move( message ) );
+		}
+	}
+	mPartial.erase( 0, begin );
+}
+	
+void Server::ClientConnection::write( std::string &message )
+{
+#if defined( __linux__ ) && defined( MPE_HAS_IO_URING )
+	if( ! mSession ) {
+		mParent->mIoUring->send( mConnection, message );
+		return;
+	}
+#endif
+	mSession->write( TcpSession::stringToBuffer( message ) );
+}
+	
 void Server::ClientConnection::onWrite( size_t bytesTransferred )
 {
 	mSession->read( Protocol::messageDelimiter() );
@@ -73,7 +116,8 @@ void Server::ClientConnection::onError( std::string error, size_t bytesTransferr
 }
 	
 Server::Server( const ci::DataSourceRef &jsonSettingsFile, asio::io_service &service, bool thread )
-: mTcpServer( TcpServer::create( service ) ), mTotalAllowedConnections( 1 ), mPort( 0 ), mFPSUpdate( 60 ), mIsThreaded( thread )
+: mTcpServer( TcpServer::create( service ) ), mTotalAllowedConnections( 256 ), mPort( 0 ), mUseIoUring( false ), mFPSUpdate( 60 ),
+	mIsThreaded( thread )
 {
 	loadSettings( jsonSettingsFile );
 	start();
@@ -81,7 +125,38 @@ Server::Server( const ci::DataSourceRef &jsonSettingsFile, asio::io_service &ser
 	
 ServerRef Server::create( const ci::DataSourceRef &jsonSettingsFile, asio::io_service &service, bool thread )
 {
-	return ServerRef();  //new Server( jsonSettingsFile, service, thread ) );
+	return ServerRef( new Server( jsonSettingsFile, service, thread ) );
+}
+	
+void Server::loadSettings( const ci::DataSourceRef &jsonSettingsFile )
+{
+	ci::JsonTree settingsDoc = ci::JsonTree( jsonSettingsFile ).getChild( "settings" );
+	
+	try {
+		ci::JsonTree port = settingsDoc.getChild( "port" );
+		mPort = port.getValue<uint16_t>();
+	}
+	catch( ci::JsonTree::ExcChildNotFound e ) {
+		CI_LOG_V( "No port set, start( port ) has to be called" );
+	}
+	
+	try {
+		ci::JsonTree ioBackend = settingsDoc.getChild( "ioBackend" );
+		mUseIoUring = ioBackend.getValue<std::string>() == "io_uring";
+	}
+	catch( ci::JsonTree::ExcChildNotFound e ) {
+		// Not required
+		CI_LOG_V( "No ioBackend set, using asio" );
+	}
+	
+	try {
+		// The io_uring backend registers a send buffer per connection up front.
+		ci::JsonTree maxConnections = settingsDoc.getChild( "maxConnections" );
+		mTotalAllowedConnections = maxConnections.getValue<uint16_t>();
+	}
+	catch( ci::JsonTree::ExcChildNotFound e ) {
+		CI_LOG_V( "No maxConnections set, accepting " << mTotalAllowedConnections );
+	}
 }
 	
 void Server::start( uint16_t port )
@@ -92,6 +167,9 @@ void Server::start( uint16_t port )
 	
 void Server::start()
 {
+	if( mUseIoUring && startIoUring() )
+		return;
+	
 	mTcpServer->connectAcceptEventHandler( &Server::onAccept, this );
 	mTcpServer->connectErrorEventHandler( &Server::onError, this );
 	mTcpServer->connectCancelEventHandler( &Server::onCancel, this );
@@ -99,10 +177,61 @@ void Server::start()
 	mTcpServer->accept( mPort );
 }
 	
+bool Server::startIoUring()
+{
+#if defined( __linux__ ) && defined( MPE_HAS_IO_URING )
+	mIoUring.reset( new IoUringTransport( mTotalAllowedConnections ) );
+	mIoUring->connectAcceptHandler( [this]( uint32_t connection ) {
+		mTcpConnections.emplace_back( new ClientConnection( connection, shared_from_this() ) );
+	});
+	mIoUring->connectReadHandler( [this]( uint32_t connection, const char *data, size_t size ) {
+		for( auto & client : mTcpConnections ) {
+			if( ! client->mSession && client->mConnection == connection ) {
+				client->receive( data, size );
+				break;
+			}
+		}
+	});
+	mIoUring->connectCloseHandler( [this]( uint32_t connection ) {
+		mTcpConnections.erase( std::remove_if( mTcpConnections.begin(), mTcpConnections.end(), [connection]( const ClientConnectionRef &client ) {
+			return ! client->mSession && client->mConnection == connection;
+		}), mTcpConnections.end() );
+	});
+	if( ! mIoUring->start( mPort ) ) {
+		CI_LOG_W( "io_uring isn't available, using asio" );
+		mIoUring.reset();
+		return false;
+	}
+	CI_LOG_I( "Serving with io_uring on " << mPort );
+	return true;
+#else
+	CI_LOG_W( "Built without MPE_HAS_IO_URING, using asio" );
+	return false;
+#endif
+}
+	
+void Server::stop()
+{
+#if defined( __linux__ ) && defined( MPE_HAS_IO_URING )
+	if( mIoUring ) {
+		mIoUring->stop();
+		mIoUring.reset();
+	}
+#endif
+	mTcpServer->cancel();
+	mTcpConnections.clear();
+}
+	
 void Server::update()
 {
 	mFrameIsReady = false;
 	
+#if defined( __linux__ ) && defined( MPE_HAS_IO_URING )
+	// Reads what arrived since the last update, without a syscall.
+	if( mIoUring )
+		mIoUring->poll();
+#endif
+	
 	std::map<uint32_t, std::vector<std::string>> idMessages;
 	
 	for( auto & client : mTcpConnections ) {
@@ -112,6 +241,12 @@ void Server::update()
 		client->mMessages.clear();
 		idMessages.emplace( std::make_pair( client->getId(), messages ) );
 	}
+	
+#if defined( __linux__ ) && defined( MPE_HAS_IO_URING )
+	// Everything written for this frame goes to the kernel in one syscall.
+	if( mIoUring )
+		mIoUring->submit();
+#endif
 }
 	
 void Server::onAccept( TcpSessionRef session )
@@ -125,6 +260,16 @@ void Server::onAccept( TcpSessionRef session )
 	}
 }
 	
+void Server::onError( std::string error, size_t bytesTransferred )
+{
+	CI_LOG_E( "Server error: " << error );
+}
+	
+void Server::onCancel()
+{
+	CI_LOG_V( "Stopped accepting, " << mTcpConnections.size() << " connections" );
+}
+	
 
 	
 }
\ No newline at end of file
@@ -0,0 +1,168 @@
+//
+//  CullingTest.cpp
+//  Cinder-MPE
+//
+
+/*
+
+ CullingTest:
+ Checks the masks and indices CullBatch returns against a scalar reference, for every
+ kind of input, counts that leave tail blocks of every size, and arrays of structs read
+ with a stride. Built once per kernel: with MPE_NO_SIMD, as is, and with AVX enabled.
+ Coordinates are on a quarter pixel grid so shapes often touch the rect exactly, where
+ a kernel that compares differently would disagree.
+
+ */
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "Culling.hpp"
+
+namespace {
+
+#if defined( MPE_CULLING_AVX )
+const char *kKernel = "AVX";
+#elif defined( MPE_CULLING_SSE )
+const char *kKernel = "SSE";
+#else
+const char *kKernel = "scalar";
+#endif
+
+struct Shapes {
+	std::vector<float>		mX1, mY1, mX2, mY2, mRadius;
+	std::vector<ci::vec2>	mPoints;
+	std::vector<ci::vec3>	mCircles;
+	std::vector<ci::Rectf>	mRects;
+};
+
+Shapes makeShapes( size_t count, std::mt19937 &rand )
+{
+	auto coordinate = [&rand]( int range ) { return static_cast<float>( static_cast<int>( rand() % ( range * 4 ) ) - range ) * 0.25f; };
+	Shapes shapes;
+	for( size_t i = 0; i < count; ++i ) {
+		float x = coordinate( 300 ), y = coordinate( 300 );
+		float radius = static_cast<float>( rand() % 120 ) * 0.25f;
+		float x2 = x + static_cast<float>( rand() % 200 ) * 0.25f, y2 = y + static_cast<float>( rand() % 200 ) * 0.25f;
+		shapes.mX1.push_back( x );
+		shapes.mY1.push_back( y );
+		shapes.mX2.push_back( x2 );
+		shapes.mY2.push_back( y2 );
+		shapes.mRadius.push_back( radius );
+		shapes.mPoints.push_back( ci::vec2( x, y ) );
+		shapes.mCircles.push_back( ci::vec3( x, y, radius ) );
+		shapes.mRects.push_back( ci::Rectf( x, y, x2, y2 ) );
+	}
+	return shapes;
+}
+
+//! The mask of the scalar kernel: the same float operations one shape at a time.
+std::vector<bool> scalarMask( const float *minXs, const float *minYs, const float *maxXs, const float *maxYs, const float *radii,
+							  size_t count, const ci::Rectf &rect, float margin )
+{
+	float x1 = rect.x1 - margin, y1 = rect.y1 - margin, x2 = rect.x2 + margin, y2 = rect.y2 + margin;
+	std::vector<bool> mask( count );
+	for( size_t i = 0; i < count; ++i ) {
+		float minX = minXs[i], minY = minYs[i], maxX = maxXs[i], maxY = maxYs[i];
+		if( radii ) {
+			minX = minX - radii[i];
+			minY = minY - radii[i];
+			maxX = maxX + radii[i];
+			maxY = maxY + radii[i];
+		}
+		mask[i] = maxX >= x1 && minX <= x2 && maxY >= y1 && minY <= y2;
+	}
+	return mask;
+}
+
+int check( const char *name, const mpe::CullBatch &batch, const std::vector<bool> &expected, const ci::Rectf &rect, float margin )
+{
+	size_t count = expected.size();
+	size_t expectedCount = 0;
+	for( bool touches : expected )
+		expectedCount += touches ? 1 : 0;
+
+	// One more word than needed, to see that nothing is written past the mask.
+	std::vector<uint64_t> mask( ( count + 63 ) / 64 + 1, ~0ULL );
+	size_t maskCount = batch.cull( rect, mask.data(), margin );
+	std::vector<uint32_t> indices( count + 1, 0xFFFFFFFF );
+	size_t indexCount = batch.cull( rect, indices.data(), margin );
+
+	int failures = 0;
+	size_t next = 0;
+	for( size_t i = 0; i < count; ++i ) {
+		bool bit = ( ( mask[i / 64] >> ( i % 64 ) ) & 1 ) != 0;
+		if( bit != expected[i] ) {
+			fprintf( stderr, "%s, %zu shapes: mask bit %zu is %i\n", name, count, i, bit ? 1 : 0 );
+			++failures;
+		}
+		if( expected[i] ) {
+			if( next >= indexCount || indices[next] != i ) {
+				fprintf( stderr, "%s, %zu shapes: index %zu missing\n", name, count, i );
+				++failures;
+			}
+			++next;
+		}
+	}
+	if( count % 64 != 0 && ( mask[count / 64] >> ( count % 64 ) ) != 0 ) {
+		fprintf( stderr, "%s, %zu shapes: bits set past the end\n", name, count );
+		++failures;
+	}
+	if( mask.back() != ~0ULL || indices[count] != 0xFFFFFFFF ) {
+		fprintf( stderr, "%s, %zu shapes: wrote past the output\n", name, count );
+		++failures;
+	}
+	if( maskCount != expectedCount || indexCount != expectedCount ) {
+		fprintf( stderr, "%s, %zu shapes: counted %zu and %zu, not %zu\n", name, count, maskCount, indexCount, expectedCount );
+		++failures;
+	}
+	return failures;
+}
+
+}
+
+int main()
+{
+#if defined( MPE_CULLING_AVX ) && defined( __GNUC__ )
+	if( ! __builtin_cpu_supports( "avx" ) ) {
+		printf( "No AVX on this CPU, skipped\n" );
+		return 77;
+	}
+#endif
+
+	std::mt19937 rand( 35 );
+	const ci::Rectf rects[] = { ci::Rectf( 0, 0, 200, 150 ), ci::Rectf( -50.25f, 10.5f, 10.5f, 80.75f ) };
+	const float margins[] = { 0, 5.25f };
+
+	int failures = 0;
+	size_t cases = 0;
+	std::vector<size_t> counts;
+	// Every tail length after 0 to 3 whole blocks of 8, and a few large batches.
+	for( size_t count = 0; count <= 33; ++count )
+		counts.push_back( count );
+	for( size_t count : { 63, 64, 65, 127, 1000, 1003 } )
+		counts.push_back( count );
+
+	for( size_t count : counts ) {
+		Shapes s = makeShapes( count, rand );
+		for( const auto & rect : rects ) {
+			for( float margin : margins ) {
+				auto points = scalarMask( s.mX1.data(), s.mY1.data(), s.mX1.data(), s.mY1.data(), nullptr, count, rect, margin );
+				auto circles = scalarMask( s.mX1.data(), s.mY1.data(), s.mX1.data(), s.mY1.data(), s.mRadius.data(), count, rect, margin );
+				auto boxes = scalarMask( s.mX1.data(), s.mY1.data(), s.mX2.data(), s.mY2.data(), nullptr, count, rect, margin );
+
+				failures += check( "points", mpe::CullBatch::points( s.mX1.data(), s.mY1.data(), count ), points, rect, margin );
+				failures += check( "vec2 points", mpe::CullBatch::points( s.mPoints.data(), count ), points, rect, margin );
+				failures += check( "circles", mpe::CullBatch::circles( s.mX1.data(), s.mY1.data(), s.mRadius.data(), count ), circles, rect, margin );
+				failures += check( "vec3 circles", mpe::CullBatch::circles( s.mCircles.data(), count ), circles, rect, margin );
+				failures += check( "rects", mpe::CullBatch::rects( s.mX1.data(), s.mY1.data(), s.mX2.data(), s.mY2.data(), count ), boxes, rect, margin );
+				failures += check( "Rectf rects", mpe::CullBatch::rects( s.mRects.data(), count ), boxes, rect, margin );
+				cases += 6;
+			}
+		}
+	}
+
+	printf( "%s kernel: %zu cases, %d failures\n", kKernel, cases, failures );
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,204 @@
+//
+//  IoUringTest.cpp
+//  Cinder-MPE
+//
+
+/*
+
+ IoUringTest:
+ Serves 20 loopback clients with IoUringTransport for 100 frames, the way the Server does:
+ a frame is released once every client sent a line for the one before, and its sends are
+ submitted together. Checks that every line arrives, that every client gets every frame
+ and that the syscalls grow with the frames, not with the clients. Then closes a connection
+ from the server right after sending to it, which has to reach the client as the line followed
+ by the end of the stream. Exits with 77 when the kernel doesn't have what the transport needs,
+ where the Server would use asio.
+
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "IoUringTransport.h"
+
+namespace {
+
+const uint16_t	kPort = 19046;
+const int		kClients = 20;
+const int		kFrames = 100;
+
+//! Connects every client, sends a line per frame and reads the frames back. Returns the clients that got all of them.
+int runClients( size_t frameSize )
+{
+	std::vector<int> fds;
+	for( int i = 0; i < kClients; ++i ) {
+		int fd = socket( AF_INET, SOCK_STREAM, 0 );
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons( kPort );
+		address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+		if( connect( fd, reinterpret_cast<sockaddr*>( &address ), sizeof( address ) ) < 0 ) {
+			close( fd );
+			continue;
+		}
+		fds.push_back( fd );
+	}
+	// Every line is written up front, the server releases the frames as it reads them.
+	for( int frame = 0; frame < kFrames; ++frame ) {
+		for( size_t i = 0; i < fds.size(); ++i ) {
+			std::string line = "D|" + std::to_string( i ) + "|" + std::to_string( frame ) + "\n";
+			if( write( fds[i], line.data(), line.size() ) != static_cast<ssize_t>( line.size() ) )
+				fprintf( stderr, "Client %zu couldn't send frame %i\n", i, frame );
+		}
+	}
+	int complete = 0;
+	for( int fd : fds ) {
+		size_t received = 0;
+		char buffer[65536];
+		while( received < kFrames * frameSize ) {
+			ssize_t size = read( fd, buffer, sizeof( buffer ) );
+			if( size <= 0 )
+				break;
+			received += size;
+		}
+		complete += received == kFrames * frameSize ? 1 : 0;
+	}
+	for( int fd : fds )
+		close( fd );
+	return complete;
+}
+
+//! Connects a client and reads until the server closes the connection. Returns false if it didn't within 5 seconds.
+bool readUntilClosed( std::string &received )
+{
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons( kPort );
+	address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	if( connect( fd, reinterpret_cast<sockaddr*>( &address ), sizeof( address ) ) < 0 ) {
+		close( fd );
+		return false;
+	}
+	timeval timeout = { 5, 0 };
+	setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+	char buffer[4096];
+	ssize_t size;
+	while( ( size = read( fd, buffer, sizeof( buffer ) ) ) > 0 )
+		received.append( buffer, size );
+	close( fd );
+	return size == 0;
+}
+
+}
+
+int main()
+{
+	mpe::IoUringTransport transport( 64 );
+	if( ! transport.start( kPort ) ) {
+		printf( "io_uring or one of its features isn't available, skipped\n" );
+		return 77;
+	}
+
+	std::map<uint32_t, std::string> received;
+	int accepted = 0, closed = 0;
+	uint32_t lastAccepted = 0;
+	transport.connectAcceptHandler( [&]( uint32_t connection ) { ++accepted; lastAccepted = connection; } );
+	transport.connectReadHandler( [&]( uint32_t connection, const char *data, size_t size ) { received[connection].append( data, size ); } );
+	transport.connectCloseHandler( [&]( uint32_t ) { ++closed; } );
+
+	// Large enough that a frame takes more than one send for some clients.
+	std::string frameMessage = "G|" + std::string( 3000, 'x' ) + "\n";
+	int completeClients = 0;
+	std::thread clients( [&] { completeClients = runClients( frameMessage.size() ); } );
+
+	int frames = 0;
+	uint64_t startSyscalls = transport.getSyscallCount();
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds( 20 );
+	while( ( frames < kFrames || closed < accepted || accepted < kClients ) && std::chrono::steady_clock::now() < deadline ) {
+		transport.submit( true );
+		transport.poll();
+		if( accepted < kClients || frames == kFrames )
+			continue;
+		bool ready = true;
+		for( uint32_t connection = 0; connection < kClients && ready; ++connection )
+			ready = std::count( received[connection].begin(), received[connection].end(), '\n' ) > frames;
+		if( ready ) {
+			for( uint32_t connection = 0; connection < kClients; ++connection )
+				transport.send( connection, frameMessage );
+			++frames;
+		}
+	}
+	uint64_t syscalls = transport.getSyscallCount() - startSyscalls;
+	clients.join();
+
+	// The multishot receive keeps the socket open past close(), the client only sees the end if it's shut down.
+	std::string goodbye = "Q|bye\n", closeReceived;
+	std::atomic<bool> closeDone( false );
+	bool closedByServer = false;
+	std::thread closing( [&] { closedByServer = readUntilClosed( closeReceived ); closeDone = true; } );
+	int acceptedBefore = accepted;
+	deadline = std::chrono::steady_clock::now() + std::chrono::seconds( 10 );
+	while( accepted == acceptedBefore && std::chrono::steady_clock::now() < deadline ) {
+		transport.submit( true );
+		transport.poll();
+	}
+	if( accepted > acceptedBefore ) {
+		transport.send( lastAccepted, goodbye );
+		transport.close( lastAccepted );
+	}
+	while( ! closeDone && std::chrono::steady_clock::now() < deadline ) {
+		transport.submit();
+		transport.poll();
+		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+	}
+	closing.join();
+	transport.stop();
+
+	int failures = 0;
+	if( frames != kFrames || completeClients != kClients ) {
+		fprintf( stderr, "Released %i frames, %i clients got all of them\n", frames, completeClients );
+		++failures;
+	}
+	if( ! closedByServer || closeReceived != goodbye ) {
+		fprintf( stderr, "The connection the server closed got '%s' and %s\n", closeReceived.c_str(), closedByServer ? "ended" : "didn't end" );
+		++failures;
+	}
+	size_t lines = 0;
+	for( auto & connection : received ) {
+		size_t start = 0, end;
+		for( int frame = 0; ( end = connection.second.find( '\n', start ) ) != std::string::npos; ++frame, ++lines ) {
+			std::string line = connection.second.substr( start, end - start );
+			if( line.compare( line.rfind( '|' ) + 1, std::string::npos, std::to_string( frame ) ) != 0 ) {
+				fprintf( stderr, "Connection %u sent '%s' as line %i\n", connection.first, line.c_str(), frame );
+				++failures;
+				break;
+			}
+			start = end + 1;
+		}
+	}
+	if( lines != static_cast<size_t>( kClients * kFrames ) ) {
+		fprintf( stderr, "Received %zu lines, not %i\n", lines, kClients * kFrames );
+		++failures;
+	}
+	// Waiting takes a syscall as well, some frames need a few. Anything per client would be over 20.
+	if( syscalls > static_cast<uint64_t>( kFrames * 4 ) ) {
+		fprintf( stderr, "%llu syscalls for %i frames\n", (unsigned long long)syscalls, kFrames );
+		++failures;
+	}
+
+	printf( "%i clients, %i frames, %llu syscalls, %d failures\n", kClients, frames, (unsigned long long)syscalls, failures );
+	return failures == 0 ? 0 : 1;
+}
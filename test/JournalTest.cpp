@@ -0,0 +1,74 @@
+//
+//  JournalTest.cpp
+//  Cinder-MPE
+//
+
+/*
+
+ JournalTest:
+ Reads a journal with JournalReader.hpp and prints every record, then the first record
+ after seeking to each frame from 0 to one past the last, for journal_roundtrip.py to
+ compare with what mpe_journal.py reads from the same file:
+
+	record frame kind flags client time payload
+	seek frame: frame payload
+	seek frame: end
+
+ Kinds are printed as their letter and payloads in hex.
+
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "JournalReader.hpp"
+
+namespace {
+
+std::string hex( boost::string_ref payload )
+{
+	static const char *kDigits = "0123456789abcdef";
+	std::string result;
+	for( char c : payload ) {
+		result += kDigits[static_cast<uint8_t>( c ) >> 4];
+		result += kDigits[static_cast<uint8_t>( c ) & 15];
+	}
+	return result;
+}
+
+}
+
+int main( int argc, char **argv )
+{
+	if( argc < 2 ) {
+		fprintf( stderr, "Usage: JournalTest journal\n" );
+		return 1;
+	}
+	std::ifstream file( argv[1], std::ios::binary );
+	std::vector<char> data( ( std::istreambuf_iterator<char>( file ) ), std::istreambuf_iterator<char>() );
+	mpe::JournalReader reader( data.data(), data.size() );
+	if( ! reader.isValid() ) {
+		fprintf( stderr, "%s isn't a journal\n", argv[1] );
+		return 1;
+	}
+
+	mpe::JournalReader::Record record;
+	uint64_t lastFrame = 0;
+	while( reader.next( record ) ) {
+		printf( "record %llu %c %u %u %llu %s\n", (unsigned long long)record.mFrame, record.mKind, record.mFlags, record.mClientId,
+			    (unsigned long long)record.mTime, hex( record.mPayload ).c_str() );
+		lastFrame = record.mFrame > lastFrame ? record.mFrame : lastFrame;
+	}
+
+	for( uint64_t frame = 0; frame <= lastFrame + 1; ++frame ) {
+		reader.seekFrame( frame );
+		if( reader.next( record ) )
+			printf( "seek %llu: %llu %s\n", (unsigned long long)frame, (unsigned long long)record.mFrame, hex( record.mPayload ).c_str() );
+		else
+			printf( "seek %llu: end\n", (unsigned long long)frame );
+	}
+	return 0;
+}
@@ -0,0 +1,109 @@
+//
+//  Lz4Test.cpp
+//  Cinder-MPE
+//
+
+/*
+
+ Lz4Test:
+ Compresses a fixed set of inputs with Lz4.hpp and checks that they decompress to
+ themselves, and from blocks no smaller than lz4DecompressBound() allows. With a file
+ argument it also writes every input with its compressed block, for lz4_roundtrip.py to
+ check against the decoder in mpe_server.py:
+
+	uint32 raw size, uint32 compressed size, raw bytes, compressed bytes, ...
+
+ */
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Lz4.hpp"
+
+namespace {
+
+std::vector<std::vector<uint8_t>> makeCases()
+{
+	std::vector<std::vector<uint8_t>> cases;
+	// Nothing, and sizes around the 12 bytes below which nothing is matched.
+	cases.push_back( {} );
+	for( size_t size : { 1, 4, 5, 11, 12, 13, 16 } )
+		cases.push_back( std::vector<uint8_t>( size, 'a' ) );
+
+	std::mt19937 rand( 1 );
+	for( int i = 0; i < 2000; ++i ) {
+		std::vector<uint8_t> data( rand() % 3000 );
+		if( i % 3 == 0 ) {
+			// Runs longer than 15 + 255 bytes, for the extended lengths.
+			for( size_t k = 0; k < data.size(); ++k )
+				data[k] = static_cast<uint8_t>( ( k / ( 1 + i % 400 ) ) % 5 );
+		}
+		else {
+			// Small alphabets match often, large ones leave long literal runs.
+			uint32_t alphabet = 1 + rand() % ( i % 2 ? 20 : 256 );
+			for( auto & byte : data )
+				byte = static_cast<uint8_t>( rand() % alphabet );
+		}
+		cases.push_back( data );
+	}
+
+	// The kind of text apps sync.
+	std::string json;
+	for( int i = 0; i < 200; ++i )
+		json += "{\"id\":" + std::to_string( i ) + ",\"x\":0.5,\"y\":1.25},";
+	cases.push_back( std::vector<uint8_t>( json.begin(), json.end() ) );
+	// As compressible as it gets, for lz4DecompressBound().
+	cases.push_back( std::vector<uint8_t>( 1 << 20, 0 ) );
+	return cases;
+}
+
+void writeSize( FILE *file, size_t size )
+{
+	uint8_t bytes[4] = { uint8_t( size ), uint8_t( size >> 8 ), uint8_t( size >> 16 ), uint8_t( size >> 24 ) };
+	fwrite( bytes, 1, 4, file );
+}
+
+}
+
+int main( int argc, char **argv )
+{
+	FILE *file = nullptr;
+	if( argc > 1 && ! ( file = fopen( argv[1], "wb" ) ) ) {
+		fprintf( stderr, "Can't write %s\n", argv[1] );
+		return 1;
+	}
+
+	int failures = 0;
+	auto cases = makeCases();
+	for( size_t i = 0; i < cases.size(); ++i ) {
+		const auto & raw = cases[i];
+		std::vector<uint8_t> compressed( mpe::lz4CompressBound( raw.size() ) );
+		size_t compressedSize = mpe::lz4Compress( raw.data(), raw.size(), compressed.data() );
+		compressed.resize( compressedSize );
+
+		std::vector<uint8_t> decompressed( raw.size() );
+		size_t size = mpe::lz4Decompress( compressed.data(), compressed.size(), decompressed.data(), raw.size() );
+		if( size != raw.size() || decompressed != raw ) {
+			fprintf( stderr, "Case %zu, %zu bytes, doesn't decompress to itself\n", i, raw.size() );
+			++failures;
+		}
+		if( raw.size() > mpe::lz4DecompressBound( compressedSize ) ) {
+			fprintf( stderr, "Case %zu, %zu bytes, compresses past lz4DecompressBound() to %zu\n", i, raw.size(), compressedSize );
+			++failures;
+		}
+
+		if( file ) {
+			writeSize( file, raw.size() );
+			writeSize( file, compressed.size() );
+			fwrite( raw.data(), 1, raw.size(), file );
+			fwrite( compressed.data(), 1, compressed.size(), file );
+		}
+	}
+
+	if( file )
+		fclose( file );
+	printf( "%zu cases, %d failed\n", cases.size(), failures );
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,104 @@
+#!/usr/bin/python3
+
+# Checks that JournalReader.hpp reads journals written by mpe_journal.py the same way its own
+# reader does: the same records, and the same first record after seeking to every frame. Covers
+# a closed journal, one of a server that crashed while writing it and one cut off mid-record.
+#
+# Format:
+# journal_roundtrip.py path/to/JournalTest path/to/repo
+
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+def writeRecords(writer, first, last):
+    for frame in range(first, last + 1):
+        writer.beginFrame()
+        time = 1000 + frame * 16667
+        if frame % 4 == 0:
+            # Frames nobody sent anything in.
+            continue
+        for client_id in range(3):
+            writer.append(mpe_journal.KIND_OUTBOUND, 0, client_id, time, b"G|%i|0,x\n" % frame)
+            writer.append(mpe_journal.KIND_INBOUND, 0, client_id, time + client_id, b"D|%i|%i\n" % (client_id, frame))
+        if frame % 3 == 0:
+            writer.append(mpe_journal.KIND_OUTBOUND, mpe_journal.FLAG_BULK_LANE, 1, time + 5, b"C|0|%i|0|3|\xff\x00a\n" % frame)
+            writer.append(mpe_journal.KIND_INBOUND, 0, mpe_journal.NO_CLIENT, time + 6, b"S|4|late")
+
+def expected(path):
+    # What JournalTest prints for the journal at path, read with mpe_journal.py.
+    reader = mpe_journal.JournalReader(path)
+    lines = []
+    last = 0
+    for record in reader.records():
+        payload = bytes(record.payload)
+        if payload.endswith(b"\n"):
+            payload = payload[:-1]
+        lines.append("record %i %c %i %i %i %s" % (record.frame, record.kind, record.flags, record.client_id,
+                                                   record.time, payload.hex()))
+        last = max(last, record.frame)
+    for frame in range(last + 2):
+        record = reader.recordAt(reader.seek(frame))
+        if record is None:
+            lines.append("seek %i: end" % frame)
+        else:
+            payload = bytes(record.payload)
+            if payload.endswith(b"\n"):
+                payload = payload[:-1]
+            lines.append("seek %i: %i %s" % (frame, record.frame, payload.hex()))
+    reader.close()
+    return lines
+
+def main():
+    global mpe_journal
+    journal_test, repo = sys.argv[1], sys.argv[2]
+    sys.path.insert(0, repo)
+    import mpe_journal
+
+    failures = 0
+    with tempfile.TemporaryDirectory() as directory:
+        paths = []
+        closed = os.path.join(directory, "closed.mpej")
+        writer = mpe_journal.JournalWriter(closed, 1000, index_interval=3, grow_by=4096)
+        writer.append(mpe_journal.KIND_INBOUND, 0, mpe_journal.NO_CLIENT, 1000, b"S|0|A\n")
+        writeRecords(writer, 1, 20)
+        writer.close()
+        paths.append(closed)
+
+        # A server that crashed leaves the journal at the size of the map, with frames after
+        # the last index block.
+        crashed = os.path.join(directory, "crashed.mpej")
+        writer = mpe_journal.JournalWriter(crashed, 1000, index_interval=4, grow_by=4096)
+        writeRecords(writer, 1, 13)
+        writer.map.flush()
+        paths.append(crashed)
+
+        # And one whose last record didn't make it to the disk.
+        cut = os.path.join(directory, "cut.mpej")
+        shutil.copyfile(crashed, cut)
+        with open(cut, "r+b") as f:
+            f.truncate(writer.used - 3)
+        paths.append(cut)
+
+        for path in paths:
+            want = expected(path)
+            got = subprocess.check_output([journal_test, path]).decode("utf_8").splitlines()
+            name = os.path.basename(path)
+            if got != want:
+                failures += 1
+                for line, (a, b) in enumerate(zip(want, got)):
+                    if a != b:
+                        print("ERROR: %s differs at line %i: mpe_journal.py has '%s', JournalReader.hpp '%s'" % (name, line, a, b))
+                        break
+                else:
+                    print("ERROR: %s has %i lines from mpe_journal.py and %i from JournalReader.hpp" % (name, len(want), len(got)))
+            else:
+                print("%s: %i lines agree" % (name, len(want)))
+        writer.close()
+
+    return 0 if failures == 0 else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
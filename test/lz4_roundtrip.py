@@ -0,0 +1,61 @@
+#!/usr/bin/python3
+
+# Checks that blocks compressed by Lz4.hpp decode with lz4Decompress in mpe_server.py, so the
+# two can't drift apart. Runs Lz4Test to write the cases.
+#
+# Format:
+# lz4_roundtrip.py path/to/Lz4Test path/to/mpe_server.py
+
+import ast
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+def loadFunction(path, name):
+    # Importing mpe_server.py would parse the test's arguments and need Twisted, so only the
+    # function is compiled.
+    with open(path) as f:
+        tree = ast.parse(f.read(), path)
+    for node in tree.body:
+        if isinstance(node, ast.FunctionDef) and node.name == name:
+            namespace = {}
+            exec(compile(ast.Module(body=[node], type_ignores=[]), path, "exec"), namespace)
+            return namespace[name]
+    raise LookupError("%s has no function %s" % (path, name))
+
+def main():
+    lz4_test, server = sys.argv[1], sys.argv[2]
+    lz4Decompress = loadFunction(server, "lz4Decompress")
+
+    with tempfile.TemporaryDirectory() as directory:
+        cases_path = os.path.join(directory, "lz4_cases.bin")
+        subprocess.check_call([lz4_test, cases_path])
+        with open(cases_path, "rb") as f:
+            data = f.read()
+
+    count = 0
+    failures = 0
+    i = 0
+    while i < len(data):
+        raw_size, compressed_size = struct.unpack_from("<II", data, i)
+        i += 8
+        raw = data[i:i + raw_size]
+        i += raw_size
+        compressed = data[i:i + compressed_size]
+        i += compressed_size
+        try:
+            if lz4Decompress(compressed, raw_size) != raw:
+                print("ERROR: Case %i, %i bytes, decodes to something else" % (count, raw_size))
+                failures += 1
+        except (ValueError, IndexError) as e:
+            print("ERROR: Case %i, %i bytes, doesn't decode: %s" % (count, raw_size, e))
+            failures += 1
+        count += 1
+
+    print("%i cases decoded by mpe_server.py, %i failed" % (count, failures))
+    return 0 if failures == 0 and count > 0 else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
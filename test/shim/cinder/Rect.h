@@ -0,0 +1,20 @@
+//
+//  Rect.h
+//  Cinder-MPE tests
+//
+
+#pragma once
+
+#include "cinder/Vector.h"
+
+// Stands in for the Cinder header when the tests are built without Cinder.
+
+namespace cinder {
+
+struct Rectf {
+	Rectf() : x1( 0 ), y1( 0 ), x2( 0 ), y2( 0 ) {}
+	Rectf( float x1, float y1, float x2, float y2 ) : x1( x1 ), y1( y1 ), x2( x2 ), y2( y2 ) {}
+	float x1, y1, x2, y2;
+};
+
+}
@@ -0,0 +1,27 @@
+//
+//  Vector.h
+//  Cinder-MPE tests
+//
+
+#pragma once
+
+// Stands in for the Cinder header when the tests are built without Cinder. Only what
+// the tested headers use: float vectors with their components laid out in order.
+
+namespace cinder {
+
+struct vec2 {
+	vec2() : x( 0 ), y( 0 ) {}
+	vec2( float x, float y ) : x( x ), y( y ) {}
+	float x, y;
+};
+
+struct vec3 {
+	vec3() : x( 0 ), y( 0 ), z( 0 ) {}
+	vec3( float x, float y, float z ) : x( x ), y( y ), z( z ) {}
+	float x, y, z;
+};
+
+}
+
+namespace ci = cinder;